@@ -1,5 +1,5 @@
 #define _FILE_OFFSET_BITS 64
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -10,113 +10,25 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
+#include "minivsfs.h"
+#include "crc32.h"
+#include "stats.h"
 
-#pragma pack(push,1)
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    uint32_t checksum;
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode must be 128 bytes");
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;
-    uint8_t type;
-    char name[58];
-    uint8_t checksum;
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t) == 64, "dirent must be 64 bytes");
-
-/* Simple CRC32 implementation (table) */
-static uint32_t CRC32_TAB[256];
-static void crc32_init(void) {
-    for (uint32_t i = 0; i < 256; ++i) {
-        uint32_t c = i;
-        for (int j = 0; j < 8; ++j)
-            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
-        CRC32_TAB[i] = c;
-    }
-}
-static uint32_t crc32(const void *data, size_t n) {
-    const uint8_t *p = (const uint8_t *)data;
-    uint32_t c = 0xFFFFFFFFu;
-    for (size_t i = 0; i < n; ++i) c = CRC32_TAB[(c ^ p[i]) & 0xFF] ^ (c >> 8);
-    return c ^ 0xFFFFFFFFu;
-}
+/* Hard limits of the format: --size-kib and --inodes beyond these are rejected */
+#define MAX_SIZE_KIB (1ull << 34)  /* 2^32 blocks: block numbers are 32-bit */
+#define MAX_INODES (1ull << 22)
 
-/* Superblock CRC over struct bytes before checksum field */
-static void superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *)sb, offsetof(superblock_t, checksum));
-    sb->checksum = s;
-}
-
-/* Inode CRC: zero crc area and compute over first 120 bytes */
-static void inode_crc_finalize(inode_t *ino) {
-    uint8_t tmp[INODE_SIZE];
-    memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
-}
+/* --journal without a size: 4 MiB, but never more than a quarter of the image */
+#define DEFAULT_JOURNAL_BLOCKS 1024u
+#define MAX_JOURNAL_BLOCKS (1u << 18)
 
-/* Dirent checksum: XOR of first 63 bytes */
-static void dirent_checksum_finalize(dirent64_t *d) {
-    const uint8_t *p = (const uint8_t *)d;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; ++i) x ^= p[i];
-    d->checksum = x;
-}
-
-static void print_usage(const char *prog) {
-    fprintf(stderr, "Usage: %s --image <file> --size-kib <size> --inodes <count>\n", prog);
-    fprintf(stderr, "  --image: output image filename\n");
-    fprintf(stderr, "  --size-kib: size in KiB (180-4096, multiple of 4)\n");
-    fprintf(stderr, "  --inodes: number of inodes (128-512)\n");
-}
+/* --dedup without a size: room for about two index entries per block of the image */
+#define MAX_DEDUP_BLOCKS (1u << 18)
 
 /* Helper: write `count` bytes of zero to file stream in chunks */
 static int write_zeros_in_chunks(FILE *f, uint64_t count) {
@@ -134,31 +46,349 @@ static int write_zeros_in_chunks(FILE *f, uint64_t count) {
     return 0;
 }
 
+/* How the zero-filled parts of the image reach the disk */
+enum fill_mode {
+    FILL_DENSE,    /* write every zero byte (portable, fully allocated) */
+    FILL_SPARSE,   /* skip zero blocks and set the length with ftruncate: holes cost no I/O or space */
+    FILL_PREALLOC  /* fallocate the whole image up front, then skip zero blocks: contiguous unwritten extents */
+};
+
+/*
+ * Write `bytes` of metadata at the current position. In the sparse and
+ * preallocated modes all-zero blocks are seeked over instead of written,
+ * since they already read back as zeros.
+ */
+static int write_region(FILE *f, const uint8_t *buf, uint64_t bytes, enum fill_mode mode) {
+    if (mode == FILL_DENSE) return fwrite(buf, 1, bytes, f) == bytes ? 0 : -1;
+    for (uint64_t off = 0; off < bytes; off += BS) {
+        size_t n = bytes - off < BS ? (size_t)(bytes - off) : BS;
+        size_t z = 0;
+        while (z < n && buf[off + z] == 0) ++z;
+        if (z == n) {
+            if (fseeko(f, (off_t)n, SEEK_CUR) != 0) return -1;
+        } else if (fwrite(buf + off, 1, n, f) != n) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void set_bit(uint8_t *bm, uint64_t idx) { bm[idx >> 3] |= (1u << (idx & 7)); }
+
+/* Where everything goes; derived from the size and inode count alone */
+typedef struct {
+    uint64_t total_blocks;
+    uint64_t gdt_start, gdt_blocks;
+    uint64_t journal_start, journal_blocks;
+    uint64_t dedup_start, dedup_blocks;
+    uint64_t ib_start, ib_blocks;
+    uint64_t db_start, db_blocks;
+    uint64_t it_start, it_blocks;
+    uint64_t data_start, data_blocks;
+    uint64_t groups, inodes_per_group;
+} layout_t;
+
+static uint64_t div_up(uint64_t a, uint64_t b) { return (a + b - 1) / b; }
+
+/*
+ * Images whose bitmaps fit one block each get the original layout
+ * (superblock, inode bitmap, data bitmap, inode table, data). Larger ones
+ * get a group descriptor table after the superblock and as many bitmap
+ * blocks as needed; the data bitmap size and the descriptor table depend
+ * on each other, so iterate to the fixed point. A journal needs the
+ * version 2 superblock, so journaled images always get the group layout,
+ * with the journal right after the descriptor table; the same goes for the
+ * dedup index, which follows the journal.
+ */
+static int compute_layout(layout_t *l, uint64_t total_blocks, uint64_t inodes, uint64_t journal_blocks, uint64_t dedup_blocks) {
+    memset(l, 0, sizeof(*l));
+    l->total_blocks = total_blocks;
+    l->journal_blocks = journal_blocks;
+    l->dedup_blocks = dedup_blocks;
+    l->ib_blocks = div_up(inodes, BITS_PER_BLOCK);
+    l->it_blocks = div_up(inodes * INODE_SIZE, BS);
+    for (int iter = 0; iter < 8; ++iter) {
+        uint64_t fixed = 1 + l->gdt_blocks + l->journal_blocks + l->dedup_blocks + l->ib_blocks + l->it_blocks;
+        if (fixed + 2 > total_blocks) return -1; /* need a data bitmap block and a data block */
+        uint64_t rem = total_blocks - fixed;
+        l->db_blocks = div_up(rem, BITS_PER_BLOCK + 1);
+        l->data_blocks = rem - l->db_blocks;
+        l->groups = div_up(l->data_blocks, BITS_PER_BLOCK);
+        uint64_t gdt = (l->groups > 1 || l->ib_blocks > 1 || journal_blocks || dedup_blocks) ? div_up(l->groups, GROUP_DESCS_PER_BLOCK) : 0;
+        if (gdt == l->gdt_blocks) break;
+        l->gdt_blocks = gdt;
+    }
+    l->inodes_per_group = div_up(div_up(inodes, l->groups), 64) * 64;
+    l->gdt_start = 1;
+    l->journal_start = l->gdt_start + l->gdt_blocks;
+    l->dedup_start = l->journal_start + l->journal_blocks;
+    l->ib_start = l->dedup_start + l->dedup_blocks;
+    l->db_start = l->ib_start + l->ib_blocks;
+    l->it_start = l->db_start + l->db_blocks;
+    l->data_start = l->it_start + l->it_blocks;
+    return 0;
+}
+
+/* Bitmap block `blk` of a bitmap whose first `used` bits are set */
+static void fill_prefix_bitmap(uint8_t *buf, uint64_t blk, uint64_t used) {
+    memset(buf, 0, BS);
+    uint64_t lo = blk * BITS_PER_BLOCK;
+    if (used <= lo) return;
+    uint64_t n = used - lo < BITS_PER_BLOCK ? used - lo : BITS_PER_BLOCK;
+    memset(buf, 0xFF, n / 8);
+    for (uint64_t i = n & ~7ull; i < n; ++i) set_bit(buf, i);
+}
+
+/* Free objects of [lo, lo+len) when the first `used` objects are allocated */
+static uint32_t free_after_prefix(uint64_t lo, uint64_t len, uint64_t used) {
+    if (used <= lo) return (uint32_t)len;
+    if (used >= lo + len) return 0;
+    return (uint32_t)(lo + len - used);
+}
+
+/* Parse a decimal count; anything malformed becomes 0, which the range checks reject */
+static uint64_t parse_u64(const char *s) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s || *end != '\0' || *s == '-') return 0;
+    return (uint64_t)v;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --image <file> --size-kib <size> --inodes <count> [--from-dir <dir> | --manifest <list>]\n", prog);
+    fprintf(stderr, "  --image: output image filename\n");
+    fprintf(stderr, "  --size-kib: size in KiB (180-17179869184, multiple of 4)\n");
+    fprintf(stderr, "  --inodes: number of inodes (128-4194304)\n");
+    fprintf(stderr, "  --from-dir: populate the root directory with the regular files in <dir>\n");
+    fprintf(stderr, "  --manifest: populate the root directory with the files listed in <list>, one per line\n");
+    fprintf(stderr, "  --sparse: leave zero regions as holes (constant-time creation, no space used)\n");
+    fprintf(stderr, "  --preallocate: reserve the whole image with fallocate and skip writing zeros\n");
+    fprintf(stderr, "  --journal[=blocks]: reserve a metadata journal for crash-safe in-place updates (%u-%u blocks, default %u)\n",
+            JOURNAL_MIN_BLOCKS, MAX_JOURNAL_BLOCKS, DEFAULT_JOURNAL_BLOCKS);
+    fprintf(stderr, "  --dedup[=blocks]: reserve a dedup index for mkfs_adder --dedup (a power of two up to %u blocks, default ~1/128 of the image)\n",
+            MAX_DEDUP_BLOCKS);
+    fprintf(stderr, "  --stats[=json]: print per-phase timings and I/O counters to stderr\n");
+}
+
+/* A file to be laid out in the image at build time */
+typedef struct {
+    char *path;           /* where to read it from */
+    char name[MAX_NAME];  /* root directory entry name */
+    uint64_t size;
+    uint64_t nblocks;     /* 0 for files stored inline in their inode */
+    uint64_t first_block; /* absolute; files are laid out back to back */
+} src_file_t;
+
+typedef struct {
+    src_file_t *v;
+    size_t n, cap;
+} src_list_t;
+
+static int src_push(src_list_t *l, const char *path, const char *name) {
+    if (l->n == l->cap) {
+        size_t nc = l->cap ? l->cap * 2 : 16;
+        src_file_t *nv = realloc(l->v, nc * sizeof(*nv));
+        if (!nv) { perror("realloc"); return -1; }
+        l->v = nv;
+        l->cap = nc;
+    }
+    src_file_t *f = &l->v[l->n];
+    memset(f, 0, sizeof(*f));
+    if (!(f->path = strdup(path))) { perror("strdup"); return -1; }
+    mvfs_name_set(f->name, name);
+
+    struct stat st;
+    if (stat(path, &st) != 0) { perror(path); free(f->path); return -1; }
+    if (!S_ISREG(st.st_mode)) { fprintf(stderr, "Not a regular file: %s\n", path); free(f->path); return -1; }
+    f->size = (uint64_t)st.st_size;
+    f->nblocks = f->size <= INLINE_DATA_MAX ? 0 : (f->size + BS - 1) / BS;
+    l->n++;
+    return 0;
+}
+
+static int src_cmp(const void *a, const void *b) {
+    return strcmp(((const src_file_t *)a)->name, ((const src_file_t *)b)->name);
+}
+
+/* Collect the regular files directly inside `dir`, sorted by name for reproducible images */
+static int src_from_dir(src_list_t *l, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) { perror(dir); return -1; }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) {
+            fprintf(stderr, "Path too long: %s/%s\n", dir, de->d_name);
+            closedir(d);
+            return -1;
+        }
+        struct stat st;
+        if (stat(path, &st) != 0) { perror(path); closedir(d); return -1; }
+        if (!S_ISREG(st.st_mode)) continue; /* only the root directory exists in MiniVSFS */
+        if (src_push(l, path, de->d_name) != 0) { closedir(d); return -1; }
+    }
+    closedir(d);
+    qsort(l->v, l->n, sizeof(*l->v), src_cmp);
+    return 0;
+}
+
+/* Collect the files named in `list` (one path per line, '#' comments); entries keep their base name */
+static int src_from_manifest(src_list_t *l, const char *list) {
+    FILE *mf = fopen(list, "r");
+    if (!mf) { perror(list); return -1; }
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_cap, mf)) != -1) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+        const char *base = strrchr(line, '/');
+        base = base ? base + 1 : line;
+        if (*base == '\0') { fprintf(stderr, "Manifest entry has no file name: %s\n", line); free(line); fclose(mf); return -1; }
+        if (src_push(l, line, base) != 0) { free(line); fclose(mf); return -1; }
+    }
+    free(line);
+    fclose(mf);
+    return 0;
+}
+
+/* Slots free for files in bucket b: "." and ".." take the first two of bucket 0 */
+static uint64_t bucket_slots(uint64_t b) { return b == 0 ? BS / DIRENT_SIZE - 2 : BS / DIRENT_SIZE; }
+
+/*
+ * Pick the smallest power-of-two bucket count that holds every file, and
+ * order the files by bucket (list order within one). start[b] .. start[b+1]
+ * index `order` for bucket b. One bucket is the classic single-block root.
+ * Returns the bucket count, or 0 on duplicate names or too many collisions.
+ */
+static uint64_t plan_root_buckets(const src_list_t *l, size_t *order, uint64_t **start_out) {
+    uint32_t *hash = malloc((l->n ? l->n : 1) * sizeof(*hash));
+    if (!hash) { perror("malloc"); return 0; }
+    for (size_t f = 0; f < l->n; ++f) hash[f] = mvfs_name_hash(l->v[f].name);
+
+    uint64_t nb = 1, *start = NULL;
+    for (;;) {
+        if (!(start = calloc(nb + 1, sizeof(*start)))) { perror("calloc"); free(hash); return 0; }
+        int fits = 1;
+        for (size_t f = 0; f < l->n; ++f) {
+            uint64_t b = hash[f] & (nb - 1);
+            if (++start[b + 1] > bucket_slots(b)) fits = 0;
+        }
+        if (fits) break;
+        free(start);
+        if (nb == MAX_DIR_BUCKETS) { fprintf(stderr, "Too many files for the root directory\n"); free(hash); return 0; }
+        nb *= 2;
+    }
+    for (uint64_t b = 0; b < nb; ++b) start[b + 1] += start[b];
+
+    uint64_t *fill = malloc(nb * sizeof(*fill));
+    if (!fill) { perror("malloc"); free(start); free(hash); return 0; }
+    memcpy(fill, start, nb * sizeof(*fill));
+    for (size_t f = 0; f < l->n; ++f) order[fill[hash[f] & (nb - 1)]++] = f;
+    free(fill);
+    free(hash);
+
+    /* names can only clash within a bucket */
+    for (uint64_t b = 0; b < nb; ++b)
+        for (uint64_t i = start[b]; i < start[b + 1]; ++i)
+            for (uint64_t j = start[b]; j < i; ++j)
+                if (strcmp(l->v[order[i]].name, l->v[order[j]].name) == 0) {
+                    fprintf(stderr, "Duplicate file name: %s\n", l->v[order[i]].name);
+                    free(start);
+                    return 0;
+                }
+    *start_out = start;
+    return nb;
+}
+
+/* Stream `f` into the image at the current position, zero padding its last block */
+static int write_src_file(FILE *img, const src_file_t *f, uint8_t *buf, size_t buf_sz) {
+    if (f->nblocks == 0) return 0; /* empty, or inline in its inode */
+    FILE *in = fopen(f->path, "rb");
+    if (!in) { perror(f->path); return -1; }
+    uint64_t left = f->size;
+    while (left > 0) {
+        size_t want = left > buf_sz ? buf_sz : (size_t)left;
+        if (fread(buf, 1, want, in) != want) {
+            fprintf(stderr, "Short read from %s (file changed while building?)\n", f->path);
+            fclose(in);
+            return -1;
+        }
+        if (fwrite(buf, 1, want, img) != want) { perror("write file data"); fclose(in); return -1; }
+        left -= want;
+    }
+    fclose(in);
+    uint64_t pad = f->nblocks * BS - f->size;
+    return write_zeros_in_chunks(img, pad);
+}
+
 int main(int argc, char *argv[]) {
+    uint64_t t0 = stats_now();
     crc32_init();
 
     char *image_name = NULL;
-    int size_kib = 0;
-    int inodes = 0;
+    uint64_t size_kib = 0;
+    uint64_t inodes = 0;
+    char *from_dir = NULL;
+    char *manifest = NULL;
+    enum fill_mode fill = FILL_DENSE;
+    uint64_t journal_blocks = 0;
+    int journal = 0;
+    uint64_t dedup_blocks = 0;
+    int dedup = 0;
+    int want_stats = 0, stats_json = 0;
 
     static struct option long_options[] = {
         {"image", required_argument, 0, 'i'},
         {"size-kib", required_argument, 0, 's'},
         {"inodes", required_argument, 0, 'n'},
+        {"from-dir", required_argument, 0, 'd'},
+        {"manifest", required_argument, 0, 'm'},
+        {"sparse", no_argument, 0, 'S'},
+        {"preallocate", no_argument, 0, 'P'},
+        {"journal", optional_argument, 0, 'J'},
+        {"dedup", optional_argument, 0, 'D'},
+        {"stats", optional_argument, 0, 'T'},
         {0,0,0,0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "i:s:n:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:s:n:d:m:SP", long_options, NULL)) != -1) {
         switch (opt) {
             case 'i': image_name = optarg; break;
-            case 's': size_kib = atoi(optarg); break;
-            case 'n': inodes = atoi(optarg); break;
+            case 's': size_kib = parse_u64(optarg); break;
+            case 'n': inodes = parse_u64(optarg); break;
+            case 'd': from_dir = optarg; break;
+            case 'm': manifest = optarg; break;
+            case 'S': fill = FILL_SPARSE; break;
+            case 'P': fill = FILL_PREALLOC; break;
+            case 'J':
+                journal = 1;
+                if (optarg && ((journal_blocks = parse_u64(optarg)) < JOURNAL_MIN_BLOCKS || journal_blocks > MAX_JOURNAL_BLOCKS)) {
+                    fprintf(stderr, "Journal must be %u-%u blocks\n", JOURNAL_MIN_BLOCKS, MAX_JOURNAL_BLOCKS);
+                    return 1;
+                }
+                break;
+            case 'D':
+                dedup = 1;
+                if (optarg && ((dedup_blocks = parse_u64(optarg)) == 0 || dedup_blocks > MAX_DEDUP_BLOCKS ||
+                               (dedup_blocks & (dedup_blocks - 1)))) {
+                    fprintf(stderr, "Dedup index must be a power of two up to %u blocks\n", MAX_DEDUP_BLOCKS);
+                    return 1;
+                }
+                break;
+            case 'T':
+                want_stats = 1;
+                if (optarg && strcmp(optarg, "json") != 0) { print_usage(argv[0]); return 1; }
+                stats_json = optarg != NULL;
+                break;
             default: print_usage(argv[0]); return 1;
         }
     }
 
-    if (!image_name || size_kib < 180 || size_kib > 4096 || inodes < 128 || inodes > 512) {
+    if (!image_name || size_kib < 180 || size_kib > MAX_SIZE_KIB || inodes < 128 || inodes > MAX_INODES) {
         fprintf(stderr, "Invalid parameters\n");
         print_usage(argv[0]);
         return 1;
@@ -167,44 +397,87 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Size must be a multiple of 4\n");
         return 1;
     }
+    if (from_dir && manifest) {
+        fprintf(stderr, "--from-dir and --manifest are mutually exclusive\n");
+        return 1;
+    }
+    if (want_stats) stats_start(t0);
+    stats_enter(PH_ALLOC);
 
-    uint64_t total_blocks = (uint64_t)size_kib * 1024ULL / BS;
-    uint64_t inode_table_blocks = (inodes * INODE_SIZE + BS - 1) / BS;
-    uint64_t inode_table_bytes = inode_table_blocks * (uint64_t)BS;
+    uint64_t total_blocks = size_kib * 1024ULL / BS;
     uint64_t total_bytes = total_blocks * (uint64_t)BS;
+    if (journal && journal_blocks == 0) {
+        journal_blocks = total_blocks / 4 < DEFAULT_JOURNAL_BLOCKS ? total_blocks / 4 : DEFAULT_JOURNAL_BLOCKS;
+        if (journal_blocks < JOURNAL_MIN_BLOCKS) journal_blocks = JOURNAL_MIN_BLOCKS;
+    }
+    if (dedup && dedup_blocks == 0)
+        for (dedup_blocks = 1; dedup_blocks < div_up(total_blocks, 128) && dedup_blocks < MAX_DEDUP_BLOCKS; dedup_blocks *= 2) {}
 
     /* Validate that we have enough space for the file system structure */
-    if (3 + inode_table_blocks > total_blocks) {
-        fprintf(stderr, "Error: File system too small for %d inodes\n", inodes);
-        fprintf(stderr, "Need at least %lu blocks, but only have %lu blocks\n",
-                3 + inode_table_blocks, total_blocks);
+    layout_t lay;
+    if (compute_layout(&lay, total_blocks, inodes, journal_blocks, dedup_blocks) != 0) {
+        fprintf(stderr, "Error: File system too small for %" PRIu64 " inodes\n", inodes);
+        fprintf(stderr, "Need more than %" PRIu64 " blocks, but only have %" PRIu64 " blocks\n",
+                3 + journal_blocks + dedup_blocks + div_up(inodes * INODE_SIZE, BS), total_blocks);
         return 1;
     }
-
-    uint64_t data_region_blocks = total_blocks - 3 - inode_table_blocks;
-    if (data_region_blocks < 1) {
-        fprintf(stderr, "Error: No space for data blocks\n");
+    uint64_t data_region_blocks = lay.data_blocks;
+
+    /* gather the files to populate the root with and lay them out back to back after the root block */
+    src_list_t files = {0};
+    if (from_dir && src_from_dir(&files, from_dir) != 0) return 1;
+    if (manifest && src_from_manifest(&files, manifest) != 0) return 1;
+
+    /* the root takes one block per bucket; more than one bucket makes it a hashed directory */
+    size_t *order = malloc((files.n ? files.n : 1) * sizeof(*order));
+    if (!order) { perror("malloc"); return 1; }
+    uint64_t *bucket_start = NULL;
+    uint64_t root_blocks = plan_root_buckets(&files, order, &bucket_start);
+    if (root_blocks == 0) return 1;
+
+    uint64_t root_block = lay.data_start;
+    uint64_t next_block = root_block + root_blocks;
+    uint32_t features = lay.gdt_blocks ? SB_FEAT_GROUPS : 0;
+    if (journal_blocks) features |= SB_FEAT_JOURNAL;
+    if (dedup_blocks) features |= SB_FEAT_DEDUP;
+    if (root_blocks > 1) features |= SB_FEAT_HASHDIR;
+    if (root_blocks > 12) features |= SB_FEAT_EXTENTS;
+    for (size_t f = 0; f < files.n; ++f) {
+        files.v[f].first_block = next_block;
+        next_block += files.v[f].nblocks;
+        if (files.v[f].nblocks > 12) features |= SB_FEAT_EXTENTS; /* one extent covers the whole file */
+        if (files.v[f].nblocks == 0 && files.v[f].size > 0) features |= SB_FEAT_INLINE;
+    }
+    if (files.n + 1 > inodes) {
+        fprintf(stderr, "Too many files: %zu (only %" PRIu64 " inodes)\n", files.n, inodes);
         return 1;
     }
+    if (next_block > total_blocks) {
+        fprintf(stderr, "Files need %" PRIu64 " data blocks, only %" PRIu64 " available\n",
+                next_block - root_block, data_region_blocks);
+        return 1;
+    }
+    uint64_t used_inodes = files.n + 1;
+    uint64_t used_blocks = next_block - root_block;
 
     superblock_t sb;
     memset(&sb, 0, sizeof(sb));
-    sb.magic = 0x4D565346u;
-    sb.version = 1u;
+    sb.magic = MVFS_MAGIC;
+    sb.version = lay.gdt_blocks ? SB_VERSION_EXT : 1u;
     sb.block_size = BS;
     sb.total_blocks = total_blocks;
     sb.inode_count = inodes;
-    sb.inode_bitmap_start = 1;
-    sb.inode_bitmap_blocks = 1;
-    sb.data_bitmap_start = 2;
-    sb.data_bitmap_blocks = 1;
-    sb.inode_table_start = 3;
-    sb.inode_table_blocks = inode_table_blocks;
-    sb.data_region_start = 3 + inode_table_blocks;
+    sb.inode_bitmap_start = lay.ib_start;
+    sb.inode_bitmap_blocks = lay.ib_blocks;
+    sb.data_bitmap_start = lay.db_start;
+    sb.data_bitmap_blocks = lay.db_blocks;
+    sb.inode_table_start = lay.it_start;
+    sb.inode_table_blocks = lay.it_blocks;
+    sb.data_region_start = lay.data_start;
     sb.data_region_blocks = data_region_blocks;
     sb.root_inode = ROOT_INO;
     sb.mtime_epoch = (uint64_t)time(NULL);
-    sb.flags = 0;
+    sb.flags = features;
     sb.checksum = 0;
 
     /* finalize checksum over struct (excluding checksum field) */
@@ -214,75 +487,220 @@ int main(int argc, char *argv[]) {
     FILE *img = fopen(image_name, "wb");
     if (!img) { perror("fopen"); return 1; }
 
-    /* write full 4KiB superblock block (struct at front, rest zeros) */
+    if (fill == FILL_PREALLOC && fallocate(fileno(img), 0, 0, (off_t)total_bytes) != 0) {
+        if (errno != EOPNOTSUPP) { perror("fallocate"); fclose(img); return 1; }
+        fprintf(stderr, "Warning: fallocate not supported here, writing zeros instead\n");
+        fill = FILL_DENSE;
+    }
+
+    stats_enter(PH_META_WRITE);
+    /* write full 4KiB superblock block (struct at front, extension if any, rest zeros) */
     uint8_t sb_block[BS];
     memset(sb_block, 0, BS);
     memcpy(sb_block, &sb, sizeof(sb));
+    if (sb.version == SB_VERSION_EXT) {
+        superblock_ext_t sbx;
+        memset(&sbx, 0, sizeof(sbx));
+        sbx.magic = SBX_MAGIC;
+        sbx.size = sizeof(sbx);
+        sbx.group_desc_start = lay.gdt_start;
+        sbx.group_desc_blocks = lay.gdt_blocks;
+        sbx.group_count = lay.groups;
+        sbx.blocks_per_group = BITS_PER_BLOCK;
+        sbx.inodes_per_group = (uint32_t)lay.inodes_per_group;
+        if (lay.journal_blocks) {
+            sbx.journal_start = lay.journal_start;
+            sbx.journal_blocks = lay.journal_blocks;
+        }
+        if (lay.dedup_blocks) {
+            sbx.dedup_start = lay.dedup_start;
+            sbx.dedup_blocks = lay.dedup_blocks;
+        }
+        superblock_ext_crc_finalize(&sbx);
+        memcpy(sb_block + SBX_OFFSET, &sbx, sizeof(sbx));
+    }
     if (fwrite(sb_block, BS, 1, img) != 1) { perror("write sb"); fclose(img); return 1; }
 
-    /* write inode bitmap block (mark inode 1 used) */
-    uint8_t *inode_b = calloc(1, BS);
-    if (!inode_b) { perror("malloc"); fclose(img); return 1; }
-    inode_b[0] = 0x01; /* inode #1 allocated */
-    if (fwrite(inode_b, BS, 1, img) != 1) { perror("write ib"); free(inode_b); fclose(img); return 1; }
-    free(inode_b);
-
-    /* write data bitmap block (mark first data block used for root dir) */
-    uint8_t *data_b = calloc(1, BS);
-    if (!data_b) { perror("malloc"); fclose(img); return 1; }
-    data_b[0] = 0x01; /* first data block in data region allocated */
-    if (fwrite(data_b, BS, 1, img) != 1) { perror("write db"); free(data_b); fclose(img); return 1; }
-    free(data_b);
-
-    /* prepare inode table buffer (zero padded) and initialize root inode */
+    /* metadata goes out one block at a time; everything before the data region is sequential */
+    uint8_t *blk = malloc(BS);
+    if (!blk) { perror("malloc"); fclose(img); return 1; }
+
+    /* group descriptor table: used inodes and blocks are a prefix, so each group's free space is one run */
+    for (uint64_t b = 0; b < lay.gdt_blocks; ++b) {
+        memset(blk, 0, BS);
+        group_desc_t *gd = (group_desc_t *)blk;
+        for (uint64_t i = 0; i < GROUP_DESCS_PER_BLOCK && b * GROUP_DESCS_PER_BLOCK + i < lay.groups; ++i) {
+            uint64_t g = b * GROUP_DESCS_PER_BLOCK + i;
+            uint64_t blo = g * BITS_PER_BLOCK, ilo = g * lay.inodes_per_group;
+            uint64_t blen = data_region_blocks - blo < BITS_PER_BLOCK ? data_region_blocks - blo : BITS_PER_BLOCK;
+            uint64_t ilen = ilo >= inodes ? 0 : (inodes - ilo < lay.inodes_per_group ? inodes - ilo : lay.inodes_per_group);
+            gd[i].free_blocks = free_after_prefix(blo, blen, used_blocks);
+            gd[i].free_inodes = free_after_prefix(ilo, ilen, used_inodes);
+            gd[i].longest_free_run = gd[i].free_blocks;
+            group_desc_crc_finalize(&gd[i]);
+        }
+        if (write_region(img, blk, BS, fill) != 0) { perror("write gdt"); free(blk); fclose(img); return 1; }
+    }
+
+    /* the journal starts out empty (no descriptor magic in its first block), and so does the dedup index */
+    if (lay.journal_blocks || lay.dedup_blocks) {
+        uint8_t *zero = calloc(1, BS);
+        if (!zero) { perror("malloc"); free(blk); fclose(img); return 1; }
+        for (uint64_t b = 0; b < lay.journal_blocks + lay.dedup_blocks; ++b) {
+            if (write_region(img, zero, BS, fill) != 0) { perror("write journal"); free(zero); free(blk); fclose(img); return 1; }
+        }
+        free(zero);
+    }
+
+    /* inode bitmap (inode 1 and one inode per populated file used) */
+    for (uint64_t b = 0; b < lay.ib_blocks; ++b) {
+        fill_prefix_bitmap(blk, b, used_inodes);
+        if (write_region(img, blk, BS, fill) != 0) { perror("write ib"); free(blk); fclose(img); return 1; }
+    }
+
+    /* data bitmap (the root dir block and every file block used) */
+    for (uint64_t b = 0; b < lay.db_blocks; ++b) {
+        fill_prefix_bitmap(blk, b, used_blocks);
+        if (write_region(img, blk, BS, fill) != 0) { perror("write db"); free(blk); fclose(img); return 1; }
+    }
+    free(blk);
+
+    /*
+     * Inode table, in chunks so huge tables never sit in memory whole.
+     * The first chunk holds the root inode and the populated files.
+     */
+    const uint64_t IT_CHUNK_BLOCKS = 256;
+    uint64_t first_chunk = div_up(used_inodes * INODE_SIZE, BS);
+    if (first_chunk < IT_CHUNK_BLOCKS) first_chunk = IT_CHUNK_BLOCKS;
+    if (first_chunk > lay.it_blocks) first_chunk = lay.it_blocks;
+    uint64_t inode_table_bytes = first_chunk * (uint64_t)BS;
     uint8_t *itab = calloc(1, inode_table_bytes);
     if (!itab) { perror("malloc"); fclose(img); return 1; }
 
     inode_t *itable = (inode_t *)itab;
     memset(&itable[0], 0, sizeof(inode_t));
     itable[0].mode = 0x4000; /* directory */
-    itable[0].links = 2;
-    itable[0].size_bytes = 2 * sizeof(dirent64_t);
-    itable[0].atime = itable[0].mtime = itable[0].ctime = (uint64_t)time(NULL);
+    itable[0].links = (uint16_t)(2 + files.n);
+    itable[0].size_bytes = (2 + files.n) * sizeof(dirent64_t);
+    itable[0].atime = itable[0].mtime = itable[0].ctime = sb.mtime_epoch;
     /* root's first data block pointer is absolute block number = data_region_start */
     itable[0].direct[0] = (uint32_t)sb.data_region_start;
+    if (root_blocks > 1) {
+        /* hashed: the size covers every bucket block so linear scanners see them all */
+        itable[0].size_bytes = root_blocks * BS;
+        itable[0].flags = INODE_FL_HASHDIR;
+        if (root_blocks <= 12) {
+            for (uint64_t b = 1; b < root_blocks; ++b) itable[0].direct[b] = (uint32_t)(root_block + b);
+        } else {
+            extent_t ext = { (uint32_t)root_block, (uint32_t)root_blocks };
+            memcpy(itable[0].direct, &ext, sizeof(ext));
+            itable[0].flags |= INODE_FL_EXTENTS;
+        }
+    }
     itable[0].proj_id = 0;
     inode_crc_finalize(&itable[0]);
 
-    if (fwrite(itab, inode_table_bytes, 1, img) != 1) { perror("write it"); free(itab); fclose(img); return 1; }
+    for (size_t f = 0; f < files.n; ++f) {
+        inode_t *ino = &itable[f + 1];
+        ino->mode = 0x8000; /* file */
+        ino->links = 1;
+        ino->size_bytes = files.v[f].size;
+        ino->atime = ino->mtime = ino->ctime = sb.mtime_epoch;
+        if (files.v[f].nblocks == 0 && files.v[f].size > 0) {
+            FILE *in = fopen(files.v[f].path, "rb");
+            if (!in) { perror(files.v[f].path); free(itab); fclose(img); return 1; }
+            size_t got = fread((uint8_t *)ino + INLINE_DATA_OFFSET, 1, (size_t)files.v[f].size, in);
+            fclose(in);
+            if (got != files.v[f].size) {
+                fprintf(stderr, "Short read from %s (file changed while building?)\n", files.v[f].path);
+                free(itab);
+                fclose(img);
+                return 1;
+            }
+            ino->flags = INODE_FL_INLINE;
+        } else if (files.v[f].nblocks <= 12) {
+            for (uint64_t b = 0; b < files.v[f].nblocks; ++b)
+                ino->direct[b] = (uint32_t)(files.v[f].first_block + b);
+        } else {
+            extent_t ext = { (uint32_t)files.v[f].first_block, (uint32_t)files.v[f].nblocks };
+            memcpy(ino->direct, &ext, sizeof(ext));
+            ino->flags = INODE_FL_EXTENTS;
+        }
+        inode_crc_finalize(ino);
+    }
+
+    if (write_region(img, itab, inode_table_bytes, fill) != 0) { perror("write it"); free(itab); fclose(img); return 1; }
+    memset(itab, 0, inode_table_bytes);
+    for (uint64_t done = first_chunk; done < lay.it_blocks; ) {
+        uint64_t n = lay.it_blocks - done < first_chunk ? lay.it_blocks - done : first_chunk;
+        if (write_region(img, itab, n * BS, fill) != 0) { perror("write it"); free(itab); fclose(img); return 1; }
+        done += n;
+    }
     free(itab);
 
-    /* write root directory entries (at start of first data block) */
-    dirent64_t entries[2];
-    memset(entries, 0, sizeof(entries));
-    entries[0].inode_no = 1; entries[0].type = 2;
-    strncpy(entries[0].name, ".", sizeof(entries[0].name)-1);
-    entries[0].name[sizeof(entries[0].name)-1] = '\0';
-    entries[1].inode_no = 1; entries[1].type = 2;
-    strncpy(entries[1].name, "..", sizeof(entries[1].name)-1);
-    entries[1].name[sizeof(entries[1].name)-1] = '\0';
-    dirent_checksum_finalize(&entries[0]);
-    dirent_checksum_finalize(&entries[1]);
-
-    /* seek to absolute first data block and write entries (rest of block remains zero) */
-    off_t data_block_off = (off_t)sb.data_region_start * (off_t)BS;
-    if (fseeko(img, data_block_off, SEEK_SET) != 0) { perror("seek data region"); fclose(img); return 1; }
-    if (fwrite(entries, sizeof(entries), 1, img) != 1) { perror("write entries"); fclose(img); return 1; }
-
-    /* pad the rest of the image with zeros in chunks (avoid single huge allocation) */
-    uint64_t used = ((uint64_t)sb.data_region_start * (uint64_t)BS) + sizeof(entries);
-    if (total_bytes > used) {
-        uint64_t rem = total_bytes - used;
-        /* seek to current position (should already be after entries) to ensure correct location */
-        if (fseeko(img, (off_t)used, SEEK_SET) != 0) { perror("seek pad"); fclose(img); return 1; }
-        if (write_zeros_in_chunks(img, rem) != 0) { perror("write zeros"); fclose(img); return 1; }
+    /* write the root directory: ".", ".." and one entry per populated file, bucket by bucket */
+    uint8_t *root_b = malloc(BS);
+    if (!root_b) { perror("malloc"); fclose(img); return 1; }
+    dirent64_t *entries = (dirent64_t *)root_b;
+    for (uint64_t b = 0; b < root_blocks; ++b) {
+        memset(root_b, 0, BS);
+        size_t e = 0;
+        if (b == 0) {
+            entries[0].inode_no = 1; entries[0].type = 2;
+            strncpy(entries[0].name, ".", sizeof(entries[0].name)-1);
+            entries[0].name[sizeof(entries[0].name)-1] = '\0';
+            entries[1].inode_no = 1; entries[1].type = 2;
+            strncpy(entries[1].name, "..", sizeof(entries[1].name)-1);
+            entries[1].name[sizeof(entries[1].name)-1] = '\0';
+            e = 2;
+        }
+        for (uint64_t i = bucket_start[b]; i < bucket_start[b + 1]; ++i, ++e) {
+            size_t f = order[i];
+            entries[e].inode_no = (uint32_t)(f + 2);
+            entries[e].type = 1;
+            memcpy(entries[e].name, files.v[f].name, MAX_NAME);
+        }
+        for (size_t k = 0; k < e; ++k) dirent_checksum_finalize(&entries[k]);
+
+        /* everything up to here was written in order, so the root blocks are next */
+        if (fwrite(root_b, BS, 1, img) != 1) { perror("write entries"); free(root_b); fclose(img); return 1; }
+    }
+    free(root_b);
+    free(bucket_start);
+    free(order);
+
+    /* stream file data in layout order, then pad the rest of the image with zeros */
+    stats_enter(PH_DATA_WRITE);
+    if (files.n > 0) {
+        const size_t CHUNK = 64 * 1024;
+        uint8_t *buf = malloc(CHUNK);
+        if (!buf) { perror("malloc"); fclose(img); return 1; }
+        for (size_t f = 0; f < files.n; ++f) {
+            if (write_src_file(img, &files.v[f], buf, CHUNK) != 0) { free(buf); fclose(img); return 1; }
+            free(files.v[f].path);
+        }
+        free(buf);
+    }
+    free(files.v);
+
+    uint64_t used = next_block * (uint64_t)BS;
+    if (fill == FILL_DENSE && total_bytes > used) {
+        if (write_zeros_in_chunks(img, total_bytes - used) != 0) { perror("write zeros"); fclose(img); return 1; }
+    }
+    stats_enter(PH_FLUSH);
+    if (fill == FILL_SPARSE) {
+        /* everything past `used` (and any skipped metadata) stays a hole */
+        if (fflush(img) != 0 || ftruncate(fileno(img), (off_t)total_bytes) != 0) { perror("ftruncate"); fclose(img); return 1; }
     }
 
     if (fflush(img) != 0) { perror("fflush"); fclose(img); return 1; }
     if (fclose(img) != 0) { perror("fclose"); return 1; }
 
-    printf("File system image created: %s\nSize: %d KiB, Inodes: %d, Blocks: %" PRIu64 "\n",
+    printf("File system image created: %s\nSize: %" PRIu64 " KiB, Inodes: %" PRIu64 ", Blocks: %" PRIu64 "\n",
            image_name, size_kib, inodes, total_blocks);
     printf("Data region blocks: %" PRIu64 "\n", data_region_blocks);
+    if (lay.gdt_blocks) printf("Block groups: %" PRIu64 "\n", lay.groups);
+    if (files.n > 0) printf("Populated root with %zu files\n", files.n);
+    if (want_stats) stats_print(stderr, "mkfs_builder", stats_json);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,472 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+#include "crc32.h"
+#include "overlay.h"
+
+/* Problems printed in full; past this only the count grows */
+#define MAX_REPORTS 100u
+#define INODE_CHUNK 8192u
+#define MAX_THREADS 256
+
+/*
+ * Everything the passes share. The image is mapped whole, shared and
+ * read-only, and never written; a pending journal transaction is applied
+ * to private copies of the blocks it changes.
+ * `ref` is the reference bitmap of the data region and `nrefs` counts the
+ * dirents naming each inode; the workers update both atomically. On dedup
+ * images `refcnt` counts the references to each data block and `indexed`
+ * marks the blocks with a dedup index entry.
+ */
+typedef struct {
+    const uint8_t *map;
+    size_t len;
+    const superblock_t *sb;
+    superblock_ext_t sbx;
+    int grouped;
+    const uint8_t *ibm, *dbm;
+    const inode_t *itable;
+    uint64_t ngroups, bpg, ipg;
+
+    uint64_t *ref;
+    uint32_t *nrefs;
+    uint32_t *refcnt;
+    uint64_t *indexed;
+    uint32_t *root_blocks;       /* block of each root directory bucket */
+    uint64_t nbuckets;
+    int hashed;
+    uint64_t file_entries;       /* dirents other than "." and ".." */
+
+    uint64_t problems;
+    pthread_mutex_t print_lock;
+    int nthreads;
+} check_t;
+
+static void problem(check_t *c, const char *fmt, ...) {
+    uint64_t n = __atomic_add_fetch(&c->problems, 1, __ATOMIC_RELAXED);
+    if (n > MAX_REPORTS) return;
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&c->print_lock);
+    vprintf(fmt, ap);
+    putchar('\n');
+    if (n == MAX_REPORTS) printf("(further problems are only counted)\n");
+    pthread_mutex_unlock(&c->print_lock);
+    va_end(ap);
+}
+
+/* Set bit i of an atomic bitmap; returns its old value */
+static inline int ref_set(uint64_t *bm, uint64_t i) {
+    uint64_t m = 1ull << (i & 63);
+    return (__atomic_fetch_or(&bm[i >> 6], m, __ATOMIC_RELAXED) & m) != 0;
+}
+
+/*
+ * Run fn over [0, n) in chunks of `chunk`, handed out to the worker
+ * threads from a shared counter so uneven chunks balance out.
+ */
+typedef struct {
+    check_t *c;
+    void (*fn)(check_t *, uint64_t, uint64_t);
+    uint64_t n, chunk, next;
+} job_t;
+
+static void *job_worker(void *arg) {
+    job_t *j = arg;
+    for (;;) {
+        uint64_t lo = __atomic_fetch_add(&j->next, j->chunk, __ATOMIC_RELAXED);
+        if (lo >= j->n) return NULL;
+        j->fn(j->c, lo, lo + j->chunk < j->n ? lo + j->chunk : j->n);
+    }
+}
+
+static void parallel_for(check_t *c, uint64_t n, uint64_t chunk, void (*fn)(check_t *, uint64_t, uint64_t)) {
+    job_t j = { c, fn, n, chunk, 0 };
+    pthread_t th[MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < c->nthreads && (uint64_t)t * chunk < n; ++t)
+        if (pthread_create(&th[started], NULL, job_worker, &j) == 0) ++started;
+    job_worker(&j);
+    for (int t = 0; t < started; ++t) pthread_join(th[t], NULL);
+}
+
+/*
+ * Every block an inode maps, in file order, as runs of absolute blocks.
+ * Reports and returns -1 on a mapping that cannot be followed.
+ */
+static int inode_runs(check_t *c, uint64_t ino_no, const inode_t *ino, extent_t *runs, uint64_t *nruns, uint32_t *ext_block) {
+    uint64_t nblocks = (ino->size_bytes + BS - 1) / BS;
+    *ext_block = 0;
+    *nruns = 0;
+    if (ino->flags & INODE_FL_COMPRESSED) {
+        if (!(c->sb->flags & SB_FEAT_COMPRESS)) { problem(c, "Inode %" PRIu64 ": compressed without the compress feature flag", ino_no); return -1; }
+        if (ino->flags & INODE_FL_INLINE || ino->reserved_0 == 0 || ino->reserved_0 >= nblocks) {
+            problem(c, "Inode %" PRIu64 ": %u compressed blocks for %" PRIu64 " bytes", ino_no, ino->reserved_0, ino->size_bytes);
+            return -1;
+        }
+        nblocks = ino->reserved_0;
+    }
+    if (ino->flags & INODE_FL_INLINE) {
+        if (!(c->sb->flags & SB_FEAT_INLINE)) { problem(c, "Inode %" PRIu64 ": inline data without the inline feature flag", ino_no); return -1; }
+        if (ino->flags & (INODE_FL_EXTENTS | INODE_FL_EXTENT_BLOCK) || ino->size_bytes > INLINE_DATA_MAX) {
+            problem(c, "Inode %" PRIu64 ": %" PRIu64 " bytes of inline data do not fit the inode", ino_no, ino->size_bytes);
+            return -1;
+        }
+        return 0;
+    }
+    /* runs outside the data region are reported block by block when they are claimed */
+    int rc = mvfs_inode_runs(c->map, c->sb, ino, nblocks, runs, nruns, ext_block);
+    if (rc == 0 || rc == MVFS_RUNS_OUTSIDE) return 0;
+    if (rc == MVFS_RUNS_DIRECT) {
+        problem(c, "Inode %" PRIu64 ": %" PRIu64 " bytes do not fit 12 direct blocks", ino_no, ino->size_bytes);
+    } else if (rc == MVFS_RUNS_EXT_BLOCK) {
+        const extent_t *e = (const extent_t *)ino->direct;
+        problem(c, "Inode %" PRIu64 ": bad extent block {%u, %u}", ino_no, e[0].start, e[0].len);
+    } else {
+        uint64_t have = 0;
+        for (uint64_t r = 0; r < *nruns; ++r) have += runs[r].len;
+        problem(c, "Inode %" PRIu64 ": extents map %" PRIu64 " of %" PRIu64 " blocks", ino_no, have, nblocks);
+    }
+    return -1;
+}
+
+/* Decode every unit of a compressed file from its runs, reporting a bad map or unit */
+static void check_compressed(check_t *c, uint64_t ino_no, const inode_t *ino, const extent_t *runs, uint64_t nruns) {
+    uint64_t stream_len = (uint64_t)ino->reserved_0 * BS, units = (ino->size_bytes + COMPRESS_UNIT - 1) / COMPRESS_UNIT;
+    for (uint64_t r = 0; r < nruns; ++r)
+        if ((uint64_t)runs[r].start + runs[r].len > c->sb->data_region_start + c->sb->data_region_blocks) return; /* already reported */
+    uint8_t *stream = malloc(stream_len), *out = malloc(COMPRESS_UNIT);
+    if (!stream || !out) { problem(c, "Inode %" PRIu64 ": out of memory decoding it", ino_no); free(stream); free(out); return; }
+    uint64_t pos = 0;
+    for (uint64_t r = 0; r < nruns; ++r) {
+        memcpy(stream + pos, c->map + (uint64_t)runs[r].start * BS, (uint64_t)runs[r].len * BS);
+        pos += (uint64_t)runs[r].len * BS;
+    }
+    if (units * sizeof(uint32_t) > stream_len) problem(c, "Inode %" PRIu64 ": compressed block map does not fit its blocks", ino_no);
+    for (uint64_t u = 0; units * sizeof(uint32_t) <= stream_len && u < units; ++u) {
+        uint64_t start, end, ulen = ino->size_bytes - u * COMPRESS_UNIT < COMPRESS_UNIT ? ino->size_bytes - u * COMPRESS_UNIT : COMPRESS_UNIT;
+        if (mvfs_unit_span((const uint32_t *)stream, ino->size_bytes, u, stream_len, &start, &end) != 0) {
+            problem(c, "Inode %" PRIu64 ": compressed unit %" PRIu64 " lies outside its stream", ino_no, u);
+            break;
+        }
+        if (mvfs_unit_decode(stream + start, (size_t)(end - start), out, (size_t)ulen) != 0)
+            problem(c, "Inode %" PRIu64 ": compressed unit %" PRIu64 " does not decode", ino_no, u);
+    }
+    free(stream);
+    free(out);
+}
+
+/* Mark a block referenced by inode ino_no, reporting strays and blocks already claimed */
+static void claim(check_t *c, uint64_t ino_no, uint64_t blk) {
+    const superblock_t *sb = c->sb;
+    if (blk < sb->data_region_start || blk >= sb->data_region_start + sb->data_region_blocks) {
+        problem(c, "Inode %" PRIu64 ": block %" PRIu64 " is outside the data region", ino_no, blk);
+        return;
+    }
+    if (c->refcnt) {
+        /* shared blocks are allowed here; check_dedup/check_shared match them against the index */
+        __atomic_add_fetch(&c->refcnt[blk - sb->data_region_start], 1, __ATOMIC_RELAXED);
+        ref_set(c->ref, blk - sb->data_region_start);
+        return;
+    }
+    if (ref_set(c->ref, blk - sb->data_region_start))
+        problem(c, "Block %" PRIu64 " is referenced more than once (again by inode %" PRIu64 ")", blk, ino_no);
+}
+
+/* Pass 1: inode checksums and mappings; fills the reference bitmap */
+static void check_inodes(check_t *c, uint64_t lo, uint64_t hi) {
+    extent_t *runs = malloc(EXTENTS_PER_BLOCK * sizeof(*runs) > 12 * sizeof(*runs) ? EXTENTS_PER_BLOCK * sizeof(*runs) : 12 * sizeof(*runs));
+    if (!runs) { problem(c, "Out of memory checking inodes %" PRIu64 "-%" PRIu64, lo + 1, hi); return; }
+    for (uint64_t i = lo; i < hi; ++i) {
+        const inode_t *ino = &c->itable[i];
+        uint64_t ino_no = i + 1;
+        if (!bitmap_bit(c->ibm, i)) {
+            if (ino->mode != 0 && ino->links != 0)
+                problem(c, "Inode %" PRIu64 ": has mode 0x%x but is free in the inode bitmap", ino_no, ino->mode);
+            continue;
+        }
+        inode_t tmp = *ino;
+        inode_crc_finalize(&tmp);
+        if (tmp.inode_crc != ino->inode_crc) { problem(c, "Inode %" PRIu64 ": bad checksum", ino_no); continue; }
+        if (ino->mode != 0x8000 && ino->mode != 0x4000) { problem(c, "Inode %" PRIu64 ": bad mode 0x%x", ino_no, ino->mode); continue; }
+        if ((ino_no == ROOT_INO) != (ino->mode == 0x4000)) {
+            problem(c, "Inode %" PRIu64 ": %s", ino_no, ino_no == ROOT_INO ? "root is not a directory" : "directory outside the root");
+            continue;
+        }
+        uint64_t nruns;
+        uint32_t ext_block;
+        if (inode_runs(c, ino_no, ino, runs, &nruns, &ext_block) != 0) continue;
+        if (ext_block) claim(c, ino_no, ext_block);
+        for (uint64_t r = 0; r < nruns; ++r)
+            for (uint64_t k = 0; k < runs[r].len; ++k) claim(c, ino_no, (uint64_t)runs[r].start + k);
+        if (ino->flags & INODE_FL_COMPRESSED) check_compressed(c, ino_no, ino, runs, nruns);
+    }
+    free(runs);
+}
+
+/* Pass 2: dirents of the root buckets [lo, hi) */
+static void check_buckets(check_t *c, uint64_t lo, uint64_t hi) {
+    uint64_t entries = 0;
+    for (uint64_t b = lo; b < hi; ++b) {
+        const dirent64_t *d = (const dirent64_t *)(c->map + (uint64_t)c->root_blocks[b] * BS);
+        for (unsigned s = 0; s < BS / DIRENT_SIZE; ++s) {
+            const dirent64_t *e = &d[s];
+            if (e->inode_no == 0) continue;
+            dirent64_t tmp = *e;
+            dirent_checksum_finalize(&tmp);
+            if (tmp.checksum != e->checksum) { problem(c, "Root bucket %" PRIu64 " slot %u: bad dirent checksum", b, s); continue; }
+            if (memchr(e->name, '\0', MAX_NAME) == NULL) { problem(c, "Root bucket %" PRIu64 " slot %u: name is not terminated", b, s); continue; }
+            if (e->inode_no > c->sb->inode_count) {
+                problem(c, "Root entry '%s': inode %u is out of range", e->name, e->inode_no);
+                continue;
+            }
+            int dot = strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0;
+            if (dot) {
+                if (b != 0 || s > 1 || e->inode_no != ROOT_INO || e->type != 2) problem(c, "Root entry '%s' is misplaced", e->name);
+            } else {
+                ++entries;
+                if (e->type != 1) problem(c, "Root entry '%s': bad type %u", e->name, e->type);
+                if (c->hashed && (mvfs_name_hash(e->name) & (c->nbuckets - 1)) != b)
+                    problem(c, "Root entry '%s' is in bucket %" PRIu64 ", expected %" PRIu32, e->name, b,
+                            mvfs_name_hash(e->name) & (uint32_t)(c->nbuckets - 1));
+                for (unsigned k = 0; k < s; ++k)
+                    if (d[k].inode_no != 0 && strncmp(d[k].name, e->name, MAX_NAME) == 0)
+                        problem(c, "Root entry '%s' appears twice", e->name);
+            }
+            __atomic_add_fetch(&c->nrefs[e->inode_no - 1], 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_add_fetch(&c->file_entries, entries, __ATOMIC_RELAXED);
+}
+
+/* Pass 3: link counts against the dirents that name each inode */
+static void check_links(check_t *c, uint64_t lo, uint64_t hi) {
+    for (uint64_t i = lo; i < hi; ++i) {
+        uint32_t n = c->nrefs[i];
+        if (!bitmap_bit(c->ibm, i)) {
+            if (n) problem(c, "Inode %" PRIu64 ": named by %u dirents but free in the inode bitmap", i + 1, n);
+            continue;
+        }
+        const inode_t *ino = &c->itable[i];
+        if (i + 1 == ROOT_INO) {
+            /* the root counts ".", ".." and one link per file it holds */
+            if (ino->links != c->file_entries + 2)
+                problem(c, "Inode 1: link count %u, root holds %" PRIu64 " files", ino->links, c->file_entries);
+            continue;
+        }
+        if (n == 0) problem(c, "Inode %" PRIu64 ": allocated but not in any directory", i + 1);
+        else if (ino->links != n) problem(c, "Inode %" PRIu64 ": link count %u, named by %u dirents", i + 1, ino->links, n);
+    }
+}
+
+/* Pass 4: each group's bitmaps against the references and its descriptor */
+static void check_groups(check_t *c, uint64_t lo, uint64_t hi) {
+    const superblock_t *sb = c->sb;
+    for (uint64_t g = lo; g < hi; ++g) {
+        uint64_t blo = g * c->bpg, bhi = blo + c->bpg < sb->data_region_blocks ? blo + c->bpg : sb->data_region_blocks;
+        uint64_t free_blocks = 0, run = 0, longest = 0, leaked = 0, unmarked = 0, first_leak = 0, first_unmarked = 0;
+        for (uint64_t b = blo; b < bhi; ++b) {
+            int used = bitmap_bit(c->dbm, b), refd = (c->ref[b >> 6] >> (b & 63)) & 1;
+            if (used && !refd && leaked++ == 0) first_leak = b;
+            if (!used && refd && unmarked++ == 0) first_unmarked = b;
+            if (used) { run = 0; continue; }
+            ++free_blocks;
+            if (++run > longest) longest = run;
+        }
+        if (leaked) problem(c, "Group %" PRIu64 ": %" PRIu64 " blocks marked used but unreferenced (first %" PRIu64 ")",
+                            g, leaked, sb->data_region_start + first_leak);
+        if (unmarked) problem(c, "Group %" PRIu64 ": %" PRIu64 " referenced blocks marked free (first %" PRIu64 ")",
+                              g, unmarked, sb->data_region_start + first_unmarked);
+        if (!c->grouped) continue;
+
+        uint64_t ilo = g * c->ipg, ihi = ilo + c->ipg < sb->inode_count ? ilo + c->ipg : sb->inode_count, free_inodes = 0;
+        for (uint64_t i = ilo; i < ihi; ++i) free_inodes += !bitmap_bit(c->ibm, i);
+        group_desc_t gd;
+        memcpy(&gd, c->map + c->sbx.group_desc_start * BS + g * sizeof(gd), sizeof(gd));
+        group_desc_t want = gd;
+        group_desc_crc_finalize(&want);
+        if (want.checksum != gd.checksum) { problem(c, "Group %" PRIu64 ": bad descriptor checksum", g); continue; }
+        if (gd.free_blocks != free_blocks || gd.free_inodes != free_inodes || gd.longest_free_run != longest)
+            problem(c, "Group %" PRIu64 ": descriptor says %u/%u/%u free blocks/inodes/longest run, bitmaps say %" PRIu64 "/%" PRIu64 "/%" PRIu64,
+                    g, gd.free_blocks, gd.free_inodes, gd.longest_free_run, free_blocks, free_inodes, longest);
+    }
+}
+
+/* Pass 5 (dedup images): index buckets [lo, hi) against the blocks and their reference counts */
+static void check_dedup(check_t *c, uint64_t lo, uint64_t hi) {
+    const superblock_t *sb = c->sb;
+    for (uint64_t b = lo; b < hi; ++b) {
+        const dedup_entry_t *e = (const dedup_entry_t *)(c->map + (c->sbx.dedup_start + b) * BS);
+        for (unsigned s = 0; s < DEDUP_ENTRIES_PER_BLOCK; ++s) {
+            if (e[s].blk == 0) continue;
+            uint64_t blk = e[s].blk;
+            if (blk < sb->data_region_start || blk >= sb->data_region_start + sb->data_region_blocks) {
+                problem(c, "Dedup bucket %" PRIu64 " slot %u: block %" PRIu64 " is outside the data region", b, s, blk);
+                continue;
+            }
+            uint64_t d = blk - sb->data_region_start;
+            if (ref_set(c->indexed, d)) problem(c, "Dedup index: block %" PRIu64 " has more than one entry", blk);
+            if ((e[s].fp & (c->sbx.dedup_blocks - 1)) != b)
+                problem(c, "Dedup index: entry for block %" PRIu64 " is in bucket %" PRIu64 ", expected %" PRIu64,
+                        blk, b, e[s].fp & (c->sbx.dedup_blocks - 1));
+            if (e[s].refs != c->refcnt[d])
+                problem(c, "Dedup index: block %" PRIu64 " has %u references recorded, %u found", blk, e[s].refs, c->refcnt[d]);
+            else if (mvfs_block_fp(c->map + blk * BS) != e[s].fp)
+                problem(c, "Dedup index: block %" PRIu64 " does not match its fingerprint", blk);
+        }
+    }
+}
+
+/* Pass 6 (dedup images): a data block referenced more than once needs an index entry counting it */
+static void check_shared(check_t *c, uint64_t lo, uint64_t hi) {
+    for (uint64_t d = lo; d < hi; ++d)
+        if (c->refcnt[d] > 1 && !((c->indexed[d >> 6] >> (d & 63)) & 1))
+            problem(c, "Block %" PRIu64 " is referenced %u times but has no dedup index entry",
+                    c->sb->data_region_start + d, c->refcnt[d]);
+}
+
+/* Locate the root's bucket blocks; 0, or -1 if the root cannot be walked */
+static int root_open(check_t *c) {
+    const inode_t *root = &c->itable[ROOT_INO - 1];
+    if (!bitmap_bit(c->ibm, ROOT_INO - 1) || root->mode != 0x4000) { problem(c, "Root inode is not an allocated directory"); return -1; }
+    c->hashed = (root->flags & INODE_FL_HASHDIR) != 0;
+    c->nbuckets = 1;
+    if (c->hashed) {
+        c->nbuckets = root->size_bytes / BS;
+        if (root->size_bytes % BS || c->nbuckets < 2 || c->nbuckets > MAX_DIR_BUCKETS || (c->nbuckets & (c->nbuckets - 1))) {
+            problem(c, "Root directory: bad hashed size %" PRIu64, root->size_bytes);
+            return -1;
+        }
+    }
+    extent_t *runs = malloc(EXTENTS_PER_BLOCK * sizeof(*runs));
+    c->root_blocks = malloc(c->nbuckets * sizeof(*c->root_blocks));
+    if (!runs || !c->root_blocks) { perror("malloc"); free(runs); return -1; }
+    uint64_t nruns, n = 0;
+    uint32_t ext_block;
+    inode_t sized = *root;
+    if (!c->hashed) sized.size_bytes = BS; /* a classic root is one block whatever its entry count */
+    int rc = inode_runs(c, ROOT_INO, &sized, runs, &nruns, &ext_block);
+    for (uint64_t r = 0; rc == 0 && r < nruns; ++r)
+        for (uint64_t k = 0; k < runs[r].len && n < c->nbuckets; ++k) c->root_blocks[n++] = runs[r].start + (uint32_t)k;
+    free(runs);
+    if (rc != 0) return -1;
+    for (uint64_t b = 0; b < n; ++b) {
+        if (c->root_blocks[b] < c->sb->data_region_start || c->root_blocks[b] >= c->sb->data_region_start + c->sb->data_region_blocks) {
+            problem(c, "Root directory: bucket %" PRIu64 " is outside the data region", b);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void print_usage(const char *p) {
+    fprintf(stderr, "Usage: %s --image <img> [--threads <n>]\n", p);
+    fprintf(stderr, "  --threads: worker threads (default: one per online CPU, at most %d)\n", MAX_THREADS);
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    char *image_name = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    static struct option long_opts[] = {
+        {"image", required_argument, 0, 'i'},
+        {"threads", required_argument, 0, 't'},
+        {0,0,0,0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:t:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i': image_name = optarg; break;
+            case 't': {
+                char *end;
+                threads = strtol(optarg, &end, 10);
+                if (*end || threads < 1) { print_usage(argv[0]); return 1; }
+                break;
+            }
+            default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (!image_name) { print_usage(argv[0]); return 1; }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    /* the image (or overlay chain) mapped read-only; blocks a pending journal transaction changes become private copies */
+    ovl_t *img = ovl_open(image_name, 0);
+    if (!img) return 1;
+    uint8_t *map = img->view;
+    if (mvfs_validate(map, (off_t)img->len) != 0) { ovl_close(img); return 1; }
+    if (img->depth > 0) printf("Checking the image as read through %d overlay%s\n", img->depth, img->depth == 1 ? "" : "s");
+
+    check_t c;
+    memset(&c, 0, sizeof(c));
+    pthread_mutex_init(&c.print_lock, NULL);
+    c.nthreads = (int)threads;
+    c.len = (size_t)((const superblock_t *)map)->total_blocks * BS;
+    int replayed = mvfs_journal_apply(map, c.len, ovl_private, img);
+    if (replayed < 0) return 1;
+    if (replayed) printf("Applied the committed journal transaction (in memory only)\n");
+    if (replayed && mvfs_validate(map, (off_t)img->len) != 0) return 1;
+
+    c.map = map;
+    c.sb = (const superblock_t *)map;
+    superblock_t sbc = *c.sb;
+    superblock_crc_finalize(&sbc);
+    if (sbc.checksum != c.sb->checksum) problem(&c, "Superblock: bad checksum");
+    c.grouped = c.sb->version == SB_VERSION_EXT;
+    if (c.grouped) memcpy(&c.sbx, map + SBX_OFFSET, sizeof(c.sbx));
+    c.ngroups = c.grouped ? c.sbx.group_count : 1;
+    c.bpg = c.grouped ? c.sbx.blocks_per_group : c.sb->data_region_blocks;
+    c.ipg = c.grouped ? c.sbx.inodes_per_group : c.sb->inode_count;
+    c.ibm = map + c.sb->inode_bitmap_start * BS;
+    c.dbm = map + c.sb->data_bitmap_start * BS;
+    c.itable = (const inode_t *)(map + c.sb->inode_table_start * BS);
+    c.ref = calloc((c.sb->data_region_blocks + 63) / 64, sizeof(*c.ref));
+    c.nrefs = calloc(c.sb->inode_count, sizeof(*c.nrefs));
+    if (!c.ref || !c.nrefs) { perror("calloc"); return 1; }
+    if (c.sb->flags & SB_FEAT_DEDUP) {
+        c.refcnt = calloc(c.sb->data_region_blocks, sizeof(*c.refcnt));
+        c.indexed = calloc((c.sb->data_region_blocks + 63) / 64, sizeof(*c.indexed));
+        if (!c.refcnt || !c.indexed) { perror("calloc"); return 1; }
+    }
+
+    parallel_for(&c, c.sb->inode_count, INODE_CHUNK, check_inodes);
+    if (root_open(&c) == 0) {
+        parallel_for(&c, c.nbuckets, 16, check_buckets);
+        parallel_for(&c, c.sb->inode_count, INODE_CHUNK, check_links);
+    }
+    parallel_for(&c, c.ngroups, 1, check_groups);
+    if (c.refcnt) {
+        parallel_for(&c, c.sbx.dedup_blocks, 16, check_dedup);
+        parallel_for(&c, c.sb->data_region_blocks, 1u << 16, check_shared);
+    }
+
+    printf("%s: %" PRIu64 " inodes, %" PRIu64 " data blocks, %" PRIu64 " group%s checked with %d thread%s: ",
+           image_name, c.sb->inode_count, c.sb->data_region_blocks, c.ngroups, c.ngroups == 1 ? "" : "s",
+           c.nthreads, c.nthreads == 1 ? "" : "s");
+    if (c.problems == 0) printf("clean\n");
+    else printf("%" PRIu64 " problem%s\n", c.problems, c.problems == 1 ? "" : "s");
+
+    free(c.ref);
+    free(c.nrefs);
+    free(c.refcnt);
+    free(c.indexed);
+    free(c.root_blocks);
+    ovl_close(img);
+    return c.problems ? 1 : 0;
+}
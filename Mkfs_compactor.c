@@ -0,0 +1,382 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+#include "crc32.h"
+#include "fileio.h"
+#include "overlay.h"
+
+#define UNPLACED UINT32_MAX
+#define EXT_SLOT UINT32_MAX   /* order[] entry of a rewritten extent block */
+/* Largest single write of data blocks that were adjacent before and after */
+#define WRITE_BLOCKS 256u
+
+/*
+ * The image is read through a shared, read-only mapping (an overlay
+ * chain's view, or the image itself), with a committed journal transaction
+ * applied first. The metadata it rewrites is remapped as private copies
+ * and rewritten there; data blocks are only read from the mapping. The
+ * new layout puts every inode's blocks, in inode order and file order,
+ * one after another from the start of the data region; an extent block
+ * follows its file's data. A block shared through the dedup index goes
+ * where its first reference puts it. Compaction is offline: the result
+ * is a new file, and nothing else may write the image meanwhile.
+ */
+typedef struct {
+    uint8_t *map;
+    superblock_t *sb;
+    superblock_ext_t sbx;
+    inode_t *itable;
+    uint32_t *newpos;        /* new data-region block of each old one, UNPLACED if nothing maps it */
+    uint32_t *order;         /* old data-region block of each new one, or EXT_SLOT */
+    uint64_t next, limit;    /* blocks placed so far, and room for them */
+    uint8_t *ext;            /* contents of the rewritten extent blocks, in placement order */
+    uint64_t next_ext, ext_cap;
+    uint64_t files, runs_before, runs_after;
+} compact_t;
+
+/* Blocks an inode maps: a classic root is one block whatever its size, a compressed file its stream */
+static uint64_t inode_blocks(const inode_t *ino, uint64_t idx) {
+    if (ino->flags & INODE_FL_INLINE) return 0;
+    if (idx == ROOT_INO - 1 && !(ino->flags & INODE_FL_HASHDIR)) return 1;
+    if (ino->flags & INODE_FL_COMPRESSED) return ino->reserved_0;
+    return (ino->size_bytes + BS - 1) / BS;
+}
+
+/* Give the next free position to a rewritten extent block holding `runs`; its new relative block */
+static int place_ext_block(compact_t *c, const extent_t *runs, uint64_t nruns, uint64_t *at) {
+    if (c->next == c->limit) { fprintf(stderr, "No room for a rewritten extent block\n"); return -1; }
+    if (c->next_ext == c->ext_cap) {
+        uint64_t cap = c->ext_cap ? 2 * c->ext_cap : 16;
+        uint8_t *ext = realloc(c->ext, cap * BS);
+        if (!ext) { perror("malloc"); return -1; }
+        c->ext = ext;
+        c->ext_cap = cap;
+    }
+    uint8_t *blk = c->ext + c->next_ext++ * BS;
+    memset(blk, 0, BS);
+    memcpy(blk, runs, nruns * sizeof(extent_t));
+    *at = c->next;
+    c->order[c->next++] = EXT_SLOT;
+    return 0;
+}
+
+/* Place one inode's blocks after everything placed so far and remap it in the inode table */
+static int place_inode(compact_t *c, uint64_t idx, extent_t *runs, extent_t *out) {
+    inode_t *ino = &c->itable[idx];
+    uint64_t nblocks = inode_blocks(ino, idx), nruns, n = 0, drs = c->sb->data_region_start;
+    if (nblocks == 0) return 0;
+    if (mvfs_inode_runs(c->map, c->sb, ino, nblocks, runs, &nruns, NULL) != 0) {
+        fprintf(stderr, "Inode %" PRIu64 ": bad block mapping\n", idx + 1);
+        return -1;
+    }
+    for (uint64_t r = 0; r < nruns; ++r) {
+        for (uint64_t k = 0; k < runs[r].len; ++k) {
+            uint64_t old = runs[r].start + k - drs;
+            if (c->newpos[old] == UNPLACED) {
+                if (c->next == c->limit) { fprintf(stderr, "No room to lay out inode %" PRIu64 "\n", idx + 1); return -1; }
+                c->order[c->next] = (uint32_t)old;
+                c->newpos[old] = (uint32_t)c->next++;
+            }
+            uint32_t b = (uint32_t)(drs + c->newpos[old]);
+            if (n > 0 && out[n - 1].start + out[n - 1].len == b) { out[n - 1].len++; continue; }
+            if (n == EXTENTS_PER_BLOCK) {
+                fprintf(stderr, "Inode %" PRIu64 ": shared blocks leave it in too many extents\n", idx + 1);
+                return -1;
+            }
+            out[n++] = (extent_t){ b, 1 };
+        }
+    }
+    /* old runs counted the way the new ones are built, adjacent ones merged */
+    uint64_t before = 0;
+    for (uint64_t r = 0; r < nruns; ++r)
+        if (r == 0 || runs[r - 1].start + runs[r - 1].len != runs[r].start) ++before;
+    c->runs_before += before;
+    c->runs_after += n;
+
+    memset(ino->direct, 0, sizeof(ino->direct));
+    ino->flags &= ~(INODE_FL_EXTENTS | INODE_FL_EXTENT_BLOCK);
+    if (nblocks <= 12) {
+        uint64_t b = 0;
+        for (uint64_t r = 0; r < n; ++r)
+            for (uint64_t k = 0; k < out[r].len; ++k) ino->direct[b++] = out[r].start + (uint32_t)k;
+    } else if (n <= INLINE_EXTENTS) {
+        ino->flags |= INODE_FL_EXTENTS;
+        memcpy(ino->direct, out, n * sizeof(extent_t));
+    } else {
+        uint64_t at;
+        if (place_ext_block(c, out, n, &at) != 0) return -1;
+        extent_t head = { (uint32_t)(drs + at), (uint32_t)n };
+        memcpy(ino->direct, &head, sizeof(head));
+        ino->flags |= INODE_FL_EXTENTS | INODE_FL_EXTENT_BLOCK;
+    }
+    inode_crc_finalize(ino);
+    return 0;
+}
+
+/* Point the dedup index at the blocks' new homes; an entry for a block nothing maps any more goes */
+static void remap_dedup(compact_t *c) {
+    uint64_t drs = c->sb->data_region_start;
+    for (uint64_t b = 0; b < c->sbx.dedup_blocks; ++b) {
+        dedup_entry_t *e = (dedup_entry_t *)(c->map + (c->sbx.dedup_start + b) * BS);
+        for (unsigned j = 0; j < DEDUP_ENTRIES_PER_BLOCK; ++j) {
+            if (e[j].blk == 0) continue;
+            uint64_t old = e[j].blk - drs;
+            if (e[j].blk < drs || old >= c->sb->data_region_blocks || c->newpos[old] == UNPLACED) memset(&e[j], 0, sizeof(e[j]));
+            else e[j].blk = (uint32_t)(drs + c->newpos[old]);
+        }
+    }
+}
+
+/*
+ * Rewrite the bitmaps' view of the new layout: the first `used` data
+ * blocks in use, the rest of the (possibly shorter) region free, and
+ * each remaining group's descriptor to match; descriptors of groups past
+ * the new end are cleared.
+ */
+static void rewrite_allocation(compact_t *c, uint64_t region_blocks) {
+    superblock_t *sb = c->sb;
+    uint8_t *dbm = c->map + sb->data_bitmap_start * BS;
+    const uint8_t *ibm = c->map + sb->inode_bitmap_start * BS;
+    memset(dbm, 0, sb->data_bitmap_blocks * BS);
+    memset(dbm, 0xFF, c->next / 8);
+    for (uint64_t b = c->next / 8 * 8; b < c->next; ++b) dbm[b >> 3] |= (uint8_t)(1u << (b & 7));
+    if (sb->version != SB_VERSION_EXT) return;
+
+    uint64_t bpg = c->sbx.blocks_per_group, ipg = c->sbx.inodes_per_group, groups = (region_blocks + bpg - 1) / bpg;
+    group_desc_t *gd = (group_desc_t *)(c->map + c->sbx.group_desc_start * BS);
+    for (uint64_t g = 0; g < c->sbx.group_count; ++g) {
+        memset(&gd[g], 0, sizeof(gd[g]));
+        if (g >= groups) continue;
+        uint64_t blo = g * bpg, bhi = blo + bpg < region_blocks ? blo + bpg : region_blocks;
+        uint64_t used = c->next <= blo ? 0 : (c->next < bhi ? c->next - blo : bhi - blo);
+        uint64_t ilo = g * ipg, ihi = ilo + ipg < sb->inode_count ? ilo + ipg : sb->inode_count, free_inodes = 0;
+        for (uint64_t i = ilo; i < ihi; ++i) free_inodes += !bitmap_bit(ibm, i);
+        /* used blocks all come first, so a group's free blocks are one run */
+        gd[g].free_blocks = gd[g].longest_free_run = (uint32_t)(bhi - blo - used);
+        gd[g].free_inodes = (uint32_t)free_inodes;
+        group_desc_crc_finalize(&gd[g]);
+    }
+    c->sbx.group_count = groups;
+    superblock_ext_crc_finalize(&c->sbx);
+    memcpy(c->map + SBX_OFFSET, &c->sbx, sizeof(c->sbx));
+}
+
+static int all_zero(const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; ++i) if (p[i]) return 0;
+    return 1;
+}
+
+/*
+ * Write the compacted image to a file already sized to it: the metadata
+ * area without its zero blocks or the (now empty) journal, which stay
+ * holes, then the data blocks in their new order. Blocks that were
+ * adjacent before and stay adjacent go out in one write.
+ */
+static int write_image(const compact_t *c, int fd) {
+    const superblock_t *sb = c->sb;
+    uint64_t js = (sb->flags & SB_FEAT_JOURNAL) ? c->sbx.journal_start : 0;
+    uint64_t je = (sb->flags & SB_FEAT_JOURNAL) ? js + c->sbx.journal_blocks : 0;
+    for (uint64_t b = 0; b < sb->data_region_start; ) {
+        if ((b >= js && b < je) || all_zero(c->map + b * BS, BS)) { ++b; continue; }
+        uint64_t e = b + 1;
+        while (e < sb->data_region_start && e - b < WRITE_BLOCKS && !(e >= js && e < je) && !all_zero(c->map + e * BS, BS)) ++e;
+        if (fio_write_full(fd, c->map + b * BS, (size_t)((e - b) * BS), (off_t)(b * BS)) != 0) return -1;
+        b = e;
+    }
+
+    uint64_t drs = sb->data_region_start, x = 0;
+    for (uint64_t i = 0; i < c->next; ) {
+        if (c->order[i] == EXT_SLOT) {
+            if (fio_write_full(fd, c->ext + x++ * BS, BS, (off_t)((drs + i) * BS)) != 0) return -1;
+            ++i;
+            continue;
+        }
+        uint64_t e = i + 1;
+        while (e < c->next && e - i < WRITE_BLOCKS && c->order[e] != EXT_SLOT && c->order[e] == c->order[e - 1] + 1) ++e;
+        if (fio_write_full(fd, c->map + (drs + c->order[i]) * BS, (size_t)((e - i) * BS), (off_t)((drs + i) * BS)) != 0) return -1;
+        i = e;
+    }
+    return 0;
+}
+
+static void print_usage(const char *p) {
+    fprintf(stderr, "Usage: %s --image <img> (--output <out.img> | --in-place) [--shrink[=<free blocks>]]\n", p);
+    fprintf(stderr, "  Rewrites the image with each inode's blocks contiguous, in inode order.\n");
+    fprintf(stderr, "  Compaction is offline: nothing else may use the image until it is done.\n");
+    fprintf(stderr, "  --in-place: replace <img> with the compacted image (written next to it, then renamed over it)\n");
+    fprintf(stderr, "  --shrink: cut the image right after the used blocks, leaving <free blocks> free (default 0)\n");
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    char *image_name = NULL, *output_name = NULL;
+    int in_place = 0, shrink = 0;
+    uint64_t reserve = 0;
+    static struct option long_opts[] = {
+        {"image", required_argument, 0, 'i'},
+        {"output", required_argument, 0, 'o'},
+        {"in-place", no_argument, 0, 'p'},
+        {"shrink", optional_argument, 0, 's'},
+        {0,0,0,0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:o:p", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i': image_name = optarg; break;
+            case 'o': output_name = optarg; break;
+            case 'p': in_place = 1; break;
+            case 's':
+                shrink = 1;
+                if (optarg) {
+                    char *end;
+                    errno = 0;
+                    reserve = strtoull(optarg, &end, 10);
+                    if (errno || *end || optarg[0] == '-') { print_usage(argv[0]); return 1; }
+                }
+                break;
+            default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (!image_name || in_place == (output_name != NULL)) { print_usage(argv[0]); return 1; }
+
+    ovl_t *img = ovl_open(image_name, 0);
+    if (!img) return 1;
+    if (in_place && img->depth > 0) {
+        fprintf(stderr, "%s is an overlay: compact it with --output, which writes a plain image\n", image_name);
+        ovl_close(img);
+        return 1;
+    }
+    compact_t c;
+    memset(&c, 0, sizeof(c));
+    c.map = img->view;
+    if (mvfs_validate(c.map, (off_t)img->len) != 0) { ovl_close(img); return 1; }
+    int replayed = mvfs_journal_apply(c.map, (size_t)((const superblock_t *)c.map)->total_blocks * BS, ovl_private, img);
+    if (replayed < 0 || (replayed && mvfs_validate(c.map, (off_t)img->len) != 0)) { ovl_close(img); return 1; }
+    c.sb = (superblock_t *)c.map;
+    if (c.sb->version == SB_VERSION_EXT) memcpy(&c.sbx, c.map + SBX_OFFSET, sizeof(c.sbx));
+    /* the metadata rewritten below becomes private copies; everything else is only read through the shared mapping */
+    if (ovl_private(img, 0, 1) != 0 || ovl_private(img, c.sb->data_bitmap_start, c.sb->data_bitmap_blocks) != 0 ||
+        ovl_private(img, c.sb->inode_table_start, c.sb->inode_table_blocks) != 0 ||
+        (c.sb->version == SB_VERSION_EXT && ovl_private(img, c.sbx.group_desc_start, c.sbx.group_desc_blocks) != 0) ||
+        ((c.sb->flags & SB_FEAT_DEDUP) && ovl_private(img, c.sbx.dedup_start, c.sbx.dedup_blocks) != 0)) {
+        perror("map image metadata");
+        ovl_close(img);
+        return 1;
+    }
+    c.itable = (inode_t *)(c.map + c.sb->inode_table_start * BS);
+    superblock_t *sb = c.sb;
+    uint64_t old_total = sb->total_blocks, old_region = sb->data_region_blocks, drs = sb->data_region_start;
+
+    /* writing over any file of the chain would destroy the image being read */
+    if (output_name) {
+        struct stat os;
+        if (stat(output_name, &os) == 0) {
+            for (int i = 0; i <= img->depth; ++i) {
+                struct stat ls;
+                if (fstat(img->layers[i].fd, &ls) == 0 && ls.st_dev == os.st_dev && ls.st_ino == os.st_ino) {
+                    fprintf(stderr, "%s is the image being compacted: use --in-place\n", output_name);
+                    ovl_close(img);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    c.newpos = malloc(old_region * sizeof(*c.newpos));
+    c.order = malloc(old_region * sizeof(*c.order));
+    extent_t *runs = malloc(2 * EXTENTS_PER_BLOCK * sizeof(*runs));
+    if (!c.newpos || !c.order || !runs) { perror("malloc"); goto fail; }
+    memset(c.newpos, 0xFF, old_region * sizeof(*c.newpos));
+    c.limit = old_region;
+
+    /* the root first, then every allocated inode in order */
+    const uint8_t *ibm = c.map + sb->inode_bitmap_start * BS;
+    for (uint64_t idx = 0; idx < sb->inode_count; ++idx) {
+        if (!bitmap_bit(ibm, idx) || c.itable[idx].mode == 0) continue;
+        if (place_inode(&c, idx, runs, runs + EXTENTS_PER_BLOCK) != 0) goto fail;
+        if (idx != ROOT_INO - 1) c.files++;
+    }
+    if (sb->flags & SB_FEAT_DEDUP) remap_dedup(&c);
+
+    /* shrinking keeps enough block groups for the inode table's groups */
+    uint64_t region = old_region;
+    if (shrink) {
+        region = c.next + reserve;
+        if (sb->version == SB_VERSION_EXT) {
+            uint64_t need = (sb->inode_count + c.sbx.inodes_per_group - 1) / c.sbx.inodes_per_group;
+            if (region < (need - 1) * c.sbx.blocks_per_group + 1) region = (need - 1) * c.sbx.blocks_per_group + 1;
+        }
+        if (region > old_region) region = old_region;
+    }
+    rewrite_allocation(&c, region);
+    if (shrink) {
+        sb->data_region_blocks = region;
+        sb->total_blocks = drs + region;
+    }
+    superblock_crc_finalize(sb);
+
+    /* --in-place writes a new file beside the image and renames it over the image once it is durable */
+    char *tmp_name = NULL;
+    int out;
+    if (in_place) {
+        struct stat st;
+        if (fstat(img->layers[0].fd, &st) != 0) { perror("stat image"); goto fail; }
+        if (asprintf(&tmp_name, "%s.compact-XXXXXX", image_name) < 0) { tmp_name = NULL; perror("malloc"); goto fail; }
+        out = mkstemp(tmp_name);
+        if (out >= 0 && fchmod(out, st.st_mode & 07777) != 0) { perror("chmod output"); close(out); unlink(tmp_name); goto fail; }
+    } else {
+        out = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (out < 0) { perror("open output"); free(tmp_name); goto fail; }
+    if (ftruncate(out, (off_t)(sb->total_blocks * BS)) != 0 || write_image(&c, out) != 0 || fsync(out) != 0) {
+        perror("write output");
+        close(out);
+        if (tmp_name) unlink(tmp_name);
+        free(tmp_name);
+        goto fail;
+    }
+    if (close(out) != 0) { perror("close output"); if (tmp_name) unlink(tmp_name); free(tmp_name); goto fail; }
+    if (tmp_name) {
+        if (rename(tmp_name, image_name) != 0) { perror("rename output"); unlink(tmp_name); free(tmp_name); goto fail; }
+        char *dir_path = strdup(image_name);
+        int dfd = dir_path ? open(dirname(dir_path), O_RDONLY | O_DIRECTORY) : -1;
+        if (dfd >= 0) { fsync(dfd); close(dfd); }
+        free(dir_path);
+        free(tmp_name);
+    }
+
+    uint64_t moved = 0;
+    for (uint64_t i = 0; i < c.next; ++i) moved += c.order[i] != EXT_SLOT && c.order[i] != i;
+    printf("Compacted %s -> %s: %" PRIu64 " files, %" PRIu64 " of %" PRIu64 " used blocks moved, %" PRIu64 " -> %" PRIu64
+           " extents, %" PRIu64 " -> %" PRIu64 " blocks\n", image_name, in_place ? image_name : output_name, c.files, moved,
+           c.next, c.runs_before, c.runs_after, old_total, sb->total_blocks);
+    free(c.newpos);
+    free(c.order);
+    free(c.ext);
+    free(runs);
+    ovl_close(img);
+    return 0;
+
+fail:
+    free(c.newpos);
+    free(c.order);
+    free(c.ext);
+    free(runs);
+    ovl_close(img);
+    return 1;
+}
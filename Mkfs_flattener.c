@@ -0,0 +1,86 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "fileio.h"
+#include "overlay.h"
+
+static void print_usage(const char *p) {
+    fprintf(stderr, "Usage: %s --image <overlay> --output <out.img>\n", p);
+    fprintf(stderr, "  Writes the image an overlay chain describes as one plain image.\n");
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    char *image_name = NULL, *output_name = NULL;
+    static struct option long_opts[] = {
+        {"image", required_argument, 0, 'i'},
+        {"output", required_argument, 0, 'o'},
+        {0,0,0,0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:o:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i': image_name = optarg; break;
+            case 'o': output_name = optarg; break;
+            default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (!image_name || !output_name) { print_usage(argv[0]); return 1; }
+
+    ovl_t *o = ovl_open(image_name, 0);
+    if (!o) return 1;
+    if (o->depth == 0) { fprintf(stderr, "%s is not an overlay\n", image_name); ovl_close(o); return 1; }
+    if (mvfs_validate(o->view, (off_t)o->len) != 0) { ovl_close(o); return 1; }
+
+    /* truncating a file of the chain would destroy the image being read */
+    struct stat os;
+    if (stat(output_name, &os) == 0) {
+        for (int i = 0; i <= o->depth; ++i) {
+            struct stat ls;
+            if (fstat(o->layers[i].fd, &ls) == 0 && ls.st_dev == os.st_dev && ls.st_ino == os.st_ino) {
+                fprintf(stderr, "%s is part of the overlay chain\n", output_name);
+                ovl_close(o);
+                return 1;
+            }
+        }
+    }
+
+    int out = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) { perror("open output"); ovl_close(o); return 1; }
+    if (fio_clone(o->layers[0].fd, out, (off_t)o->len) != 0) { perror("copy base image"); close(out); ovl_close(o); return 1; }
+
+    /* then every block any overlay holds, as the chain reads it */
+    uint64_t blocks = 0;
+    for (int i = 1; i <= o->depth; ++i) {
+        for (uint64_t r = 0; r < o->layers[i].nruns; ++r) {
+            const ovl_run_t *run = &o->layers[i].runs[r];
+            if (fio_write_full(out, o->view + run->vblk * BS, (size_t)(run->len * BS), (off_t)(run->vblk * BS)) != 0) {
+                perror("write output");
+                close(out);
+                ovl_close(o);
+                return 1;
+            }
+            blocks += run->len;
+        }
+    }
+    if (fsync(out) != 0 || close(out) != 0) { perror("write output"); ovl_close(o); return 1; }
+
+    printf("Flattened %s (%d overlay%s, %" PRIu64 " blocks over %s) into %s\n", image_name, o->depth,
+           o->depth == 1 ? "" : "s", blocks, o->layers[0].path, output_name);
+    ovl_close(o);
+    return 0;
+}
@@ -0,0 +1,345 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "fileio.h"
+#include "overlay.h"
+
+#define MAX_THREADS 256
+/* Largest single copy_file_range/sendfile request */
+#define COPY_CHUNK (1u << 30)
+
+/*
+ * The image is mapped whole, shared and read-only, but only its metadata
+ * is read through the mapping; a pending journal transaction is applied
+ * to private copies of the blocks it changes. File data is never
+ * journaled, so it is copied straight from the image descriptor into the
+ * destination by the kernel, without passing through this process.
+ * Compressed files are the exception: they are decoded from the mapping.
+ * So is everything read through an overlay chain, whose blocks are spread
+ * over several files: fd is then -1 and data is written from the mapping.
+ */
+typedef struct {
+    int fd;
+    const uint8_t *map;
+    size_t len;
+    const superblock_t *sb;
+    const inode_t *itable;
+} image_t;
+
+typedef struct {
+    uint32_t ino;
+    char name[MAX_NAME];
+} entry_t;
+
+/*
+ * Every block an inode maps, in file order, as runs of absolute blocks
+ * inside the data region; -1 if the mapping cannot be followed.
+ */
+static int inode_runs(const image_t *im, const inode_t *ino, extent_t *runs, uint64_t *nruns) {
+    uint64_t nblocks = (ino->flags & INODE_FL_COMPRESSED) ? ino->reserved_0 : (ino->size_bytes + BS - 1) / BS;
+    *nruns = 0;
+    if (ino->flags & INODE_FL_INLINE) return ino->size_bytes <= INLINE_DATA_MAX ? 0 : -1;
+    return mvfs_inode_runs(im->map, im->sb, ino, nblocks, runs, nruns, NULL) == 0 ? 0 : -1;
+}
+
+/* The files in the root directory; count in *n, NULL (with a message) on failure */
+static entry_t *root_entries(const image_t *im, uint64_t *n) {
+    const inode_t *root = &im->itable[ROOT_INO - 1];
+    if (root->mode != 0x4000) { fprintf(stderr, "Root inode is not a directory\n"); return NULL; }
+    inode_t sized = *root;
+    if (!(root->flags & INODE_FL_HASHDIR)) sized.size_bytes = BS; /* a classic root is one block whatever its entry count */
+    else if (root->size_bytes % BS || root->size_bytes / BS > MAX_DIR_BUCKETS) {
+        fprintf(stderr, "Root directory: bad hashed size %" PRIu64 "\n", root->size_bytes);
+        return NULL;
+    }
+    extent_t *runs = malloc(EXTENTS_PER_BLOCK * sizeof(*runs));
+    if (!runs) { perror("malloc"); return NULL; }
+    uint64_t nruns, cap = 64;
+    entry_t *out = NULL;
+    if (inode_runs(im, &sized, runs, &nruns) != 0) { fprintf(stderr, "Root directory: bad block mapping\n"); goto fail; }
+    out = malloc(cap * sizeof(*out));
+    if (!out) { perror("malloc"); goto fail; }
+    *n = 0;
+    for (uint64_t r = 0; r < nruns; ++r) {
+        for (uint64_t k = 0; k < runs[r].len; ++k) {
+            const dirent64_t *d = (const dirent64_t *)(im->map + ((uint64_t)runs[r].start + k) * BS);
+            for (unsigned s = 0; s < BS / DIRENT_SIZE; ++s) {
+                if (d[s].inode_no == 0 || d[s].type != 1) continue;
+                if (d[s].inode_no > im->sb->inode_count || memchr(d[s].name, '\0', MAX_NAME) == NULL) {
+                    fprintf(stderr, "Skipping a damaged root entry\n");
+                    continue;
+                }
+                if (*n == cap) {
+                    entry_t *grown = realloc(out, 2 * cap * sizeof(*out));
+                    if (!grown) { perror("realloc"); goto fail; }
+                    out = grown;
+                    cap *= 2;
+                }
+                out[*n].ino = d[s].inode_no;
+                memcpy(out[*n].name, d[s].name, MAX_NAME);
+                ++*n;
+            }
+        }
+    }
+    free(runs);
+    return out;
+fail:
+    free(runs);
+    free(out);
+    return NULL;
+}
+
+/*
+ * Move `len` bytes at image offset `off` to out_fd's current position:
+ * copy_file_range() where both ends allow it (it can share extents on
+ * filesystems that reflink), sendfile() to pipes, sockets and anything
+ * else, and plain pread/write only if neither is supported.
+ */
+static int copy_out(int img_fd, int out_fd, uint64_t off, uint64_t len, int *use_cfr, int *use_sendfile) {
+    loff_t pos = (loff_t)off;
+    while (len > 0) {
+        size_t want = len < COPY_CHUNK ? (size_t)len : COPY_CHUNK;
+        ssize_t n = -1;
+        if (*use_cfr) {
+            n = copy_file_range(img_fd, &pos, out_fd, NULL, want, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+                *use_cfr = 0;
+                continue;
+            }
+        } else if (*use_sendfile) {
+            off_t soff = (off_t)pos;
+            n = sendfile(out_fd, img_fd, &soff, want);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) { *use_sendfile = 0; continue; }
+            if (n > 0) pos = soff;
+        } else {
+            char buf[BS * 16];
+            n = pread(img_fd, buf, want < sizeof(buf) ? want : sizeof(buf), pos);
+            if (n > 0 && fio_write_all(out_fd, buf, (size_t)n) != 0) return -1;
+            if (n > 0) pos += n;
+        }
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        if (n == 0) { errno = EIO; return -1; } /* the image ends inside the file */
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+/* Decode a compressed file into out_fd, gathering its stream from the mapping first; 0, or -1 with a message */
+static int decode_out(const image_t *im, const inode_t *ino, const extent_t *runs, uint64_t nruns, const char *name, int out_fd) {
+    uint64_t stream_len = (uint64_t)ino->reserved_0 * BS, units = (ino->size_bytes + COMPRESS_UNIT - 1) / COMPRESS_UNIT;
+    uint8_t *stream = malloc(stream_len), *out = malloc(COMPRESS_UNIT);
+    if (!stream || !out) { perror("malloc"); free(stream); free(out); return -1; }
+    uint64_t pos = 0;
+    for (uint64_t r = 0; r < nruns; ++r) {
+        memcpy(stream + pos, im->map + (uint64_t)runs[r].start * BS, (uint64_t)runs[r].len * BS);
+        pos += (uint64_t)runs[r].len * BS;
+    }
+    const uint32_t *map = (const uint32_t *)stream;
+    int rc = units * sizeof(uint32_t) <= stream_len ? 0 : -1;
+    for (uint64_t u = 0; rc == 0 && u < units; ++u) {
+        uint64_t start, end, ulen = ino->size_bytes - u * COMPRESS_UNIT < COMPRESS_UNIT ? ino->size_bytes - u * COMPRESS_UNIT : COMPRESS_UNIT;
+        if (mvfs_unit_span(map, ino->size_bytes, u, stream_len, &start, &end) != 0 ||
+            mvfs_unit_decode(stream + start, (size_t)(end - start), out, (size_t)ulen) != 0) { rc = -1; break; }
+        if (fio_write_all(out_fd, out, (size_t)ulen) != 0) {
+            fprintf(stderr, "'%s': %s\n", name, strerror(errno));
+            free(stream);
+            free(out);
+            return -1;
+        }
+    }
+    if (rc != 0) fprintf(stderr, "'%s': corrupt compressed data\n", name);
+    free(stream);
+    free(out);
+    return rc;
+}
+
+/* Stream inode ino_no's size_bytes to out_fd; 0, or -1 with a message */
+static int stream_file(const image_t *im, uint32_t ino_no, const char *name, int out_fd) {
+    const inode_t *ino = &im->itable[ino_no - 1];
+    inode_t tmp = *ino;
+    inode_crc_finalize(&tmp);
+    if (tmp.inode_crc != ino->inode_crc || ino->mode != 0x8000) {
+        fprintf(stderr, "'%s': inode %u is damaged\n", name, ino_no);
+        return -1;
+    }
+    extent_t *runs = malloc(EXTENTS_PER_BLOCK * sizeof(*runs));
+    if (!runs) { perror("malloc"); return -1; }
+    uint64_t nruns;
+    int rc = inode_runs(im, ino, runs, &nruns);
+    if (rc != 0) fprintf(stderr, "'%s': inode %u has a bad block mapping\n", name, ino_no);
+    /* inline data lives in the (possibly journal-patched) mapping, not at a file offset to copy from */
+    if (rc == 0 && (ino->flags & INODE_FL_INLINE) &&
+        fio_write_all(out_fd, (const uint8_t *)ino + INLINE_DATA_OFFSET, ino->size_bytes) != 0) {
+        fprintf(stderr, "'%s': %s\n", name, strerror(errno));
+        rc = -1;
+    }
+    if (rc == 0 && (ino->flags & INODE_FL_COMPRESSED)) rc = decode_out(im, ino, runs, nruns, name, out_fd);
+    int use_cfr = 1, use_sendfile = 1;
+    uint64_t left = (ino->flags & (INODE_FL_INLINE | INODE_FL_COMPRESSED)) ? 0 : ino->size_bytes;
+    for (uint64_t r = 0; rc == 0 && r < nruns && left > 0; ++r) {
+        uint64_t n = (uint64_t)runs[r].len * BS;
+        if (n > left) n = left; /* the last block only holds the file's tail */
+        if (im->fd >= 0) rc = copy_out(im->fd, out_fd, (uint64_t)runs[r].start * BS, n, &use_cfr, &use_sendfile);
+        else rc = fio_write_all(out_fd, im->map + (uint64_t)runs[r].start * BS, (size_t)n);
+        if (rc != 0) fprintf(stderr, "'%s': %s\n", name, strerror(errno));
+        left -= n;
+    }
+    free(runs);
+    return rc;
+}
+
+/* Export workers take the next entry from a shared counter */
+typedef struct {
+    const image_t *im;
+    const entry_t *ents;
+    uint64_t n, next;
+    int dir_fd;
+    uint64_t failed, bytes;
+} export_t;
+
+static void *export_worker(void *arg) {
+    export_t *x = arg;
+    for (;;) {
+        uint64_t i = __atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED);
+        if (i >= x->n) return NULL;
+        const entry_t *e = &x->ents[i];
+        char name[MAX_NAME];
+        memcpy(name, e->name, sizeof(name));
+        /* names come from the image; keep them inside the destination directory */
+        for (char *p = name; *p; ++p) if (*p == '/') *p = '_';
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || name[0] == '\0') name[0] = '_';
+        int out = openat(x->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            fprintf(stderr, "'%s': %s\n", name, strerror(errno));
+            __atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        int rc = stream_file(x->im, e->ino, e->name, out);
+        if (close(out) != 0 && rc == 0) { fprintf(stderr, "'%s': %s\n", name, strerror(errno)); rc = -1; }
+        if (rc != 0) __atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+        else __atomic_add_fetch(&x->bytes, x->im->itable[e->ino - 1].size_bytes, __ATOMIC_RELAXED);
+    }
+}
+
+static void print_usage(const char *p) {
+    fprintf(stderr, "Usage: %s --image <img> --ls\n", p);
+    fprintf(stderr, "       %s --image <img> --cat <name> [--output <file>]\n", p);
+    fprintf(stderr, "       %s --image <img> --export <dir> [--threads <n>]\n", p);
+    fprintf(stderr, "  --cat: write the file to stdout, or to --output\n");
+    fprintf(stderr, "  --export: write every file in the root directory into <dir>\n");
+    fprintf(stderr, "  --threads: export workers (default: one per online CPU, at most %d)\n", MAX_THREADS);
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    char *image_name = NULL, *cat_name = NULL, *output = NULL, *export_dir = NULL;
+    int list = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    static struct option long_opts[] = {
+        {"image", required_argument, 0, 'i'},
+        {"ls", no_argument, 0, 'l'},
+        {"cat", required_argument, 0, 'c'},
+        {"output", required_argument, 0, 'o'},
+        {"export", required_argument, 0, 'e'},
+        {"threads", required_argument, 0, 't'},
+        {0,0,0,0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:lc:o:e:t:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i': image_name = optarg; break;
+            case 'l': list = 1; break;
+            case 'c': cat_name = optarg; break;
+            case 'o': output = optarg; break;
+            case 'e': export_dir = optarg; break;
+            case 't': {
+                char *end;
+                threads = strtol(optarg, &end, 10);
+                if (*end || threads < 1) { print_usage(argv[0]); return 1; }
+                break;
+            }
+            default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (!image_name || list + (cat_name != NULL) + (export_dir != NULL) != 1 || (output && !cat_name)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    image_t im;
+    ovl_t *img = ovl_open(image_name, 0);
+    if (!img) return 1;
+    uint8_t *map = img->view;
+    if (mvfs_validate(map, (off_t)img->len) != 0) { ovl_close(img); return 1; }
+    im.fd = img->depth == 0 ? img->layers[0].fd : -1;
+    im.len = (size_t)((const superblock_t *)map)->total_blocks * BS;
+    int replayed = mvfs_journal_apply(map, im.len, ovl_private, img);
+    if (replayed < 0 || (replayed && mvfs_validate(map, (off_t)img->len) != 0)) { ovl_close(img); return 1; }
+    im.map = map;
+    im.sb = (const superblock_t *)map;
+    im.itable = (const inode_t *)(map + im.sb->inode_table_start * BS);
+
+    uint64_t n;
+    entry_t *ents = root_entries(&im, &n);
+    if (!ents) { ovl_close(img); return 1; }
+
+    int rc = 0;
+    if (list) {
+        for (uint64_t i = 0; i < n; ++i)
+            printf("%8u %12" PRIu64 " %s\n", ents[i].ino, im.itable[ents[i].ino - 1].size_bytes, ents[i].name);
+    } else if (cat_name) {
+        char key[MAX_NAME];
+        mvfs_name_set(key, cat_name); /* a long name matches the entry it was cut to */
+        uint64_t i = 0;
+        while (i < n && strncmp(ents[i].name, key, MAX_NAME) != 0) ++i;
+        if (i == n) {
+            fprintf(stderr, "'%s' is not in the root directory\n", cat_name);
+            rc = 1;
+        } else {
+            int out = output ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+            if (out < 0) { perror("open output"); rc = 1; }
+            else {
+                if (stream_file(&im, ents[i].ino, ents[i].name, out) != 0) rc = 1;
+                if (output && close(out) != 0) { perror("close output"); rc = 1; }
+            }
+        }
+    } else {
+        mkdir(export_dir, 0755);
+        export_t x = { &im, ents, n, 0, open(export_dir, O_RDONLY | O_DIRECTORY), 0, 0 };
+        if (x.dir_fd < 0) { perror("open export directory"); rc = 1; }
+        else {
+            pthread_t th[MAX_THREADS];
+            int started = 0;
+            for (int t = 1; t < threads && (uint64_t)t < n; ++t)
+                if (pthread_create(&th[started], NULL, export_worker, &x) == 0) ++started;
+            export_worker(&x);
+            for (int t = 0; t < started; ++t) pthread_join(th[t], NULL);
+            close(x.dir_fd);
+            printf("Exported %" PRIu64 " of %" PRIu64 " files (%" PRIu64 " bytes) to %s\n",
+                   n - x.failed, n, x.bytes, export_dir);
+            if (x.failed) rc = 1;
+        }
+    }
+
+    free(ents);
+    ovl_close(img);
+    return rc;
+}
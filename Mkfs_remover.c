@@ -0,0 +1,138 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+
+/* One change to make: remove `name`, or with truncate set, cut it down to `size` bytes */
+typedef struct {
+    char *name;
+    int truncate;
+    uint64_t size;
+} op_t;
+
+static int add_op(op_t **ops, size_t *count, size_t *cap, const char *name, int truncate, uint64_t size) {
+    if (*count == *cap) {
+        size_t nc = *cap ? *cap * 2 : 16;
+        op_t *no = realloc(*ops, nc * sizeof(*no));
+        if (!no) { perror("realloc"); return -1; }
+        *ops = no;
+        *cap = nc;
+    }
+    op_t *o = &(*ops)[*count];
+    if (!(o->name = strdup(name))) { perror("strdup"); return -1; }
+    o->truncate = truncate;
+    o->size = size;
+    ++*count;
+    return 0;
+}
+
+/* Queue a removal for each file named in `path` (one per line, '#' comments) */
+static int read_manifest(const char *path, op_t **ops, size_t *count, size_t *cap) {
+    FILE *mf = fopen(path, "r");
+    if (!mf) { perror("open manifest"); return -1; }
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_cap, mf)) != -1) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+        if (add_op(ops, count, cap, line, 0, 0) != 0) { free(line); fclose(mf); return -1; }
+    }
+    free(line);
+    fclose(mf);
+    return 0;
+}
+
+/* "<name>=<bytes>", split at the last '=' so names may contain one */
+static int parse_truncate(const char *arg, op_t **ops, size_t *count, size_t *cap) {
+    const char *eq = strrchr(arg, '=');
+    if (!eq || eq == arg || eq[1] == '\0') return -1;
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(eq + 1, &end, 10);
+    if (errno || *end != '\0' || eq[1] == '-') return -1;
+    char *name = strndup(arg, (size_t)(eq - arg));
+    if (!name) { perror("strdup"); return -1; }
+    int rc = add_op(ops, count, cap, name, 1, size);
+    free(name);
+    return rc;
+}
+
+static void print_usage(const char *p) {
+    fprintf(stderr, "Usage: %s --image <img> [--remove <name> ...] [--truncate <name>=<bytes> ...] [--manifest <list>] [--punch]\n", p);
+    fprintf(stderr, "  Removes or truncates files in the root directory of <img>, in place.\n");
+    fprintf(stderr, "  A failed change leaves the image unchanged, except that on a journaled image the changes\n");
+    fprintf(stderr, "  committed before it stay.\n");
+    fprintf(stderr, "  --remove: file to remove; may be repeated\n");
+    fprintf(stderr, "  --truncate: cut a file down to <bytes>; may be repeated\n");
+    fprintf(stderr, "  --manifest: text file naming one file to remove per line\n");
+    fprintf(stderr, "  --punch: punch the freed blocks out of the image file, giving the space back to the host\n");
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    char *image_name = NULL;
+    op_t *ops = NULL;
+    size_t nops = 0, ops_cap = 0;
+    int punch = 0;
+    static struct option long_opts[] = {
+        {"image", required_argument, 0, 'i'},
+        {"remove", required_argument, 0, 'r'},
+        {"truncate", required_argument, 0, 't'},
+        {"manifest", required_argument, 0, 'm'},
+        {"punch", no_argument, 0, 'P'},
+        {0,0,0,0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:r:t:m:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i': image_name = optarg; break;
+            case 'r':
+                if (add_op(&ops, &nops, &ops_cap, optarg, 0, 0) != 0) return 1;
+                break;
+            case 't':
+                if (parse_truncate(optarg, &ops, &nops, &ops_cap) != 0) { print_usage(argv[0]); return 1; }
+                break;
+            case 'm':
+                if (read_manifest(optarg, &ops, &nops, &ops_cap) != 0) return 1;
+                break;
+            case 'P': punch = 1; break;
+            default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (!image_name || nops == 0) { print_usage(argv[0]); return 1; }
+
+    /*
+     * As with mkfs_adder, a failed change leaves the image as it was, and
+     * on a plain image so does a failure anywhere in the batch. A journaled
+     * image commits what is pending before the transaction could outgrow
+     * the journal and after each change that frees blocks, so the changes
+     * made before a failure stay.
+     */
+    mvfs_t *fs = mvfs_open(image_name, MVFS_RDWR);
+    if (!fs) return 1;
+    if (punch && mvfs_set_punch(fs, 1) != 0) { mvfs_discard(fs); return 1; }
+    for (size_t i = 0; i < nops; ++i) {
+        int rc = ops[i].truncate ? mvfs_truncate(fs, ops[i].name, ops[i].size) : mvfs_remove(fs, ops[i].name);
+        if (rc != 0) { mvfs_discard(fs); return 1; }
+    }
+    if (mvfs_close(fs) != 0) return 1;
+
+    for (size_t i = 0; i < nops; ++i) {
+        if (ops[i].truncate) printf("Truncated '%s' to %" PRIu64 " bytes -> image: %s\n", ops[i].name, ops[i].size, image_name);
+        else printf("Removed '%s' -> image: %s\n", ops[i].name, image_name);
+        free(ops[i].name);
+    }
+    free(ops);
+    return 0;
+}
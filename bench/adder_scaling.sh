@@ -0,0 +1,48 @@
+#!/bin/sh
+# Per-add cost of mkfs_adder as a function of image size.
+#
+# Builds one image per size, punches holes in its zero region (so the
+# input looks like a freshly made sparse image), then times a number of
+# single-file adds against it and prints the mean cost per add.
+#
+#   gcc -O2 -o mkfs_builder Mkfs_builder.c minivsfs.c blkio.c bitmap.c crc32.c lz.c overlay.c stats.c
+#   gcc -O2 -o mkfs_adder Mkfs_adder.c minivsfs.c blkio.c bitmap.c crc32.c lz.c overlay.c stats.c
+#   sh bench/adder_scaling.sh [runs]
+#
+# BUILDER / ADDER override the binaries, SIZES the list of --size-kib values.
+
+set -eu
+
+BUILDER=${BUILDER:-./mkfs_builder}
+ADDER=${ADDER:-./mkfs_adder}
+SIZES=${SIZES:-"180 512 1024 2048 4096"}
+RUNS=${1:-50}
+
+abspath() { (cd "$(dirname "$1")" && printf '%s/%s\n' "$(pwd)" "$(basename "$1")"); }
+BUILDER=$(abspath "$BUILDER")
+ADDER=$(abspath "$ADDER")
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+printf 'falcon yankee narwhal rhinoceros xylophone delta quokka walrus juliet mike\n' > "$work/sample.txt"
+
+now_ns() { date +%s%N; }
+
+printf '%-10s %-8s %-14s %s\n' size_kib runs us_per_add out_kib_on_disk
+for size in $SIZES; do
+    "$BUILDER" --image "$work/in.img" --size-kib "$size" --inodes 128 >/dev/null
+    command -v fallocate >/dev/null 2>&1 && fallocate -d "$work/in.img" 2>/dev/null || true
+
+    start=$(now_ns)
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        (cd "$work" && "$ADDER" --input in.img --output out.img --file sample.txt >/dev/null)
+        i=$((i + 1))
+    done
+    end=$(now_ns)
+
+    per_add=$(( (end - start) / RUNS / 1000 ))
+    on_disk=$(du -k "$work/out.img" | cut -f1)
+    printf '%-10s %-8s %-14s %s\n' "$size" "$RUNS" "$per_add" "$on_disk"
+done
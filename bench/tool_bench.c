@@ -0,0 +1,285 @@
+/*
+ * Throughput and latency of mkfs_builder and mkfs_adder, run as the real
+ * binaries.
+ *
+ *   make bench                  (or: make tool_bench && ./tool_bench ...)
+ *   ./tool_bench [--builder <bin>] [--adder <bin>] [--runs <n>] [--quick]
+ *                [--rev <name>] [--out <results.jsonl>] [--baseline <old.jsonl>]
+ *
+ * mkfs_builder is timed across a grid of --size-kib and --inodes values,
+ * and mkfs_adder across file counts and file sizes. The sizes run from
+ * an inline file and one like the sample file_*.txt up to the 12-block
+ * direct-mapping maximum. Each run is one fork/exec of the tool, timed
+ * from fork to exit. Every case reports ops/s (images built, or files
+ * added), MB/s (image bytes, or file bytes) and the p50/p99 latency of a
+ * run. With --out, each case is also appended as one JSON line tagged
+ * with --rev. With --baseline, a results file from an earlier run is
+ * read back and each case shows its change against it.
+ */
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_RUNS 10000
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Run argv[0] in `dir` with stdout discarded; seconds taken, or -1 if it failed */
+static double run_tool(const char *dir, char *const argv[]) {
+    double t0 = now_sec();
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null < 0 || dup2(null, STDOUT_FILENO) < 0 || chdir(dir) != 0) _exit(127);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) { perror("waitpid"); return -1; }
+    }
+    double dt = now_sec() - t0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed (status %d)\n", argv[0], status);
+        return -1;
+    }
+    return dt;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples */
+static double percentile(const double *v, int n, double p) {
+    int k = (int)(p / 100.0 * n + 0.999999);
+    if (k < 1) k = 1;
+    if (k > n) k = n;
+    return v[k - 1];
+}
+
+typedef struct {
+    char bench[16];
+    char name[96];
+    double ops, mbs, p50, p99;
+} result_t;
+
+static result_t *baseline;
+static int nbaseline;
+
+/* Read results written by --out; only the fields compared are parsed */
+static int load_baseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        result_t r;
+        memset(&r, 0, sizeof(r));
+        if (sscanf(line, "{\"bench\":\"%15[^\"]\",\"case\":\"%95[^\"]\"", r.bench, r.name) != 2) continue;
+        const char *p;
+        if ((p = strstr(line, "\"ops_per_sec\":"))) r.ops = atof(p + 14);
+        if ((p = strstr(line, "\"mb_per_sec\":"))) r.mbs = atof(p + 13);
+        if ((p = strstr(line, "\"p50_ms\":"))) r.p50 = atof(p + 9);
+        if ((p = strstr(line, "\"p99_ms\":"))) r.p99 = atof(p + 9);
+        result_t *nb = realloc(baseline, (size_t)(nbaseline + 1) * sizeof(*nb));
+        if (!nb) { perror("realloc"); fclose(f); return -1; }
+        baseline = nb;
+        baseline[nbaseline++] = r;
+    }
+    fclose(f);
+    return 0;
+}
+
+static const result_t *find_baseline(const char *bench, const char *name) {
+    for (int i = nbaseline - 1; i >= 0; --i)
+        if (strcmp(baseline[i].bench, bench) == 0 && strcmp(baseline[i].name, name) == 0) return &baseline[i];
+    return NULL;
+}
+
+static FILE *out;
+static const char *rev = "unknown";
+
+static void print_header(void) {
+    printf("%-8s %-28s %5s %11s %9s %9s %9s%s\n", "bench", "case", "runs", "ops/s", "MB/s", "p50_ms", "p99_ms",
+           nbaseline ? "  vs baseline (ops/s, p99)" : "");
+}
+
+/* Summarize one case: `ops` and `bytes` are per run */
+static void report(const char *bench, const char *name, double *lat, int runs, double ops, double bytes) {
+    double total = 0;
+    for (int i = 0; i < runs; ++i) total += lat[i];
+    qsort(lat, (size_t)runs, sizeof(*lat), cmp_double);
+    result_t r;
+    snprintf(r.bench, sizeof(r.bench), "%s", bench);
+    snprintf(r.name, sizeof(r.name), "%s", name);
+    r.ops = ops * runs / total;
+    r.mbs = bytes * runs / total / 1e6;
+    r.p50 = percentile(lat, runs, 50) * 1e3;
+    r.p99 = percentile(lat, runs, 99) * 1e3;
+
+    printf("%-8s %-28s %5d %11.1f %9.1f %9.3f %9.3f", bench, name, runs, r.ops, r.mbs, r.p50, r.p99);
+    const result_t *b = find_baseline(bench, name);
+    if (b && b->ops > 0 && b->p99 > 0)
+        printf("  %+6.1f%% %+6.1f%%", (r.ops / b->ops - 1) * 100, (r.p99 / b->p99 - 1) * 100);
+    printf("\n");
+    if (out) {
+        fprintf(out, "{\"bench\":\"%s\",\"case\":\"%s\",\"rev\":\"%s\",\"runs\":%d,\"ops_per_sec\":%.3f,"
+                "\"mb_per_sec\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f}\n",
+                bench, name, rev, runs, r.ops, r.mbs, r.p50, r.p99);
+        fflush(out);
+    }
+}
+
+/* Deterministic text-like contents, the same on every run */
+static int make_file(const char *path, size_t size, unsigned seed) {
+    static const char *const words[] = { "falcon", "yankee", "narwhal", "rhinoceros", "xylophone",
+                                         "delta", "quokka", "walrus", "juliet", "mike" };
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    for (size_t n = 0; n < size; ) {
+        seed = seed * 1103515245u + 12345u;
+        const char *w = words[(seed >> 16) % 10];
+        for (; *w && n < size; ++w, ++n) fputc(*w, f);
+        if (n < size) { fputc(n + 1 == size || (seed >> 8) % 9 == 0 ? '\n' : ' ', f); ++n; }
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int bench_builder(const char *builder, const char *dir, int runs, int quick) {
+    static const unsigned sizes[] = { 180, 1024, 4096, 16384, 65536 };
+    static const unsigned inodes[] = { 128, 512, 4096 };
+    double *lat = malloc((size_t)runs * sizeof(*lat));
+    if (!lat) { perror("malloc"); return -1; }
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) - (quick ? 2 : 0); ++s) {
+        for (size_t i = 0; i < sizeof(inodes) / sizeof(inodes[0]); ++i) {
+            /* skip layouts whose inode table would not leave room for data */
+            if ((uint64_t)inodes[i] * 128 > (uint64_t)sizes[s] * 1024 / 2) continue;
+            char size_arg[16], inode_arg[16], name[96];
+            snprintf(size_arg, sizeof(size_arg), "%u", sizes[s]);
+            snprintf(inode_arg, sizeof(inode_arg), "%u", inodes[i]);
+            snprintf(name, sizeof(name), "size_kib=%u,inodes=%u", sizes[s], inodes[i]);
+            char *argv[] = { (char *)builder, "--image", "b.img", "--size-kib", size_arg, "--inodes", inode_arg, NULL };
+            for (int r = 0; r < runs; ++r)
+                if ((lat[r] = run_tool(dir, argv)) < 0) { free(lat); return -1; }
+            report("builder", name, lat, runs, 1, (double)sizes[s] * 1024);
+        }
+    }
+    free(lat);
+    return 0;
+}
+
+static int bench_adder(const char *builder, const char *adder, const char *dir, int runs, int quick) {
+    /* 56 bytes is stored inline, 80 like a sample file_*.txt, 48 KiB the largest direct-mapped file */
+    static const struct { const char *label; size_t size; } sizes[] = {
+        { "inline-56B", 56 }, { "sample-80B", 80 }, { "1blk-4KiB", 4096 }, { "12blk-48KiB", 12 * 4096 }
+    };
+    static const unsigned counts[] = { 1, 16, 128 };
+    const unsigned max_count = quick ? 16 : 128;
+
+    char *mk[] = { (char *)builder, "--image", "in.img", "--size-kib", "16384", "--inodes", "512", NULL };
+    if (run_tool(dir, mk) < 0) return -1;
+
+    double *lat = malloc((size_t)runs * sizeof(*lat));
+    if (!lat) { perror("malloc"); return -1; }
+    char path[4096 + 64];
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]) && counts[c] <= max_count; ++c) {
+            snprintf(path, sizeof(path), "%s/files.txt", dir);
+            FILE *m = fopen(path, "w");
+            if (!m) { perror(path); free(lat); return -1; }
+            for (unsigned k = 0; k < counts[c]; ++k) {
+                char fname[64];
+                snprintf(fname, sizeof(fname), "f%zu_%u.txt", s, k);
+                snprintf(path, sizeof(path), "%s/%s", dir, fname);
+                if (make_file(path, sizes[s].size, (unsigned)(s * 1000 + k)) != 0) { fclose(m); free(lat); return -1; }
+                fprintf(m, "%s\n", fname);
+            }
+            if (fclose(m) != 0) { perror("write manifest"); free(lat); return -1; }
+
+            char name[96];
+            snprintf(name, sizeof(name), "files=%u,size=%s", counts[c], sizes[s].label);
+            char *argv[] = { (char *)adder, "--input", "in.img", "--output", "out.img", "--manifest", "files.txt", NULL };
+            for (int r = 0; r < runs; ++r)
+                if ((lat[r] = run_tool(dir, argv)) < 0) { free(lat); return -1; }
+            report("adder", name, lat, runs, counts[c], (double)counts[c] * (double)sizes[s].size);
+        }
+    }
+    free(lat);
+    return 0;
+}
+
+/* Remove the scratch directory and everything in it */
+static void cleanup(const char *dir) {
+    char cmd[4200];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", dir);
+}
+
+static char *abs_path(const char *p) {
+    if (strchr(p, '/') == NULL) {
+        fprintf(stderr, "%s: give the binary with a path, e.g. ./%s\n", p, p);
+        return NULL;
+    }
+    char *r = realpath(p, NULL);
+    if (!r) perror(p);
+    return r;
+}
+
+static void usage(const char *p) {
+    fprintf(stderr, "Usage: %s [--builder <bin>] [--adder <bin>] [--runs <n>] [--quick] "
+            "[--rev <name>] [--out <results.jsonl>] [--baseline <old.jsonl>]\n", p);
+}
+
+int main(int argc, char *argv[]) {
+    const char *builder_arg = "./mkfs_builder", *adder_arg = "./mkfs_adder", *out_path = NULL, *base_path = NULL;
+    int runs = 20, quick = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(a, "--quick") == 0) { quick = 1; continue; }
+        if (!v) { usage(argv[0]); return 1; }
+        if (strcmp(a, "--builder") == 0) builder_arg = v;
+        else if (strcmp(a, "--adder") == 0) adder_arg = v;
+        else if (strcmp(a, "--runs") == 0) runs = atoi(v);
+        else if (strcmp(a, "--rev") == 0) rev = v;
+        else if (strcmp(a, "--out") == 0) out_path = v;
+        else if (strcmp(a, "--baseline") == 0) base_path = v;
+        else { usage(argv[0]); return 1; }
+        ++i;
+    }
+    if (runs < 1 || runs > MAX_RUNS) { fprintf(stderr, "--runs must be 1-%d\n", MAX_RUNS); return 1; }
+
+    char *builder = abs_path(builder_arg), *adder = abs_path(adder_arg);
+    if (!builder || !adder) return 1;
+    if (base_path && load_baseline(base_path) != 0) return 1;
+    if (out_path && !(out = fopen(out_path, "a"))) { perror(out_path); return 1; }
+
+    const char *tmp = getenv("TMPDIR");
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/mvfs_bench.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+
+    print_header();
+    int rc = bench_builder(builder, dir, runs, quick) == 0 && bench_adder(builder, adder, dir, runs, quick) == 0 ? 0 : 1;
+
+    cleanup(dir);
+    if (out && fclose(out) != 0) { perror(out_path); rc = 1; }
+    free(builder);
+    free(adder);
+    free(baseline);
+    return rc;
+}
@@ -0,0 +1,167 @@
+#include "bitmap.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Bit i of the map is bit i&63 of little-endian word i>>6 */
+static inline uint64_t load_word(const uint8_t *bm, uint64_t w) {
+    uint64_t v;
+    memcpy(&v, bm + w * 8, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/* First clear (want == 0) or set (want == 1) bit in [from, end), else end */
+static uint64_t scan(const uint8_t *bm, uint64_t from, uint64_t end, int want) {
+    if (from >= end) return end;
+    uint64_t flip = want ? 0 : ~0ull;
+    uint64_t w = from >> 6;
+    uint64_t word = (load_word(bm, w) ^ flip) & (~0ull << (from & 63));
+    uint64_t first = w;
+    for (;;) {
+        if (word) {
+            stats.bits_scanned += (w - first + 1) * 64;
+            uint64_t r = w * 64 + (uint64_t)__builtin_ctzll(word);
+            return r < end ? r : end;
+        }
+        if (++w * 64 >= end) { stats.bits_scanned += (w - first) * 64; return end; }
+        word = load_word(bm, w) ^ flip;
+    }
+}
+
+static void chunk_bounds(const bitmap_t *b, uint64_t c, uint64_t *lo, uint64_t *hi) {
+    *lo = c * BITMAP_CHUNK_BITS;
+    *hi = *lo + BITMAP_CHUNK_BITS < b->nbits ? *lo + BITMAP_CHUNK_BITS : b->nbits;
+}
+
+static void chunk_refresh(bitmap_t *b, uint64_t c) {
+    uint64_t lo, hi;
+    chunk_bounds(b, c, &lo, &hi);
+    bitmap_chunk_t st = {0, 0, 0, 0};
+    uint64_t pos = lo;
+    while (pos < hi) {
+        uint64_t z = scan(b->bm, pos, hi, 0);
+        if (z == hi) break;
+        uint64_t o = scan(b->bm, z, hi, 1);
+        uint32_t len = (uint32_t)(o - z);
+        st.free += len;
+        if (len > st.longest) st.longest = len;
+        if (z == lo) st.head = len;
+        if (o == hi) st.tail = len;
+        pos = o;
+    }
+    b->nfree = b->nfree - b->chunk[c].free + st.free;
+    b->chunk[c] = st;
+}
+
+int bitmap_attach(bitmap_t *b, uint8_t *bm, uint64_t nbits) {
+    b->bm = bm;
+    b->nbits = nbits;
+    b->nchunks = (nbits + BITMAP_CHUNK_BITS - 1) / BITMAP_CHUNK_BITS;
+    b->nfree = 0;
+    b->chunk = calloc(b->nchunks ? b->nchunks : 1, sizeof(*b->chunk));
+    if (!b->chunk) return -1;
+    for (uint64_t c = 0; c < b->nchunks; ++c) chunk_refresh(b, c);
+    return 0;
+}
+
+void bitmap_detach(bitmap_t *b) {
+    free(b->chunk);
+    memset(b, 0, sizeof(*b));
+}
+
+uint64_t bitmap_find_zero(const bitmap_t *b, uint64_t from) {
+    for (uint64_t c = from / BITMAP_CHUNK_BITS; c < b->nchunks; ++c) {
+        if (b->chunk[c].free == 0) continue;
+        uint64_t lo, hi;
+        chunk_bounds(b, c, &lo, &hi);
+        uint64_t z = scan(b->bm, from > lo ? from : lo, hi, 0);
+        if (z != hi) return z;
+    }
+    return b->nbits;
+}
+
+uint64_t bitmap_find_one(const bitmap_t *b, uint64_t from) {
+    for (uint64_t c = from / BITMAP_CHUNK_BITS; c < b->nchunks; ++c) {
+        uint64_t lo, hi;
+        chunk_bounds(b, c, &lo, &hi);
+        if (b->chunk[c].free == hi - lo) continue;
+        uint64_t o = scan(b->bm, from > lo ? from : lo, hi, 1);
+        if (o != hi) return o;
+    }
+    return b->nbits;
+}
+
+uint64_t bitmap_find_run(const bitmap_t *b, uint64_t len, uint64_t from) {
+    if (len == 0) return from < b->nbits ? from : b->nbits;
+    uint64_t carry_start = 0, carry = 0; /* free run reaching the current chunk's start */
+    for (uint64_t c = from / BITMAP_CHUNK_BITS; c < b->nchunks; ++c) {
+        const bitmap_chunk_t *ch = &b->chunk[c];
+        uint64_t lo, hi;
+        chunk_bounds(b, c, &lo, &hi);
+        uint64_t start = from > lo ? from : lo;
+        uint64_t head = start == lo ? ch->head : scan(b->bm, start, hi, 1) - start;
+        uint64_t tail = ch->tail < hi - start ? ch->tail : hi - start;
+
+        if (carry > 0 && carry + head >= len) return carry_start;
+
+        if (ch->longest >= len) {
+            uint64_t pos = start;
+            while (pos < hi) {
+                uint64_t z = scan(b->bm, pos, hi, 0);
+                if (z == hi) break;
+                uint64_t o = scan(b->bm, z, hi, 1);
+                if (o - z >= len) return z;
+                pos = o;
+            }
+        }
+
+        if (head == hi - start) {
+            if (carry == 0) carry_start = start;
+            carry += hi - start;
+        } else {
+            carry = tail;
+            carry_start = hi - tail;
+        }
+        if (carry >= len) return carry_start;
+    }
+    return b->nbits;
+}
+
+uint64_t bitmap_longest_run(const bitmap_t *b) {
+    uint64_t best = 0, carry = 0;
+    for (uint64_t c = 0; c < b->nchunks; ++c) {
+        const bitmap_chunk_t *ch = &b->chunk[c];
+        uint64_t lo, hi;
+        chunk_bounds(b, c, &lo, &hi);
+        if (ch->longest > best) best = ch->longest;
+        if (carry + ch->head > best) best = carry + ch->head;
+        carry = ch->free == hi - lo ? carry + (hi - lo) : ch->tail;
+    }
+    return carry > best ? carry : best;
+}
+
+static void update_range(bitmap_t *b, uint64_t start, uint64_t len, int set) {
+    if (len == 0) return;
+    uint64_t end = start + len;
+    uint64_t i = start;
+    for (; i < end && (i & 7); ++i) {
+        if (set) b->bm[i >> 3] |= (uint8_t)(1u << (i & 7));
+        else b->bm[i >> 3] &= (uint8_t)~(1u << (i & 7));
+    }
+    if (end - i >= 8) {
+        memset(b->bm + (i >> 3), set ? 0xFF : 0x00, (end - i) >> 3);
+        i += (end - i) & ~7ull;
+    }
+    for (; i < end; ++i) {
+        if (set) b->bm[i >> 3] |= (uint8_t)(1u << (i & 7));
+        else b->bm[i >> 3] &= (uint8_t)~(1u << (i & 7));
+    }
+    for (uint64_t c = start / BITMAP_CHUNK_BITS; c <= (end - 1) / BITMAP_CHUNK_BITS; ++c) chunk_refresh(b, c);
+}
+
+void bitmap_set_range(bitmap_t *b, uint64_t start, uint64_t len) { update_range(b, start, len, 1); }
+void bitmap_clear_range(bitmap_t *b, uint64_t start, uint64_t len) { update_range(b, start, len, 0); }
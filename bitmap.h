@@ -0,0 +1,61 @@
+#ifndef MVFS_BITMAP_H
+#define MVFS_BITMAP_H
+
+#include <stdint.h>
+
+/*
+ * Allocation bitmaps in the MiniVSFS on-disk format (bit i of the map is
+ * bit i&7 of byte i>>3, 1 = allocated), scanned 64 bits at a time.
+ *
+ * A bitmap_t wraps a caller-owned buffer and keeps a per-chunk summary
+ * (free count, longest free run, free bits at either edge) so that run
+ * searches skip full or too-fragmented chunks without touching their
+ * words. The buffer must be readable in whole 64-bit words, which every
+ * on-disk bitmap (whole 4 KiB blocks) is.
+ */
+#define BITMAP_CHUNK_BITS 4096u
+
+typedef struct {
+    uint32_t free;     /* free bits in the chunk */
+    uint32_t longest;  /* longest free run inside the chunk */
+    uint32_t head;     /* free bits at the start of the chunk */
+    uint32_t tail;     /* free bits at the end of the chunk */
+} bitmap_chunk_t;
+
+typedef struct {
+    uint8_t *bm;
+    uint64_t nbits;
+    uint64_t nchunks;
+    uint64_t nfree;
+    bitmap_chunk_t *chunk;
+} bitmap_t;
+
+/* A run of `len` bits starting at `start` */
+typedef struct {
+    uint64_t start;
+    uint64_t len;
+} bitmap_run_t;
+
+int bitmap_attach(bitmap_t *b, uint8_t *bm, uint64_t nbits); /* 0, or -1 on allocation failure */
+void bitmap_detach(bitmap_t *b);
+
+/* Bit i of a raw on-disk bitmap, for tools that read one without a bitmap_t */
+static inline int bitmap_bit(const uint8_t *bm, uint64_t i) { return (bm[i >> 3] >> (i & 7)) & 1; }
+
+static inline int bitmap_test(const bitmap_t *b, uint64_t i) { return bitmap_bit(b->bm, i); }
+static inline uint64_t bitmap_free_count(const bitmap_t *b) { return b->nfree; }
+
+/* First clear / set bit in [from, nbits); nbits if there is none */
+uint64_t bitmap_find_zero(const bitmap_t *b, uint64_t from);
+uint64_t bitmap_find_one(const bitmap_t *b, uint64_t from);
+
+/* Length of the longest free run anywhere in the bitmap */
+uint64_t bitmap_longest_run(const bitmap_t *b);
+
+/* Start of the first free run of at least `len` bits at or after `from`; nbits if none */
+uint64_t bitmap_find_run(const bitmap_t *b, uint64_t len, uint64_t from);
+
+void bitmap_set_range(bitmap_t *b, uint64_t start, uint64_t len);
+void bitmap_clear_range(bitmap_t *b, uint64_t start, uint64_t len);
+
+#endif
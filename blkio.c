@@ -0,0 +1,349 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "blkio.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define SPAN_IOVS 1024u               /* IOV_MAX */
+#define SPAN_BYTES (1ull << 30)       /* keep each request well under the kernel's per-call limit */
+#define URING_DEPTH 64u
+
+/*
+ * Minimal io_uring over the raw syscalls (no liburing): one SQ/CQ ring
+ * pair, filled with up to URING_DEPTH writes per io_uring_enter().
+ */
+struct blkio_uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqe_len;
+};
+
+static void uring_close(blkio_uring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqe_len);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_len);
+    if (r->sq_map) munmap(r->sq_map, r->sq_len);
+    if (r->fd >= 0) close(r->fd);
+    free(r);
+}
+
+static blkio_uring_t *uring_open(void) {
+#ifdef __NR_io_uring_setup
+    blkio_uring_t *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (r->fd < 0) { free(r); return NULL; }
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) { r->sq_map = NULL; uring_close(r); return NULL; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) { r->cq_map = NULL; uring_close(r); return NULL; }
+    }
+    r->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { r->sqes = NULL; uring_close(r); return NULL; }
+
+    uint8_t *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+int blkio_backend_parse(const char *name) {
+    if (strcmp(name, "pwrite") == 0) return BLKIO_PWRITE;
+    if (strcmp(name, "pwritev") == 0) return BLKIO_PWRITEV;
+    if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0) return BLKIO_URING;
+    if (strcmp(name, "mmap") == 0) return BLKIO_MMAP;
+    return -1;
+}
+
+int blkio_init(blkio_t *io, int fd, const char *path, int backend, int direct) {
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->backend = backend;
+    if (backend == BLKIO_MMAP) {
+        struct stat st;
+        if (direct) { fprintf(stderr, "O_DIRECT and a mapped image don't mix\n"); return -1; }
+        if (fstat(fd, &st) != 0) { perror("stat image"); return -1; }
+        io->map_len = (size_t)st.st_size;
+        io->map = mmap(NULL, io->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (io->map == MAP_FAILED) { io->map = NULL; perror("mmap image"); return -1; }
+        return 0;
+    }
+    if (direct) {
+        io->fd = open(path, O_WRONLY | O_DIRECT);
+        if (io->fd < 0) { perror("open image (O_DIRECT)"); return -1; }
+        io->direct = 1;
+    }
+    if (backend == BLKIO_URING && !(io->ring = uring_open())) {
+        fprintf(stderr, "io_uring unavailable (%s), using pwritev\n", strerror(errno));
+        io->backend = BLKIO_PWRITEV;
+    }
+    return 0;
+}
+
+const uint8_t *blkio_find(const blkio_t *io, uint64_t blk) {
+    for (size_t i = io->n; i-- > 0; )
+        if (blk >= io->q[i].blk && blk < io->q[i].blk + io->q[i].nblocks) return io->q[i].buf + (blk - io->q[i].blk) * BLKIO_BS;
+    return NULL;
+}
+
+void blkio_truncate(blkio_t *io, size_t mark) {
+    for (size_t i = mark; i < io->n; ++i) {
+        if (!io->q[i].owned) continue;
+        io->queued_bytes -= io->q[i].nblocks * BLKIO_BS;
+        free(io->q[i].buf);
+    }
+    if (mark < io->n) io->n = mark;
+    if (mark == 0) io->queued_bytes = 0; /* remapped pieces of a buffer only count in its first */
+}
+
+void blkio_fini(blkio_t *io) {
+    blkio_truncate(io, 0);
+    free(io->q);
+    if (io->ring) uring_close(io->ring);
+    if (io->map) munmap(io->map, io->map_len);
+    if (io->direct) close(io->fd);
+    memset(io, 0, sizeof(*io));
+    io->fd = -1;
+}
+
+uint8_t *blkio_alloc(uint64_t nblocks) {
+    void *p;
+    if (posix_memalign(&p, BLKIO_ALIGN, (size_t)(nblocks ? nblocks : 1) * BLKIO_BS) != 0) return NULL;
+    return p;
+}
+
+int blkio_write(blkio_t *io, uint64_t blk, uint8_t *buf, uint64_t nblocks, int owned) {
+    if (io->n == io->cap) {
+        size_t nc = io->cap ? io->cap * 2 : 256;
+        blkio_req_t *nq = realloc(io->q, nc * sizeof(*nq));
+        if (!nq) return -1;
+        io->q = nq;
+        io->cap = nc;
+    }
+    io->q[io->n++] = (blkio_req_t){ blk, nblocks, buf, owned };
+    if (owned) io->queued_bytes += nblocks * BLKIO_BS;
+    return 0;
+}
+
+static int req_cmp(const void *a, const void *b) {
+    const blkio_req_t *x = a, *y = b;
+    return x->blk < y->blk ? -1 : x->blk > y->blk;
+}
+
+/* Write all of iov[0..n) at `off`, continuing after short writes */
+static int pwritev_full(blkio_t *io, struct iovec *iov, int n, off_t off) {
+    while (n > 0) {
+        ssize_t w = pwritev(io->fd, iov, n, off);
+        io->syscalls++;
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { if (w == 0) errno = EIO; return -1; }
+        off += w;
+        while (n > 0 && (size_t)w >= iov->iov_len) { w -= (ssize_t)iov->iov_len; ++iov; --n; }
+        if (n > 0) { iov->iov_base = (uint8_t *)iov->iov_base + w; iov->iov_len -= (size_t)w; }
+    }
+    return 0;
+}
+
+/* A run of queued requests covering contiguous blocks, as one iovec array */
+typedef struct {
+    off_t off;
+    struct iovec *iov;
+    int niov;
+    size_t bytes;
+} span_t;
+
+/* Submit up to r->entries spans as one io_uring_enter() and reap them all */
+static int uring_write(blkio_t *io, span_t *s, unsigned n) {
+    blkio_uring_t *r = io->ring;
+    unsigned tail = *r->sq_tail;
+    for (unsigned i = 0; i < n; ++i, ++tail) {
+        unsigned idx = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = io->fd;
+        sqe->off = (uint64_t)s[i].off;
+        sqe->addr = (uint64_t)(uintptr_t)s[i].iov;
+        sqe->len = (unsigned)s[i].niov;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned submitted = 0, done = 0;
+    int rc = 0;
+    while (done < n) {
+        unsigned to_submit = n - submitted;
+        int e = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        io->syscalls++;
+        stats.uring_submits++;
+        if (e < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            return -1;
+        }
+        submitted += (unsigned)e;
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            span_t *sp = &s[cqe->user_data];
+            int res = cqe->res;
+            ++head;
+            ++done;
+            if (res < 0) { errno = -res; rc = -1; continue; }
+            stats.uring_bytes += (uint64_t)res;
+            if ((size_t)res < sp->bytes) {
+                /* finish a short write synchronously */
+                struct iovec *iov = sp->iov;
+                int niov = sp->niov;
+                size_t w = (size_t)res;
+                while (niov > 0 && w >= iov->iov_len) { w -= iov->iov_len; ++iov; --niov; }
+                if (niov > 0) { iov->iov_base = (uint8_t *)iov->iov_base + w; iov->iov_len -= w; }
+                if (pwritev_full(io, iov, niov, sp->off + res) != 0) rc = -1;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+
+/*
+ * Rewrite the queue in file blocks. A request the hook splits keeps its
+ * buffer with the first piece, which alone frees it.
+ */
+static int remap_queue(blkio_t *io) {
+    size_t cap = io->n, n = 0;
+    blkio_req_t *q = malloc(cap * sizeof(*q));
+    if (!q) { errno = ENOMEM; return -1; }
+    for (size_t i = 0; i < io->n; ++i) {
+        const blkio_req_t *r = &io->q[i];
+        for (uint64_t done = 0; done < r->nblocks; ) {
+            uint64_t len, fblk = io->remap(io->remap_ctx, r->blk + done, r->buf + done * BLKIO_BS, r->nblocks - done, &len);
+            if (fblk == UINT64_MAX) { free(q); return -1; }
+            if (n == cap) {
+                blkio_req_t *nq = realloc(q, (cap *= 2) * sizeof(*nq));
+                if (!nq) { free(q); errno = ENOMEM; return -1; }
+                q = nq;
+            }
+            q[n++] = (blkio_req_t){ fblk, len, r->buf + done * BLKIO_BS, done == 0 && r->owned };
+            done += len;
+        }
+    }
+    free(io->q);
+    io->q = q;
+    io->n = n;
+    io->cap = cap;
+    qsort(io->q, io->n, sizeof(*io->q), req_cmp);
+    return 0;
+}
+
+int blkio_flush(blkio_t *io) {
+    if (io->n == 0) return 0;
+    int rc = 0;
+    qsort(io->q, io->n, sizeof(*io->q), req_cmp);
+    if (io->remap && remap_queue(io) != 0) {
+        int saved = errno;
+        blkio_truncate(io, 0);
+        errno = saved;
+        return -1;
+    }
+
+    if (io->backend == BLKIO_MMAP) {
+        for (size_t i = 0; i < io->n && rc == 0; ++i) {
+            const blkio_req_t *r = &io->q[i];
+            if (r->blk > io->map_len / BLKIO_BS || r->nblocks > io->map_len / BLKIO_BS - r->blk) { errno = EFBIG; rc = -1; break; }
+            memcpy(io->map + r->blk * BLKIO_BS, r->buf, (size_t)r->nblocks * BLKIO_BS);
+            stats.mmap_bytes += r->nblocks * BLKIO_BS;
+        }
+        blkio_truncate(io, 0);
+        return rc;
+    }
+
+    if (io->backend == BLKIO_PWRITE) {
+        for (size_t i = 0; i < io->n && rc == 0; ++i) {
+            struct iovec v = { io->q[i].buf, (size_t)io->q[i].nblocks * BLKIO_BS };
+            rc = pwritev_full(io, &v, 1, (off_t)(io->q[i].blk * BLKIO_BS));
+        }
+        blkio_truncate(io, 0);
+        return rc;
+    }
+
+    struct iovec *iov = malloc(io->n * sizeof(*iov));
+    span_t *spans = malloc(io->n * sizeof(*spans));
+    if (!iov || !spans) { free(iov); free(spans); blkio_truncate(io, 0); errno = ENOMEM; return -1; }
+    size_t nspans = 0;
+    for (size_t i = 0; i < io->n; ++i) {
+        const blkio_req_t *q = &io->q[i];
+        size_t bytes = (size_t)q->nblocks * BLKIO_BS;
+        span_t *last = nspans ? &spans[nspans - 1] : NULL;
+        if (last && (uint64_t)last->off + last->bytes == q->blk * BLKIO_BS &&
+            last->niov < (int)SPAN_IOVS && last->bytes + bytes <= SPAN_BYTES) {
+            last->niov++;
+            last->bytes += bytes;
+        } else {
+            spans[nspans++] = (span_t){ (off_t)(q->blk * BLKIO_BS), &iov[i], 1, bytes };
+        }
+        iov[i].iov_base = q->buf;
+        iov[i].iov_len = bytes;
+    }
+
+    if (io->backend == BLKIO_URING) {
+        for (size_t s = 0; s < nspans && rc == 0; s += io->ring->entries) {
+            unsigned n = nspans - s < io->ring->entries ? (unsigned)(nspans - s) : io->ring->entries;
+            rc = uring_write(io, &spans[s], n);
+        }
+    } else {
+        for (size_t s = 0; s < nspans && rc == 0; ++s)
+            rc = pwritev_full(io, spans[s].iov, spans[s].niov, spans[s].off);
+    }
+    int saved = errno;
+    free(iov);
+    free(spans);
+    blkio_truncate(io, 0);
+    errno = saved;
+    return rc;
+}
+
+int blkio_sync(blkio_t *io) {
+    stats.syncs++;
+    if (io->map) return msync(io->map, io->map_len, MS_SYNC);
+    return fdatasync(io->fd);
+}
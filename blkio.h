@@ -0,0 +1,98 @@
+#ifndef MVFS_BLKIO_H
+#define MVFS_BLKIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Batched block writes. Writes are queued with blkio_write() and go out on
+ * blkio_flush(): the queue is sorted by block, requests for adjacent
+ * blocks are coalesced, and each coalesced span is one pwritev() or one
+ * io_uring SQE, so an operation that touches many small, mostly
+ * contiguous ranges costs a handful of syscalls instead of one per block.
+ *
+ * With `direct` the writes use a separate O_DIRECT descriptor of the same
+ * file; queued buffers then have to be BLKIO_ALIGN-aligned, which
+ * blkio_alloc() buffers always are.
+ *
+ * BLKIO_MMAP instead maps the whole file shared and copies each flushed
+ * request into the mapping, with no write syscalls; blkio_sync() makes it
+ * durable with one msync(). That is mkfs_adder's original --in-place
+ * mode. The file must not grow while mapped, and a write the host file
+ * system has no room for raises SIGBUS rather than failing.
+ */
+#define BLKIO_BS 4096u
+#define BLKIO_ALIGN 4096u
+
+enum blkio_backend {
+    BLKIO_PWRITE,   /* one pwrite per queued write, no coalescing */
+    BLKIO_PWRITEV,  /* coalesced, one pwritev per span */
+    BLKIO_URING,    /* coalesced, one IORING_OP_WRITEV per span, submitted together */
+    BLKIO_MMAP      /* copied into a shared mapping of the file, one msync per sync */
+};
+
+typedef struct {
+    uint64_t blk;
+    uint64_t nblocks;
+    uint8_t *buf;
+    int owned;      /* free buf once written */
+} blkio_req_t;
+
+typedef struct blkio_uring blkio_uring_t;
+
+/*
+ * Optional translation from queued block numbers to file blocks, applied
+ * on flush: returns the file block of the first *len (at most nblocks)
+ * blocks of a write of buf at `blk`, or UINT64_MAX with errno set.
+ */
+typedef uint64_t (*blkio_remap_fn)(void *ctx, uint64_t blk, const uint8_t *buf, uint64_t nblocks, uint64_t *len);
+
+typedef struct {
+    int fd;
+    int backend;
+    int direct;
+    blkio_req_t *q;
+    size_t n, cap;
+    uint64_t queued_bytes;   /* bytes held in owned buffers */
+    blkio_uring_t *ring;
+    uint64_t syscalls;       /* write submissions made so far */
+    blkio_remap_fn remap;    /* set after blkio_init() to write somewhere other than the queued blocks */
+    void *remap_ctx;
+    uint8_t *map;            /* BLKIO_MMAP: the whole file, shared */
+    size_t map_len;
+} blkio_t;
+
+/* Parse "pwrite", "pwritev", "uring" or "mmap"; -1 if unknown */
+int blkio_backend_parse(const char *name);
+
+/*
+ * Write through `fd`, or through a fresh O_DIRECT descriptor of `path`
+ * when `direct` is set. Falls back to pwritev (with a note on stderr) if
+ * io_uring is unavailable. 0, or -1 with a message on stderr.
+ */
+int blkio_init(blkio_t *io, int fd, const char *path, int backend, int direct);
+void blkio_fini(blkio_t *io);
+
+/* BLKIO_ALIGN-aligned buffer of `nblocks` blocks for handing to blkio_write(..., 1) */
+uint8_t *blkio_alloc(uint64_t nblocks);
+
+/*
+ * Queue `nblocks` blocks from buf for block `blk`. With `owned` the queue
+ * takes the buffer and frees it after the flush; otherwise it must stay
+ * valid and unchanged until then. 0, or -1 if the queue cannot grow.
+ */
+int blkio_write(blkio_t *io, uint64_t blk, uint8_t *buf, uint64_t nblocks, int owned);
+
+/* Submit everything queued and wait for it; 0, or -1 with errno set */
+int blkio_flush(blkio_t *io);
+
+/* Make flushed writes durable: fdatasync, or one msync of the whole mapping with BLKIO_MMAP; 0 or -1 */
+int blkio_sync(blkio_t *io);
+
+/* The most recently queued contents of block `blk`, or NULL if it has no write queued */
+const uint8_t *blkio_find(const blkio_t *io, uint64_t blk);
+
+/* Drop queued writes from index `mark` (a former io->n) on, e.g. after a failed operation */
+void blkio_truncate(blkio_t *io, size_t mark);
+
+#endif
@@ -0,0 +1,231 @@
+#include "crc32.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#endif
+
+/*
+ * Kernels all operate on the raw (pre/post-inverted) CRC register, so they
+ * can be chained: the PCLMUL kernel folds the bulk and hands its register
+ * to a table kernel for the tail.
+ */
+typedef uint32_t (*crc32_kernel_fn)(uint32_t c, const uint8_t *p, size_t n);
+
+/* T[0] is the classic byte table; T[k][i] advances T[k-1][i] by one more zero byte */
+static uint32_t CRC32_T[16][256];
+
+static uint32_t crc32_bytewise(uint32_t c, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; ++i) c = CRC32_T[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint32_t load_le32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* Slicing-by-8: 8 table lookups per 8 input bytes, no loop-carried byte dependency */
+static uint32_t crc32_slice8(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint32_t a = load_le32(p) ^ c;
+        uint32_t b = load_le32(p + 4);
+        c = CRC32_T[7][a & 0xFF] ^ CRC32_T[6][(a >> 8) & 0xFF] ^
+            CRC32_T[5][(a >> 16) & 0xFF] ^ CRC32_T[4][a >> 24] ^
+            CRC32_T[3][b & 0xFF] ^ CRC32_T[2][(b >> 8) & 0xFF] ^
+            CRC32_T[1][(b >> 16) & 0xFF] ^ CRC32_T[0][b >> 24];
+        p += 8;
+        n -= 8;
+    }
+    return crc32_bytewise(c, p, n);
+}
+
+/* Slicing-by-16: same idea over 16 bytes, trading 16 KiB of tables for fewer iterations */
+static uint32_t crc32_slice16(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 16) {
+        uint32_t a = load_le32(p) ^ c;
+        uint32_t b = load_le32(p + 4);
+        uint32_t d = load_le32(p + 8);
+        uint32_t e = load_le32(p + 12);
+        c = CRC32_T[15][a & 0xFF] ^ CRC32_T[14][(a >> 8) & 0xFF] ^
+            CRC32_T[13][(a >> 16) & 0xFF] ^ CRC32_T[12][a >> 24] ^
+            CRC32_T[11][b & 0xFF] ^ CRC32_T[10][(b >> 8) & 0xFF] ^
+            CRC32_T[9][(b >> 16) & 0xFF] ^ CRC32_T[8][b >> 24] ^
+            CRC32_T[7][d & 0xFF] ^ CRC32_T[6][(d >> 8) & 0xFF] ^
+            CRC32_T[5][(d >> 16) & 0xFF] ^ CRC32_T[4][d >> 24] ^
+            CRC32_T[3][e & 0xFF] ^ CRC32_T[2][(e >> 8) & 0xFF] ^
+            CRC32_T[1][(e >> 16) & 0xFF] ^ CRC32_T[0][e >> 24];
+        p += 16;
+        n -= 16;
+    }
+    return crc32_bytewise(c, p, n);
+}
+#else
+/* the sliced kernels assume little-endian word loads */
+#define crc32_slice8 crc32_bytewise
+#define crc32_slice16 crc32_bytewise
+#endif
+
+#ifdef CRC32_HAVE_PCLMUL
+/*
+ * Carry-less multiplication folding (Gopal et al., "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009), with
+ * the bit-reflected constants for 0xEDB88320. Folds four 128-bit lanes in
+ * parallel, reduces to one lane, then Barrett-reduces to 32 bits.
+ * Requires n >= 64 and n % 16 == 0.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t c, const uint8_t *p, size_t n) {
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ull, 0x01c6e41596ull };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ull, 0x00ccaa009eull };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ull, 0x0000000000ull };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641ull, 0x01f7011641ull };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    p += 64;
+    n -= 64;
+
+    /* fold 64 bytes per iteration */
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        n -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* remaining 16-byte blocks */
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        n -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t c, const uint8_t *p, size_t n) {
+    if (n >= 64) {
+        size_t bulk = n & ~(size_t)15;
+        c = crc32_pclmul_fold(c, p, bulk);
+        p += bulk;
+        n -= bulk;
+    }
+    return crc32_slice8(c, p, n);
+}
+
+static int cpu_has_pclmul(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static const struct {
+    const char *name;
+    crc32_kernel_fn fn;
+} KERNELS[] = {
+    { "bytewise", crc32_bytewise },
+    { "slice8", crc32_slice8 },
+    { "slice16", crc32_slice16 },
+#ifdef CRC32_HAVE_PCLMUL
+    { "pclmul", crc32_pclmul },
+#endif
+};
+
+static crc32_kernel_fn crc32_active = crc32_bytewise;
+static const char *crc32_active_name = "bytewise";
+
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; ++j)
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        CRC32_T[0][i] = c;
+    }
+    for (int k = 1; k < 16; ++k)
+        for (int i = 0; i < 256; ++i)
+            CRC32_T[k][i] = (CRC32_T[k - 1][i] >> 8) ^ CRC32_T[0][CRC32_T[k - 1][i] & 0xFF];
+
+    crc32_select("slice16");
+#ifdef CRC32_HAVE_PCLMUL
+    if (cpu_has_pclmul()) crc32_select("pclmul");
+#endif
+}
+
+int crc32_select(const char *name) {
+    for (size_t i = 0; i < sizeof(KERNELS) / sizeof(KERNELS[0]); ++i) {
+        if (strcmp(KERNELS[i].name, name) != 0) continue;
+#ifdef CRC32_HAVE_PCLMUL
+        if (KERNELS[i].fn == crc32_pclmul && !cpu_has_pclmul()) return -1;
+#endif
+        crc32_active = KERNELS[i].fn;
+        crc32_active_name = KERNELS[i].name;
+        return 0;
+    }
+    return -1;
+}
+
+const char *crc32_kernel_name(void) { return crc32_active_name; }
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n) {
+    return crc32_active(crc ^ 0xFFFFFFFFu, (const uint8_t *)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32(const void *data, size_t n) { return crc32_update(0, data, n); }
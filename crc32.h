@@ -0,0 +1,24 @@
+#ifndef MVFS_CRC32_H
+#define MVFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 (reflected polynomial 0xEDB88320, as in zlib/Ethernet) shared by
+ * the MiniVSFS tools. crc32_init() builds the tables and picks the fastest
+ * kernel the CPU supports; call it once before any other function.
+ */
+void crc32_init(void);
+
+/* CRC of a whole buffer */
+uint32_t crc32(const void *data, size_t n);
+
+/* Continue a CRC: crc32_update(crc32(a, na), b, nb) == crc32(a ++ b). Start from 0. */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n);
+
+/* Kernel selection, mainly for benchmarks: "bytewise", "slice8", "slice16", "pclmul" */
+const char *crc32_kernel_name(void);
+int crc32_select(const char *name); /* 0 on success, -1 if unknown or unsupported here */
+
+#endif
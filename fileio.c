@@ -0,0 +1,109 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "fileio.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define HOLE_BS 4096u   /* granularity at which the pread/pwrite copy leaves zeros as holes */
+
+int fio_read_full(int fd, void *dst, size_t len, off_t off) {
+    uint8_t *p = dst;
+    while (len > 0) {
+        ssize_t r = pread(fd, p, len, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) { if (r == 0) errno = EIO; return -1; }
+        p += r;
+        off += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+int fio_write_full(int fd, const void *src, size_t len, off_t off) {
+    const uint8_t *p = src;
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { if (w == 0) errno = EIO; return -1; }
+        p += w;
+        off += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+int fio_write_all(int fd, const void *src, size_t len) {
+    const uint8_t *p = src;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { if (w == 0) errno = EIO; return -1; }
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+/* Copy [off, off+len) with plain pread/pwrite, leaving all-zero blocks as holes */
+static int copy_range_rw(int in_fd, int out_fd, off_t off, off_t len) {
+    uint8_t buf[16 * HOLE_BS];
+    while (len > 0) {
+        size_t want = len > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)len;
+        ssize_t r = pread(in_fd, buf, want, off);
+        if (r < 0) { if (errno == EINTR) continue; return -1; }
+        if (r == 0) { errno = EIO; return -1; }
+        for (size_t b = 0; b < (size_t)r; b += HOLE_BS) {
+            size_t n = (size_t)r - b < HOLE_BS ? (size_t)r - b : HOLE_BS;
+            size_t z = 0;
+            while (z < n && buf[b + z] == 0) ++z;
+            if (z == n) continue; /* output was pre-sized, so this stays a hole */
+            if (fio_write_full(out_fd, buf + b, n, off + (off_t)b) != 0) return -1;
+        }
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Copy [off, off+len) in-kernel; falls back to pread/pwrite where unsupported */
+static int copy_range(int in_fd, int out_fd, off_t off, off_t len) {
+    off_t in_off = off, out_off = off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, (size_t)len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+                return copy_range_rw(in_fd, out_fd, in_off, len);
+            return -1;
+        }
+        if (n == 0) { errno = EIO; return -1; }
+        len -= n;
+    }
+    return 0;
+}
+
+int fio_clone(int in_fd, int out_fd, off_t len) {
+#ifdef FICLONE
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) return ftruncate(out_fd, len);
+#endif
+    if (ftruncate(out_fd, len) != 0) return -1;
+
+    off_t off = 0;
+    while (off < len) {
+        off_t data = lseek(in_fd, off, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) return 0; /* only holes remain */
+            return copy_range(in_fd, out_fd, off, len - off); /* no SEEK_DATA support */
+        }
+        if (data >= len) return 0;
+        off_t hole = lseek(in_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > len) hole = len;
+        if (copy_range(in_fd, out_fd, data, hole - data) != 0) return -1;
+        off = hole;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef MVFS_FILEIO_H
+#define MVFS_FILEIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Whole-buffer file I/O shared by the tools. The full-I/O helpers retry
+ * short transfers and EINTR; a file that ends early fails with EIO. All
+ * return 0, or -1 with errno set.
+ */
+
+/* Read exactly `len` bytes at `off` into dst */
+int fio_read_full(int fd, void *dst, size_t len, off_t off);
+
+/* Write exactly `len` bytes of src at `off` */
+int fio_write_full(int fd, const void *src, size_t len, off_t off);
+
+/* Write exactly `len` bytes of src at fd's current position (pipes, terminals) */
+int fio_write_all(int fd, const void *src, size_t len);
+
+/*
+ * Make out_fd a copy of the first `len` bytes of in_fd. Order of
+ * preference: reflink (FICLONE, O(1) on btrfs/xfs), then a
+ * SEEK_DATA/SEEK_HOLE walk copying only allocated extents with
+ * copy_file_range, then pread/pwrite. Holes in the input, and all-zero
+ * blocks on the pread/pwrite path, stay holes in the output.
+ */
+int fio_clone(int in_fd, int out_fd, off_t len);
+
+#endif
@@ -0,0 +1,110 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4u
+#define LZ_MAX_OFFSET 65535u
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* The extra bytes of a length field: runs of 255 and a final byte below it */
+static uint8_t *put_len(uint8_t *op, const uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op == oend) return NULL;
+        *op++ = 255;
+    }
+    if (op == oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* One sequence: nlit literals, then a match of mlen bytes at off back (mlen 0: literals only) */
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit, size_t off, size_t mlen) {
+    if (op == oend) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = put_len(op, oend, nlit - 15))) return NULL;
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) return op;
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && !(op = put_len(op, oend, mlen - 15))) return NULL;
+    return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1u << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(ip);
+        const uint8_t *ref = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+        if (ref >= ip || (size_t)(ip - ref) > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            /* step faster through data that keeps missing */
+            ip += 1 + ((size_t)(ip - anchor) >> 6);
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < end && ref[mlen] == ip[mlen]) ++mlen;
+        if (!(op = put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen))) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!(op = put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0))) return 0;
+    return (size_t)(op - dst);
+}
+
+/* A length field's extra bytes; -1 if they run past the input */
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip == iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + out;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15 && get_len(&ip, iend, &len) != 0) return -1;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        len = token & 15;
+        if (len == 15 && get_len(&ip, iend, &len) != 0) return -1;
+        len += LZ_MIN_MATCH;
+        if (len > (size_t)(oend - op)) return -1;
+        const uint8_t *m = op - off;
+        if (off >= len) {
+            memcpy(op, m, len);
+            op += len;
+        } else {
+            while (len--) *op++ = *m++; /* overlapping: repeats the last off bytes */
+        }
+    }
+    return op == oend ? 0 : -1;
+}
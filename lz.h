@@ -0,0 +1,23 @@
+#ifndef MVFS_LZ_H
+#define MVFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A small LZ77 codec for compressed files, in the LZ4 block layout: each
+ * sequence is a token (literal count in the high nibble, match length - 4
+ * in the low one, 15 meaning more length bytes follow), the literals, a
+ * little-endian 16-bit match offset and the extra match length bytes. The
+ * last sequence has literals only. Compression is a single greedy pass
+ * over a 4096-entry hash of 4-byte prefixes, so it runs at memory speed
+ * and needs no heap.
+ */
+
+/* Compress n bytes into at most cap bytes; the compressed size, or 0 if it does not fit */
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+/* Decompress into exactly `out` bytes; 0, or -1 if the input is corrupt or decodes to another size */
+int lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out);
+
+#endif
@@ -0,0 +1,2271 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "minivsfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "blkio.h"
+#include "crc32.h"
+#include "fileio.h"
+#include "lz.h"
+#include "overlay.h"
+#include "stats.h"
+
+void superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = crc32((void *)sb, offsetof(superblock_t, checksum));
+    sb->checksum = s;
+}
+
+void superblock_ext_crc_finalize(superblock_ext_t *sbx) {
+    sbx->checksum = crc32(sbx, offsetof(superblock_ext_t, checksum));
+}
+
+void group_desc_crc_finalize(group_desc_t *gd) {
+    gd->checksum = crc32(gd, offsetof(group_desc_t, checksum));
+}
+
+/* Inode CRC: zero crc area and compute over first 120 bytes */
+void inode_crc_finalize(inode_t *ino) {
+    uint8_t tmp[INODE_SIZE];
+    memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+
+void dirent_checksum_finalize(dirent64_t *d) {
+    const uint8_t *p = (const uint8_t *)d;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; ++i) x ^= p[i];
+    d->checksum = x;
+}
+
+void mvfs_name_set(char dst[MAX_NAME], const char *name) {
+    strncpy(dst, name, MAX_NAME - 1);
+    dst[MAX_NAME - 1] = '\0';
+}
+
+uint32_t mvfs_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+uint64_t mvfs_block_fp(const void *blk) {
+    /* four independent multiply-xorshift lanes over the 64-bit words, folded and finalized */
+    const uint8_t *p = blk;
+    const uint64_t K = 0x9E3779B97F4A7C15ull;
+    uint64_t h[4] = { 1, 2, 3, 4 };
+    for (size_t i = 0; i < BS; i += 32) {
+        for (int l = 0; l < 4; ++l) {
+            uint64_t w;
+            memcpy(&w, p + i + 8 * l, sizeof(w));
+            h[l] = (h[l] ^ w) * K;
+            h[l] ^= h[l] >> 32;
+        }
+    }
+    uint64_t x = h[0];
+    for (int l = 1; l < 4; ++l) x = (x ^ h[l]) * K;
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t div_up(uint64_t a, uint64_t b) { return (a + b - 1) / b; }
+
+int mvfs_unit_span(const uint32_t *map, uint64_t size, uint64_t u, uint64_t stream_len, uint64_t *start, uint64_t *end) {
+    *start = u == 0 ? div_up(size, COMPRESS_UNIT) * sizeof(uint32_t) : map[u - 1];
+    *end = map[u];
+    return *start <= *end && *end <= stream_len ? 0 : -1;
+}
+
+int mvfs_unit_decode(const uint8_t *in, size_t n, uint8_t *out, size_t ulen) {
+    if (n == ulen) {
+        memcpy(out, in, n);
+        return 0;
+    }
+    return n < ulen ? lz_decompress(in, n, out, ulen) : -1;
+}
+
+int mvfs_inode_runs(const uint8_t *map, const superblock_t *sb, const inode_t *ino, uint64_t nblocks,
+                    extent_t *runs, uint64_t *nruns, uint32_t *ext_block) {
+    uint64_t drs = sb->data_region_start, dre = drs + sb->data_region_blocks;
+    *nruns = 0;
+    if (ext_block) *ext_block = 0;
+    if (!(ino->flags & INODE_FL_EXTENTS)) {
+        if (nblocks > 12) return MVFS_RUNS_DIRECT;
+        for (uint64_t b = 0; b < nblocks; ++b) runs[(*nruns)++] = (extent_t){ ino->direct[b], 1 };
+    } else {
+        extent_t ext[EXTENTS_PER_BLOCK];
+        uint64_t count = INLINE_EXTENTS;
+        memcpy(ext, ino->direct, INLINE_EXTENTS * sizeof(extent_t));
+        if (ino->flags & INODE_FL_EXTENT_BLOCK) {
+            if (ext[0].start < drs || ext[0].start >= dre || ext[0].len == 0 || ext[0].len > EXTENTS_PER_BLOCK) return MVFS_RUNS_EXT_BLOCK;
+            if (ext_block) *ext_block = ext[0].start;
+            count = ext[0].len;
+            memcpy(ext, map + (uint64_t)ext[0].start * BS, count * sizeof(extent_t));
+        }
+        uint64_t have = 0;
+        for (uint64_t e = 0; e < count && have < nblocks && ext[e].len; ++e) {
+            uint64_t len = ext[e].len < nblocks - have ? ext[e].len : nblocks - have;
+            runs[(*nruns)++] = (extent_t){ ext[e].start, (uint32_t)len };
+            have += len;
+        }
+        if (have < nblocks) return MVFS_RUNS_SHORT;
+    }
+    for (uint64_t r = 0; r < *nruns; ++r)
+        if (runs[r].start < drs || (uint64_t)runs[r].start + runs[r].len > dre) return MVFS_RUNS_OUTSIDE;
+    return 0;
+}
+
+/* Whether blocks [s, s + n) lie after the descriptor table and before the data region, clear of the bitmaps and inode table */
+static int region_ok(const superblock_t *sb, const superblock_ext_t *sbx, uint64_t s, uint64_t n) {
+    uint64_t e = s + n;
+    return s >= sbx->group_desc_start + sbx->group_desc_blocks && e >= s && e <= sb->data_region_start &&
+           !(s < sb->inode_bitmap_start + sb->inode_bitmap_blocks && e > sb->inode_bitmap_start) &&
+           !(s < sb->data_bitmap_start + sb->data_bitmap_blocks && e > sb->data_bitmap_start) &&
+           !(s < sb->inode_table_start + sb->inode_table_blocks && e > sb->inode_table_start);
+}
+
+int mvfs_validate(const uint8_t *blk0, off_t file_size) {
+    const superblock_t *sb = (const superblock_t *)blk0;
+    if (sb->magic != MVFS_MAGIC || sb->block_size != BS) {
+        fprintf(stderr, "Not a MiniVSFS image\n");
+        return -1;
+    }
+    if (sb->flags & ~SB_FEAT_KNOWN) {
+        fprintf(stderr, "Image uses unsupported features (flags 0x%x)\n", sb->flags);
+        return -1;
+    }
+    uint64_t tb = sb->total_blocks;
+    if (tb == 0 || tb > (uint64_t)file_size / BS) {
+        fprintf(stderr, "Image truncated: %" PRIu64 " blocks declared, %lld bytes present\n",
+                tb, (long long)file_size);
+        return -1;
+    }
+    if (sb->inode_bitmap_start + sb->inode_bitmap_blocks > tb ||
+        sb->data_bitmap_start + sb->data_bitmap_blocks > tb ||
+        sb->inode_table_start + sb->inode_table_blocks > tb ||
+        sb->data_region_start + sb->data_region_blocks > tb ||
+        sb->inode_count > sb->inode_bitmap_blocks * BS * 8 ||
+        sb->inode_count > sb->inode_table_blocks * (BS / INODE_SIZE) ||
+        sb->data_region_blocks > sb->data_bitmap_blocks * BS * 8 ||
+        sb->data_region_start + sb->data_region_blocks > (1ull << 32) ||
+        sb->root_inode != ROOT_INO || sb->inode_count < ROOT_INO) {
+        fprintf(stderr, "Corrupt superblock layout\n");
+        return -1;
+    }
+    if ((sb->version == SB_VERSION_EXT) != ((sb->flags & SB_FEAT_GROUPS) != 0) ||
+        ((sb->flags & (SB_FEAT_JOURNAL | SB_FEAT_DEDUP)) && sb->version != SB_VERSION_EXT)) {
+        fprintf(stderr, "Corrupt superblock layout\n");
+        return -1;
+    }
+    if (sb->version != SB_VERSION_EXT) return 0;
+
+    superblock_ext_t sbx;
+    memcpy(&sbx, blk0 + SBX_OFFSET, sizeof(sbx));
+    if (sbx.magic != SBX_MAGIC || sbx.size != sizeof(sbx) ||
+        sbx.checksum != crc32(&sbx, offsetof(superblock_ext_t, checksum))) {
+        fprintf(stderr, "Corrupt superblock extension\n");
+        return -1;
+    }
+    if (sbx.blocks_per_group != BITS_PER_BLOCK || sbx.inodes_per_group == 0 || sbx.inodes_per_group % 64 ||
+        sbx.group_count != div_up(sb->data_region_blocks, sbx.blocks_per_group) ||
+        sbx.group_count > sb->data_bitmap_blocks ||
+        sbx.group_count * sbx.inodes_per_group < sb->inode_count ||
+        sbx.group_desc_start == 0 || sbx.group_desc_start + sbx.group_desc_blocks > tb ||
+        sbx.group_desc_blocks * GROUP_DESCS_PER_BLOCK < sbx.group_count) {
+        fprintf(stderr, "Corrupt block group layout\n");
+        return -1;
+    }
+    if ((sb->flags & SB_FEAT_JOURNAL) &&
+        (sbx.journal_blocks < JOURNAL_MIN_BLOCKS || !region_ok(sb, &sbx, sbx.journal_start, sbx.journal_blocks))) {
+        fprintf(stderr, "Corrupt journal layout\n");
+        return -1;
+    }
+    if (sb->flags & SB_FEAT_DEDUP) {
+        uint64_t ds = sbx.dedup_start, de = ds + sbx.dedup_blocks;
+        if (sbx.dedup_blocks == 0 || (sbx.dedup_blocks & (sbx.dedup_blocks - 1)) || !region_ok(sb, &sbx, ds, sbx.dedup_blocks) ||
+            ((sb->flags & SB_FEAT_JOURNAL) && ds < sbx.journal_start + sbx.journal_blocks && de > sbx.journal_start)) {
+            fprintf(stderr, "Corrupt dedup index layout\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write-back cache of metadata blocks. Clean blocks sit on an LRU list and
+ * are evicted once the cache holds CACHE_BLOCKS; dirty blocks sit on their
+ * own list and stay until the next write-back, so nothing changed since
+ * the last mvfs_sync() reaches the image early. A pointer from cache_get()
+ * is valid until the next cache_get(). Block buffers are aligned for
+ * O_DIRECT write-back.
+ */
+#define CACHE_BLOCKS 8192u
+#define CACHE_HASH 4096u
+
+typedef struct cblock {
+    uint64_t blk;
+    int dirty;
+    struct cblock *hnext;
+    struct cblock *prev, *next;   /* on the clean LRU list (most recent first) or the dirty list */
+    uint8_t *data;
+} cblock_t;
+
+typedef struct {
+    cblock_t *head, *tail;
+} cblist_t;
+
+/*
+ * Allocation state of one block group: its descriptor plus private copies
+ * of its data and inode bitmap slices. Groups are loaded on first use, so
+ * adding to a large image only reads the bitmaps of the groups it touches;
+ * the descriptors' free summaries decide which groups those are. A version
+ * 1 image is a single group spanning both whole bitmaps. Groups changed by
+ * the operation in progress are `dirty` until committed to the cache.
+ */
+typedef struct {
+    group_desc_t desc;
+    uint64_t blk_lo, blk_len;    /* data region blocks of the group */
+    uint64_t ino_lo, ino_len;    /* inode indices of the group */
+    uint8_t *dbuf, *ibuf;
+    bitmap_t dbm, ibm;
+    int loaded, dirty;
+} group_t;
+
+/* Runs of absolute blocks, merged where one ends and the next begins */
+typedef struct {
+    bitmap_run_t *v;
+    size_t n, cap;
+} runlist_t;
+
+struct mvfs {
+    int fd;
+    int mode;
+    char *path;
+    blkio_t io;                  /* file data and write-back go out through here in batches */
+    superblock_t sb;
+    superblock_ext_t sbx;        /* valid on version 2 images */
+    int sb_dirty;
+
+    cblock_t *hash[CACHE_HASH];
+    cblist_t clean, dirty;
+    uint64_t cached, ndirty;
+
+    /* journaled images: the transaction being built since the last sync */
+    uint64_t jseq;               /* sequence number of the next transaction */
+    journal_run_t *jruns;        /* data runs written by this transaction, in write order */
+    size_t njruns, jruns_cap;
+    uint32_t jdata_crc;          /* crc32 of those runs' contents */
+    int ckpt_pending;            /* the last checkpoint may not be durable yet */
+    int jfreed;                  /* it frees blocks, which must not be reused before it commits */
+
+    group_t *g;
+    uint64_t ngroups, bpg, ipg;
+    uint64_t free_blocks;        /* sum of the descriptors' free_blocks */
+    uint64_t rotor;              /* group of the last inode handed out */
+    uint64_t goal;               /* data region block right after the last file added */
+    int dedup;                   /* share identical data blocks through the dedup index */
+    int compress;                /* store file data compressed where that saves blocks */
+    ovl_t *ovl;                  /* overlay chain: reads come from its view, writes go to its top */
+    int punch;                   /* punch freed blocks out of the image file on sync */
+    runlist_t holes;             /* blocks freed since the last sync, to punch */
+};
+
+static void list_unlink(cblist_t *l, cblock_t *c) {
+    if (c->prev) c->prev->next = c->next; else l->head = c->next;
+    if (c->next) c->next->prev = c->prev; else l->tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static void list_push(cblist_t *l, cblock_t *c) {
+    c->prev = NULL;
+    c->next = l->head;
+    if (l->head) l->head->prev = c; else l->tail = c;
+    l->head = c;
+}
+
+static cblock_t *cache_lookup(mvfs_t *fs, uint64_t blk) {
+    for (cblock_t *c = fs->hash[blk & (CACHE_HASH - 1)]; c; c = c->hnext)
+        if (c->blk == blk) return c;
+    return NULL;
+}
+
+static void cache_remove(mvfs_t *fs, cblock_t *c) {
+    cblock_t **pp = &fs->hash[c->blk & (CACHE_HASH - 1)];
+    while (*pp != c) pp = &(*pp)->hnext;
+    *pp = c->hnext;
+    list_unlink(c->dirty ? &fs->dirty : &fs->clean, c);
+    if (c->dirty) fs->ndirty--;
+    fs->cached--;
+    free(c->data);
+    free(c);
+}
+
+/* Read image bytes: from the overlay chain's view, or straight from the file */
+static int dev_read(mvfs_t *fs, uint8_t *dst, size_t len, off_t off) {
+    if (!fs->ovl) return fio_read_full(fs->fd, dst, len, off);
+    if ((uint64_t)off > fs->ovl->len || len > fs->ovl->len - (uint64_t)off) { errno = EIO; return -1; }
+    memcpy(dst, fs->ovl->view + off, len);
+    return 0;
+}
+
+static int dev_sync(mvfs_t *fs) {
+    if (fs->io.map) return blkio_sync(&fs->io);
+    stats.syncs++;
+    return fdatasync(fs->fd);
+}
+
+static uint8_t *cache_get(mvfs_t *fs, uint64_t blk, int for_write) {
+    if (blk >= fs->sb.total_blocks) { fprintf(stderr, "Block %" PRIu64 " outside the image\n", blk); return NULL; }
+    cblock_t *c = cache_lookup(fs, blk);
+    if (!c) {
+        if (fs->cached >= CACHE_BLOCKS && fs->clean.tail) cache_remove(fs, fs->clean.tail);
+        if (!(c = malloc(sizeof(*c))) || !(c->data = blkio_alloc(1))) { perror("malloc cache block"); free(c); return NULL; }
+        if (dev_read(fs, c->data, BS, (off_t)blk * BS) != 0) { perror("read image block"); free(c->data); free(c); return NULL; }
+        c->blk = blk;
+        c->dirty = 0;
+        c->prev = c->next = NULL;
+        c->hnext = fs->hash[blk & (CACHE_HASH - 1)];
+        fs->hash[blk & (CACHE_HASH - 1)] = c;
+        fs->cached++;
+        list_push(&fs->clean, c);
+    } else if (!c->dirty) {
+        list_unlink(&fs->clean, c);
+        list_push(&fs->clean, c);
+    }
+    if (for_write && !c->dirty) {
+        list_unlink(&fs->clean, c);
+        c->dirty = 1;
+        fs->ndirty++;
+        list_push(&fs->dirty, c);
+    }
+    return c->data;
+}
+
+/* Forget a cached copy of a block that is about to be written directly */
+static void cache_drop(mvfs_t *fs, uint64_t blk) {
+    cblock_t *c = cache_lookup(fs, blk);
+    if (c) cache_remove(fs, c);
+}
+
+/* Write queued file data and every dirty block back in one batch, then move the blocks to the clean list */
+static int cache_writeback(mvfs_t *fs) {
+    for (cblock_t *c = fs->dirty.head; c; c = c->next)
+        if (blkio_write(&fs->io, c->blk, c->data, 1, 0) != 0) { perror("malloc"); return -1; }
+    int ph = stats_enter(PH_FLUSH);
+    int rc = blkio_flush(&fs->io);
+    stats_enter(ph);
+    if (rc != 0) { perror("write image"); return -1; }
+    while (fs->dirty.head) {
+        cblock_t *c = fs->dirty.head;
+        list_unlink(&fs->dirty, c);
+        c->dirty = 0;
+        list_push(&fs->clean, c);
+    }
+    fs->ndirty = 0;
+    while (fs->cached > CACHE_BLOCKS && fs->clean.tail) cache_remove(fs, fs->clean.tail);
+    return 0;
+}
+
+/* Copy `len` bytes at byte `off` of the region starting at block `blk` out of / into the cache */
+static int meta_read(mvfs_t *fs, uint64_t blk, uint64_t off, void *dst, size_t len) {
+    uint8_t *d = dst;
+    while (len > 0) {
+        size_t o = (size_t)(off % BS), n = len < BS - o ? len : BS - o;
+        const uint8_t *p = cache_get(fs, blk + off / BS, 0);
+        if (!p) return -1;
+        memcpy(d, p + o, n);
+        d += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int meta_write(mvfs_t *fs, uint64_t blk, uint64_t off, const void *src, size_t len) {
+    const uint8_t *s = src;
+    while (len > 0) {
+        size_t o = (size_t)(off % BS), n = len < BS - o ? len : BS - o;
+        uint8_t *p = cache_get(fs, blk + off / BS, 1);
+        if (!p) return -1;
+        memcpy(p + o, s, n);
+        s += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Remember that `nblocks` blocks of file data in buf go to `blk` in the open transaction */
+static int journal_note_data(mvfs_t *fs, uint64_t blk, const uint8_t *buf, uint64_t nblocks) {
+    fs->jdata_crc = crc32_update(fs->jdata_crc, buf, (size_t)nblocks * BS);
+    journal_run_t *last = fs->njruns ? &fs->jruns[fs->njruns - 1] : NULL;
+    if (last && last->start + last->len == blk) { last->len += nblocks; return 0; }
+    if (fs->njruns == fs->jruns_cap) {
+        size_t nc = fs->jruns_cap ? fs->jruns_cap * 2 : 64;
+        journal_run_t *nr = realloc(fs->jruns, nc * sizeof(*nr));
+        if (!nr) { perror("realloc"); return -1; }
+        fs->jruns = nr;
+        fs->jruns_cap = nc;
+    }
+    fs->jruns[fs->njruns++] = (journal_run_t){ blk, nblocks };
+    return 0;
+}
+
+/* Descriptor blocks needed to log `nmeta` blocks and `ndata` data runs */
+static uint64_t journal_desc_blocks(uint64_t nmeta, uint64_t ndata) {
+    return div_up(sizeof(journal_head_t) + nmeta * sizeof(uint64_t) + ndata * sizeof(journal_run_t), BS);
+}
+
+/*
+ * Log every dirty block as one transaction, commit it with one
+ * fdatasync, then checkpoint the blocks to their home locations. The
+ * checkpoint is only made durable before the next transaction overwrites
+ * the journal; until then a crash just replays this one.
+ */
+static int journal_commit(mvfs_t *fs) {
+    uint64_t js = fs->sbx.journal_start;
+    if (fs->ndirty == 0) {
+        /* nothing to log: only orphaned data from failed adds can be queued */
+        int ph = stats_enter(PH_FLUSH);
+        int rc = blkio_flush(&fs->io);
+        stats_enter(ph);
+        if (rc != 0) { perror("write image"); return -1; }
+        return 0;
+    }
+    uint64_t nmeta = fs->ndirty, dblocks = journal_desc_blocks(nmeta, fs->njruns);
+    if (dblocks + nmeta + 1 > fs->sbx.journal_blocks) {
+        fprintf(stderr, "Transaction too large for the journal (%" PRIu64 " blocks, journal has %" PRIu64 ")\n",
+                dblocks + nmeta + 1, fs->sbx.journal_blocks);
+        return -1;
+    }
+    if (fs->ckpt_pending) {
+        int ph = stats_enter(PH_FLUSH);
+        int rc = dev_sync(fs);
+        stats_enter(ph);
+        if (rc != 0) { perror("fsync image"); return -1; }
+        fs->ckpt_pending = 0;
+    }
+
+    uint8_t *desc = blkio_alloc(dblocks), *commit = blkio_alloc(1);
+    if (!desc || !commit) { perror("malloc"); free(desc); free(commit); return -1; }
+    memset(desc, 0, dblocks * BS);
+    memset(commit, 0, BS);
+    journal_head_t *h = (journal_head_t *)desc;
+    h->magic = JOURNAL_DESC_MAGIC;
+    h->desc_blocks = (uint32_t)dblocks;
+    h->seq = fs->jseq;
+    h->nmeta = (uint32_t)nmeta;
+    h->ndata = (uint32_t)fs->njruns;
+    uint64_t *home = (uint64_t *)(desc + sizeof(*h));
+    uint64_t i = 0;
+    for (cblock_t *c = fs->dirty.head; c; c = c->next) home[i++] = c->blk;
+    memcpy(home + nmeta, fs->jruns, fs->njruns * sizeof(journal_run_t));
+
+    uint32_t body = crc32(desc, dblocks * BS);
+    for (cblock_t *c = fs->dirty.head; c; c = c->next) body = crc32_update(body, c->data, BS);
+    journal_commit_t *jc = (journal_commit_t *)commit;
+    jc->magic = JOURNAL_COMMIT_MAGIC;
+    jc->nmeta = (uint32_t)nmeta;
+    jc->seq = fs->jseq;
+    jc->body_crc = body;
+    jc->data_crc = fs->jdata_crc;
+    jc->checksum = crc32(jc, offsetof(journal_commit_t, checksum));
+
+    /* queued file data, descriptor, copies and commit block go out as one batch under one fdatasync */
+    size_t mark = fs->io.n;
+    if (blkio_write(&fs->io, js, desc, dblocks, 1) != 0) { perror("malloc"); free(desc); free(commit); return -1; }
+    int rc = 0;
+    i = 0;
+    for (cblock_t *c = fs->dirty.head; c && rc == 0; c = c->next) rc = blkio_write(&fs->io, js + dblocks + i++, c->data, 1, 0);
+    if (rc == 0 && blkio_write(&fs->io, js + dblocks + nmeta, commit, 1, 1) == 0) commit = NULL;
+    if (commit) { perror("malloc"); free(commit); blkio_truncate(&fs->io, mark); return -1; }
+    int ph = stats_enter(PH_FLUSH);
+    if (blkio_flush(&fs->io) != 0) { perror("write journal"); stats_enter(ph); return -1; }
+    rc = dev_sync(fs);
+    stats_enter(ph);
+    if (rc != 0) { perror("fsync image"); return -1; }
+
+    fs->jseq++;
+    fs->njruns = 0;
+    fs->jdata_crc = 0;
+    if (cache_writeback(fs) != 0) return -1;
+    fs->ckpt_pending = 1;
+    return 0;
+}
+
+/*
+ * Whether a transaction read from the journal was committed: its commit
+ * block matches and covers exactly this descriptor and these copies. The
+ * expected crc32 of its data runs goes to *data_crc.
+ */
+static int journal_committed(const journal_head_t *h, const uint8_t *desc, const uint8_t *copies,
+                             const uint8_t *commit, uint32_t *data_crc) {
+    journal_commit_t jc;
+    memcpy(&jc, commit, sizeof(jc));
+    if (jc.magic != JOURNAL_COMMIT_MAGIC || jc.seq != h->seq || jc.nmeta != h->nmeta ||
+        jc.checksum != crc32(&jc, offsetof(journal_commit_t, checksum)) ||
+        jc.body_crc != crc32_update(crc32(desc, (size_t)h->desc_blocks * BS), copies, (size_t)h->nmeta * BS)) return 0;
+    *data_crc = jc.data_crc;
+    return 1;
+}
+
+/* A committed transaction's home blocks and data runs must lie in the image, and outside the journal */
+static int journal_targets_ok(const journal_head_t *h, const uint8_t *desc, uint64_t total_blocks, uint64_t js, uint64_t jb) {
+    const uint64_t *home = (const uint64_t *)(desc + sizeof(*h));
+    const journal_run_t *runs = (const journal_run_t *)(home + h->nmeta);
+    for (uint32_t i = 0; i < h->nmeta; ++i)
+        if (home[i] >= total_blocks || (home[i] >= js && home[i] < js + jb)) return 0;
+    for (uint32_t r = 0; r < h->ndata; ++r)
+        if (runs[r].start >= total_blocks || runs[r].len > total_blocks - runs[r].start) return 0;
+    return 1;
+}
+
+/* Whether the head at the start of the journal can describe a transaction that fits it */
+static int journal_head_ok(const journal_head_t *h, uint64_t jb) {
+    return h->magic == JOURNAL_DESC_MAGIC && h->desc_blocks == journal_desc_blocks(h->nmeta, h->ndata) &&
+           (uint64_t)h->desc_blocks + h->nmeta + 1 <= jb;
+}
+
+/*
+ * Apply the transaction left in the journal if it committed and its file
+ * data is intact. The logged blocks go into the cache as dirty blocks;
+ * read-write handles then write them home at once.
+ */
+static int journal_replay(mvfs_t *fs) {
+    uint64_t js = fs->sbx.journal_start, jb = fs->sbx.journal_blocks;
+    fs->jseq = 1;
+    uint8_t *blk = blkio_alloc(1);
+    if (!blk) { perror("malloc"); return -1; }
+    if (dev_read(fs, blk, BS, (off_t)(js * BS)) != 0) { perror("read journal"); free(blk); return -1; }
+    journal_head_t h;
+    memcpy(&h, blk, sizeof(h));
+    free(blk);
+    if (h.magic != JOURNAL_DESC_MAGIC) return 0;
+    fs->jseq = h.seq + 1;
+    if (!journal_head_ok(&h, jb)) return 0;
+
+    int rc = -1;
+    uint64_t dblocks = h.desc_blocks;
+    uint8_t *desc = blkio_alloc(dblocks), *copies = blkio_alloc(h.nmeta), *buf = blkio_alloc(256);
+    uint32_t want_crc;
+    if (!desc || !copies || !buf) { perror("malloc"); goto out; }
+    if (dev_read(fs, desc, dblocks * BS, (off_t)(js * BS)) != 0 ||
+        dev_read(fs, copies, (size_t)h.nmeta * BS, (off_t)((js + dblocks) * BS)) != 0 ||
+        dev_read(fs, buf, BS, (off_t)((js + dblocks + h.nmeta) * BS)) != 0) { perror("read journal"); goto out; }
+    rc = 0;
+    if (!journal_committed(&h, desc, copies, buf, &want_crc)) goto out;
+    if (!journal_targets_ok(&h, desc, fs->sb.total_blocks, js, jb)) {
+        fprintf(stderr, "Corrupt journal transaction\n");
+        rc = -1;
+        goto out;
+    }
+
+    const uint64_t *home = (const uint64_t *)(desc + sizeof(h));
+    journal_run_t *runs = (journal_run_t *)(home + h.nmeta);
+    uint32_t dcrc = 0;
+    for (uint32_t r = 0; r < h.ndata; ++r) {
+        for (uint64_t k = 0; k < runs[r].len; k += 256) {
+            size_t n = (size_t)(runs[r].len - k < 256 ? runs[r].len - k : 256) * BS;
+            if (dev_read(fs, buf, n, (off_t)((runs[r].start + k) * BS)) != 0) { perror("read image"); rc = -1; goto out; }
+            dcrc = crc32_update(dcrc, buf, n);
+        }
+    }
+    if (dcrc != want_crc) goto out; /* the file data never landed: drop the transaction */
+
+    for (uint32_t i = 0; i < h.nmeta; ++i)
+        if (meta_write(fs, home[i], 0, copies + (size_t)i * BS, BS) != 0) { rc = -1; goto out; }
+    if (fs->mode == MVFS_RDWR) {
+        if (cache_writeback(fs) != 0 || dev_sync(fs) != 0) { perror("replay journal"); rc = -1; }
+    }
+out:
+    free(desc);
+    free(copies);
+    free(buf);
+    return rc;
+}
+
+int mvfs_journal_apply(uint8_t *map, size_t len, int (*writable)(void *ctx, uint64_t blk, uint64_t n), void *ctx) {
+    const superblock_t *sb = (const superblock_t *)map;
+    if (!(sb->flags & SB_FEAT_JOURNAL)) return 0;
+    superblock_ext_t sbx;
+    memcpy(&sbx, map + SBX_OFFSET, sizeof(sbx));
+    uint64_t js = sbx.journal_start, jb = sbx.journal_blocks, tb = len / BS;
+    journal_head_t h;
+    memcpy(&h, map + js * BS, sizeof(h));
+    if (!journal_head_ok(&h, jb)) return 0;
+    const uint8_t *desc = map + js * BS, *copies = desc + (size_t)h.desc_blocks * BS;
+    uint32_t want_crc;
+    if (!journal_committed(&h, desc, copies, copies + (size_t)h.nmeta * BS, &want_crc)) return 0;
+    if (!journal_targets_ok(&h, desc, tb, js, jb)) {
+        fprintf(stderr, "Corrupt journal transaction\n");
+        return -1;
+    }
+    const uint64_t *home = (const uint64_t *)(desc + sizeof(h));
+    const journal_run_t *runs = (const journal_run_t *)(home + h.nmeta);
+    uint32_t dcrc = 0;
+    for (uint32_t r = 0; r < h.ndata; ++r) dcrc = crc32_update(dcrc, map + runs[r].start * BS, (size_t)runs[r].len * BS);
+    if (dcrc != want_crc) return 0;
+    int changed = 0;
+    for (uint32_t i = 0; i < h.nmeta; ++i) {
+        if (memcmp(map + home[i] * BS, copies + (size_t)i * BS, BS) == 0) continue;
+        if (writable && writable(ctx, home[i], 1) != 0) { perror("map journaled block"); return -1; }
+        memcpy(map + home[i] * BS, copies + (size_t)i * BS, BS);
+        changed = 1;
+    }
+    return changed;
+}
+
+static int inode_read(mvfs_t *fs, uint64_t idx, inode_t *ino) {
+    return meta_read(fs, fs->sb.inode_table_start, idx * INODE_SIZE, ino, sizeof(*ino));
+}
+
+static int inode_write(mvfs_t *fs, uint64_t idx, const inode_t *ino) {
+    return meta_write(fs, fs->sb.inode_table_start, idx * INODE_SIZE, ino, sizeof(*ino));
+}
+
+/* Recompute a loaded group's descriptor from its bitmaps */
+static void group_refresh(mvfs_t *fs, group_t *g) {
+    fs->free_blocks -= g->desc.free_blocks;
+    g->desc.free_blocks = (uint32_t)bitmap_free_count(&g->dbm);
+    g->desc.free_inodes = (uint32_t)bitmap_free_count(&g->ibm);
+    g->desc.longest_free_run = (uint32_t)bitmap_longest_run(&g->dbm);
+    fs->free_blocks += g->desc.free_blocks;
+}
+
+static void group_unload(group_t *g) {
+    bitmap_detach(&g->dbm);
+    bitmap_detach(&g->ibm);
+    free(g->dbuf);
+    free(g->ibuf);
+    g->dbuf = g->ibuf = NULL;
+    g->loaded = g->dirty = 0;
+}
+
+static int group_read(mvfs_t *fs, uint64_t gi) {
+    group_t *g = &fs->g[gi];
+    /* bitmap_t reads whole 64-bit words, so round the private copies up */
+    size_t db = (size_t)div_up(g->blk_len, 8), ib = (size_t)div_up(g->ino_len, 8);
+    g->dbuf = calloc(div_up(db, 8) + 1, 8);
+    g->ibuf = calloc(div_up(ib, 8) + 1, 8);
+    if (!g->dbuf || !g->ibuf) { perror("malloc bitmaps"); group_unload(g); return -1; }
+    if (meta_read(fs, fs->sb.data_bitmap_start, gi * fs->bpg / 8, g->dbuf, db) != 0 ||
+        meta_read(fs, fs->sb.inode_bitmap_start, g->ino_lo / 8, g->ibuf, ib) != 0) { group_unload(g); return -1; }
+    if (bitmap_attach(&g->dbm, g->dbuf, g->blk_len) != 0 ||
+        bitmap_attach(&g->ibm, g->ibuf, g->ino_len) != 0) { perror("malloc bitmaps"); group_unload(g); return -1; }
+    g->loaded = 1;
+    group_refresh(fs, g); /* the bitmaps are authoritative over a stale descriptor */
+    return 0;
+}
+
+static int group_load(mvfs_t *fs, uint64_t gi) {
+    if (fs->g[gi].loaded) return 0;
+    int ph = stats_enter(PH_BITMAP_READ);
+    int rc = group_read(fs, gi);
+    stats_enter(ph);
+    return rc;
+}
+
+/* Reset a group's descriptor to the copy in the (cached) descriptor table */
+static int group_desc_reload(mvfs_t *fs, uint64_t gi) {
+    group_t *g = &fs->g[gi];
+    fs->free_blocks -= g->desc.free_blocks;
+    if (meta_read(fs, fs->sbx.group_desc_start, gi * sizeof(group_desc_t), &g->desc, sizeof(g->desc)) != 0) return -1;
+    if (g->desc.checksum != crc32(&g->desc, offsetof(group_desc_t, checksum))) {
+        fprintf(stderr, "Corrupt group descriptor %" PRIu64 "\n", gi);
+        return -1;
+    }
+    fs->free_blocks += g->desc.free_blocks;
+    return 0;
+}
+
+static int groups_open(mvfs_t *fs) {
+    const superblock_t *sb = &fs->sb;
+    int grouped = sb->version == SB_VERSION_EXT;
+    fs->ngroups = grouped ? fs->sbx.group_count : 1;
+    fs->bpg = grouped ? fs->sbx.blocks_per_group : sb->data_region_blocks;
+    fs->ipg = grouped ? fs->sbx.inodes_per_group : sb->inode_count;
+    if (!(fs->g = calloc(fs->ngroups, sizeof(*fs->g)))) { perror("calloc groups"); return -1; }
+    for (uint64_t i = 0; i < fs->ngroups; ++i) {
+        group_t *g = &fs->g[i];
+        g->blk_lo = i * fs->bpg;
+        g->blk_len = sb->data_region_blocks - g->blk_lo < fs->bpg ? sb->data_region_blocks - g->blk_lo : fs->bpg;
+        g->ino_lo = i * fs->ipg;
+        g->ino_len = g->ino_lo >= sb->inode_count ? 0 :
+                     (sb->inode_count - g->ino_lo < fs->ipg ? sb->inode_count - g->ino_lo : fs->ipg);
+        if (grouped && group_desc_reload(fs, i) != 0) return -1;
+    }
+    return grouped ? 0 : group_load(fs, 0);
+}
+
+/* Write the groups changed by this operation back into the cache */
+static int groups_commit(mvfs_t *fs) {
+    for (uint64_t i = 0; i < fs->ngroups; ++i) {
+        group_t *g = &fs->g[i];
+        if (!g->dirty) continue;
+        if (meta_write(fs, fs->sb.data_bitmap_start, i * fs->bpg / 8, g->dbuf, (size_t)div_up(g->blk_len, 8)) != 0 ||
+            meta_write(fs, fs->sb.inode_bitmap_start, g->ino_lo / 8, g->ibuf, (size_t)div_up(g->ino_len, 8)) != 0)
+            return -1;
+        if (fs->sb.version == SB_VERSION_EXT) {
+            group_desc_t gd = g->desc;
+            group_desc_crc_finalize(&gd);
+            if (meta_write(fs, fs->sbx.group_desc_start, i * sizeof(gd), &gd, sizeof(gd)) != 0) return -1;
+        }
+        g->dirty = 0;
+    }
+    return 0;
+}
+
+/* Throw away this operation's allocations: changed groups reload from the cache */
+static void groups_abort(mvfs_t *fs) {
+    for (uint64_t i = 0; i < fs->ngroups; ++i) {
+        group_t *g = &fs->g[i];
+        if (!g->dirty) continue;
+        group_unload(g);
+        if (fs->sb.version == SB_VERSION_EXT) group_desc_reload(fs, i);
+        else group_load(fs, i);
+    }
+}
+
+/* Mark [start, start+len) of the data region allocated, across group boundaries */
+static void groups_mark(mvfs_t *fs, uint64_t start, uint64_t len) {
+    while (len > 0) {
+        group_t *g = &fs->g[start / fs->bpg];
+        uint64_t n = g->blk_lo + g->blk_len - start < len ? g->blk_lo + g->blk_len - start : len;
+        bitmap_set_range(&g->dbm, start - g->blk_lo, n);
+        g->dirty = 1;
+        group_refresh(fs, g);
+        start += n;
+        len -= n;
+    }
+}
+
+/* Mark [start, start+len) of the data region free, loading the groups it spans */
+static int groups_unmark(mvfs_t *fs, uint64_t start, uint64_t len) {
+    while (len > 0) {
+        uint64_t gi = start / fs->bpg;
+        if (group_load(fs, gi) != 0) return -1;
+        group_t *g = &fs->g[gi];
+        uint64_t n = g->blk_lo + g->blk_len - start < len ? g->blk_lo + g->blk_len - start : len;
+        bitmap_clear_range(&g->dbm, start - g->blk_lo, n);
+        g->dirty = 1;
+        group_refresh(fs, g);
+        start += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int groups_free_inode(mvfs_t *fs, uint64_t idx) {
+    uint64_t gi = idx / fs->ipg;
+    if (group_load(fs, gi) != 0) return -1;
+    group_t *g = &fs->g[gi];
+    bitmap_clear_range(&g->ibm, idx - g->ino_lo, 1);
+    g->dirty = 1;
+    group_refresh(fs, g);
+    return 0;
+}
+
+static int runlist_add(runlist_t *l, uint64_t start, uint64_t len) {
+    if (l->n > 0 && l->v[l->n - 1].start + l->v[l->n - 1].len == start) {
+        l->v[l->n - 1].len += len;
+        return 0;
+    }
+    /* runs freed last block first grow downwards */
+    if (l->n > 0 && start + len == l->v[l->n - 1].start) {
+        l->v[l->n - 1].start = start;
+        l->v[l->n - 1].len += len;
+        return 0;
+    }
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? 2 * l->cap : 16;
+        bitmap_run_t *v = realloc(l->v, cap * sizeof(*v));
+        if (!v) { perror("malloc"); return -1; }
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n].start = start;
+    l->v[l->n++].len = len;
+    return 0;
+}
+
+/*
+ * Pick an inode, preferring (from the group of the previous pick on) a
+ * group with a free run long enough for the file's data, so the two stay
+ * together. -1 with errno ENOSPC when every inode is in use.
+ */
+static int groups_alloc_inode(mvfs_t *fs, uint64_t nblocks, uint64_t *idx) {
+    uint64_t want = nblocks < fs->bpg ? nblocks : fs->bpg;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (uint64_t k = 0; k < fs->ngroups; ++k) {
+            uint64_t gi = (fs->rotor + k) % fs->ngroups;
+            group_t *g = &fs->g[gi];
+            if (g->desc.free_inodes == 0 || (pass == 0 && g->desc.longest_free_run < want)) continue;
+            if (group_load(fs, gi) != 0) return -1;
+            uint64_t i = bitmap_find_zero(&g->ibm, 0);
+            if (i == g->ino_len) continue;
+            bitmap_set_range(&g->ibm, i, 1);
+            g->dirty = 1;
+            group_refresh(fs, g);
+            fs->rotor = gi;
+            *idx = g->ino_lo + i;
+            return 0;
+        }
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+/*
+ * Allocate `n` blocks over the whole data region: one run at or after
+ * `goal` inside a single group when some group's summary says it has
+ * one, otherwise first-fit pieces from the goal's group on, with pieces
+ * that meet across a group boundary merged. Run starts are data-region
+ * relative. Returns the number of runs filled in, or -1 with errno
+ * ENOSPC if fewer than `n` blocks are free, or EFBIG if more than
+ * `max_runs` pieces would be needed. Nothing is marked on failure.
+ */
+static int groups_alloc_blocks(mvfs_t *fs, uint64_t n, uint64_t goal, bitmap_run_t *runs, int max_runs) {
+    if (n == 0) return 0;
+    if (fs->free_blocks < n) { errno = ENOSPC; return -1; }
+    uint64_t first = goal / fs->bpg < fs->ngroups ? goal / fs->bpg : 0;
+
+    if (n <= fs->bpg) {
+        for (uint64_t k = 0; k < fs->ngroups; ++k) {
+            uint64_t gi = (first + k) % fs->ngroups;
+            group_t *g = &fs->g[gi];
+            if (g->desc.longest_free_run < n) continue;
+            if (group_load(fs, gi) != 0) return -1;
+            uint64_t from = k == 0 && goal > g->blk_lo ? goal - g->blk_lo : 0;
+            uint64_t s = bitmap_find_run(&g->dbm, n, from);
+            if (s == g->blk_len && from > 0) s = bitmap_find_run(&g->dbm, n, 0);
+            if (s == g->blk_len) continue;
+            runs[0].start = g->blk_lo + s;
+            runs[0].len = n;
+            groups_mark(fs, runs[0].start, n);
+            return 1;
+        }
+    }
+
+    int nr = 0;
+    uint64_t need = n;
+    for (uint64_t k = 0; k < fs->ngroups && need > 0; ++k) {
+        uint64_t gi = (first + k) % fs->ngroups;
+        group_t *g = &fs->g[gi];
+        if (g->desc.free_blocks == 0) continue;
+        if (group_load(fs, gi) != 0) return -1;
+        uint64_t pos = 0;
+        while (need > 0) {
+            uint64_t z = bitmap_find_zero(&g->dbm, pos);
+            if (z == g->blk_len) break;
+            uint64_t o = bitmap_find_one(&g->dbm, z);
+            uint64_t take = o - z < need ? o - z : need;
+            if (nr > 0 && runs[nr - 1].start + runs[nr - 1].len == g->blk_lo + z) {
+                runs[nr - 1].len += take;
+            } else {
+                if (nr == max_runs) { errno = EFBIG; return -1; }
+                runs[nr].start = g->blk_lo + z;
+                runs[nr].len = take;
+                ++nr;
+            }
+            need -= take;
+            pos = o;
+        }
+    }
+    if (need > 0) { errno = ENOSPC; return -1; }
+    for (int r = 0; r < nr; ++r) groups_mark(fs, runs[r].start, runs[r].len);
+    return nr;
+}
+
+/*
+ * One file being added: where its inode, data blocks and dirent will go.
+ * Files of up to INLINE_DATA_MAX bytes are stored in the inode and get no
+ * blocks. Files of up to 12 blocks keep the classic direct[] mapping; larger ones
+ * are extent-mapped, with a separate extent block past INLINE_EXTENTS runs.
+ */
+typedef struct {
+    size_t size;
+    size_t nblocks;
+    bitmap_run_t *runs;   /* data runs in file order, absolute block numbers */
+    int nruns;
+    uint32_t ext_block;   /* extent block, 0 if the runs fit in the inode */
+    uint64_t inode_idx;   /* 0-based index into the inode table */
+
+    /* deduplicated adds only */
+    uint64_t *blocks;     /* absolute block of each file block */
+    uint8_t *kind;        /* BLK_* for each file block */
+    uint64_t nnew;        /* blocks that need fresh data blocks */
+
+    /* compressed adds only */
+    uint8_t *cdata;       /* the stored stream, block map first */
+    size_t csize;         /* its length; nblocks covers this instead of size */
+} add_plan_t;
+
+enum { BLK_SHARED, BLK_NEW, BLK_REPEAT }; /* an indexed block, a fresh block, or a repeat of file block blocks[i] */
+
+/* Fill in the block mapping of a freshly planned inode */
+static int inode_map_blocks(mvfs_t *fs, inode_t *ino, const add_plan_t *p) {
+    if (p->nblocks <= 12) {
+        size_t b = 0;
+        for (int r = 0; r < p->nruns; ++r)
+            for (uint64_t k = 0; k < p->runs[r].len; ++k) ino->direct[b++] = (uint32_t)(p->runs[r].start + k);
+        return 0;
+    }
+    extent_t ext[EXTENTS_PER_BLOCK];
+    memset(ext, 0, sizeof(ext));
+    for (int r = 0; r < p->nruns; ++r) {
+        ext[r].start = (uint32_t)p->runs[r].start;
+        ext[r].len = (uint32_t)p->runs[r].len;
+    }
+    ino->flags |= INODE_FL_EXTENTS;
+    if (p->ext_block == 0) {
+        memcpy(ino->direct, ext, (size_t)p->nruns * sizeof(extent_t));
+        return 0;
+    }
+    if (meta_write(fs, p->ext_block, 0, ext, BS) != 0) return -1;
+    extent_t head = { p->ext_block, (uint32_t)p->nruns };
+    memcpy(ino->direct, &head, sizeof(head));
+    ino->flags |= INODE_FL_EXTENT_BLOCK;
+    return 0;
+}
+
+/* Every block of an inode's data as runs of absolute blocks, in file order (none for inline data) */
+static int inode_runs(mvfs_t *fs, const inode_t *ino, bitmap_run_t **out) {
+    uint64_t nblocks = (ino->flags & INODE_FL_INLINE) ? 0 :
+                       (ino->flags & INODE_FL_COMPRESSED) ? ino->reserved_0 : div_up(ino->size_bytes, BS);
+    bitmap_run_t *runs = malloc((nblocks > EXTENTS_PER_BLOCK ? nblocks : EXTENTS_PER_BLOCK) * sizeof(*runs) + sizeof(*runs));
+    if (!runs) { perror("malloc runs"); return -1; }
+    int n = 0;
+    if (!(ino->flags & INODE_FL_EXTENTS)) {
+        for (uint64_t b = 0; b < nblocks && b < 12; ++b) {
+            if (n > 0 && runs[n - 1].start + runs[n - 1].len == ino->direct[b]) { runs[n - 1].len++; continue; }
+            runs[n].start = ino->direct[b];
+            runs[n++].len = 1;
+        }
+    } else {
+        extent_t ext[EXTENTS_PER_BLOCK];
+        uint64_t count = INLINE_EXTENTS;
+        memcpy(ext, ino->direct, INLINE_EXTENTS * sizeof(extent_t));
+        if (ino->flags & INODE_FL_EXTENT_BLOCK) {
+            count = ext[0].len;
+            if (count > EXTENTS_PER_BLOCK || meta_read(fs, ext[0].start, 0, ext, BS) != 0) {
+                fprintf(stderr, "Corrupt extent block\n");
+                free(runs);
+                return -1;
+            }
+        }
+        uint64_t have = 0;
+        for (uint64_t e = 0; e < count && have < nblocks; ++e) {
+            uint64_t len = ext[e].len < nblocks - have ? ext[e].len : nblocks - have;
+            runs[n].start = ext[e].start;
+            runs[n++].len = len;
+            have += len;
+        }
+    }
+    for (int r = 0; r < n; ++r) {
+        if (runs[r].start < fs->sb.data_region_start ||
+            runs[r].start + runs[r].len > fs->sb.data_region_start + fs->sb.data_region_blocks) {
+            fprintf(stderr, "Inode maps blocks outside the data region\n");
+            free(runs);
+            return -1;
+        }
+    }
+    *out = runs;
+    return n;
+}
+
+/*
+ * The root directory while an operation runs: 2^k bucket blocks, with a
+ * name stored in bucket mvfs_name_hash() & (nbuckets - 1). The classic
+ * single-block root is the one-bucket case. Each bucket is an ordinary
+ * block of dirents, so linear scanners still read every entry. Buckets are
+ * copied privately on first touch and written back on commit. A full
+ * bucket doubles the directory, splitting every bucket in two, so a lookup
+ * or insert only ever reads one block.
+ */
+typedef struct {
+    inode_t root;
+    uint64_t nbuckets;
+    uint32_t *blk;        /* absolute block of each bucket */
+    uint8_t **buf;        /* private copy of each touched bucket, NULL until then */
+    uint32_t ext_block;   /* root's extent block, 0 if none */
+    int grown;            /* buckets were added: the root's mapping must be rewritten */
+} dir_t;
+
+static void dir_close(dir_t *d) {
+    for (uint64_t i = 0; d->buf && i < d->nbuckets; ++i) free(d->buf[i]);
+    free(d->buf);
+    free(d->blk);
+    memset(d, 0, sizeof(*d));
+}
+
+static int dir_open(mvfs_t *fs, dir_t *d) {
+    memset(d, 0, sizeof(*d));
+    if (inode_read(fs, ROOT_INO - 1, &d->root) != 0) return -1;
+    const inode_t *root = &d->root;
+    d->nbuckets = 1;
+    if (root->flags & INODE_FL_HASHDIR) {
+        d->nbuckets = root->size_bytes / BS;
+        if (root->size_bytes % BS || d->nbuckets < 2 || d->nbuckets > MAX_DIR_BUCKETS || (d->nbuckets & (d->nbuckets - 1))) {
+            fprintf(stderr, "Corrupt root directory\n");
+            return -1;
+        }
+    }
+    d->blk = malloc(d->nbuckets * sizeof(*d->blk));
+    d->buf = calloc(d->nbuckets, sizeof(*d->buf));
+    if (!d->blk || !d->buf) { perror("malloc root directory"); dir_close(d); return -1; }
+
+    if (root->flags & INODE_FL_HASHDIR) {
+        inode_t sized = *root;
+        bitmap_run_t *runs;
+        int nr = inode_runs(fs, &sized, &runs);
+        if (nr < 0) { dir_close(d); return -1; }
+        uint64_t n = 0;
+        for (int r = 0; r < nr; ++r)
+            for (uint64_t k = 0; k < runs[r].len && n < d->nbuckets; ++k) d->blk[n++] = (uint32_t)(runs[r].start + k);
+        free(runs);
+        if (n < d->nbuckets) { fprintf(stderr, "Corrupt root directory\n"); dir_close(d); return -1; }
+        if (root->flags & INODE_FL_EXTENT_BLOCK) {
+            extent_t head;
+            memcpy(&head, root->direct, sizeof(head));
+            d->ext_block = head.start;
+        }
+    } else {
+        d->blk[0] = root->direct[0];
+        if (d->blk[0] < fs->sb.data_region_start || d->blk[0] >= fs->sb.data_region_start + fs->sb.data_region_blocks) {
+            fprintf(stderr, "Root has no data block\n");
+            dir_close(d);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static uint8_t *dir_bucket(mvfs_t *fs, dir_t *d, uint64_t i) {
+    if (!d->buf[i]) {
+        if (!(d->buf[i] = malloc(BS))) { perror("malloc root directory"); return NULL; }
+        if (meta_read(fs, d->blk[i], 0, d->buf[i], BS) != 0) { free(d->buf[i]); d->buf[i] = NULL; return NULL; }
+    }
+    return d->buf[i];
+}
+
+/* Inode number of the root entry called `name`, 0 if there is none, -1 on error */
+static int64_t dir_lookup(mvfs_t *fs, dir_t *d, const char *name) {
+    char key[MAX_NAME];
+    mvfs_name_set(key, name);
+    uint8_t *b = dir_bucket(fs, d, mvfs_name_hash(key) & (d->nbuckets - 1));
+    if (!b) return -1;
+    for (unsigned s = 0; s < BS / DIRENT_SIZE; ++s) {
+        const dirent64_t *e = (const dirent64_t *)(b + s * DIRENT_SIZE);
+        if (e->inode_no != 0 && strncmp(e->name, key, MAX_NAME) == 0) return e->inode_no;
+    }
+    return 0;
+}
+
+/*
+ * Take the entry called `name` out of its bucket: its inode number, 0 if
+ * there is none, -1 on error. A classic root keeps its entries packed, as
+ * its size counts them, so the last entry moves into the freed slot.
+ */
+static int64_t dir_remove(mvfs_t *fs, dir_t *d, const char *name) {
+    char key[MAX_NAME];
+    mvfs_name_set(key, name);
+    uint8_t *b = dir_bucket(fs, d, mvfs_name_hash(key) & (d->nbuckets - 1));
+    if (!b) return -1;
+    dirent64_t *e = (dirent64_t *)b;
+    unsigned slots = BS / DIRENT_SIZE, hit = slots, last = 0;
+    for (unsigned s = 0; s < slots; ++s) {
+        if (e[s].inode_no == 0) continue;
+        last = s;
+        if (hit == slots && strncmp(e[s].name, key, MAX_NAME) == 0) hit = s;
+    }
+    if (hit == slots) return 0;
+    int64_t ino = e[hit].inode_no;
+    if (d->nbuckets == 1 && last != hit) {
+        memcpy(&e[hit], &e[last], DIRENT_SIZE);
+        hit = last;
+    }
+    memset(&e[hit], 0, DIRENT_SIZE);
+    return ino;
+}
+
+/* Physically contiguous stretches of the bucket blocks, in bucket order */
+static int dir_runs(const dir_t *d, bitmap_run_t *runs) {
+    int n = 0;
+    for (uint64_t i = 0; i < d->nbuckets; ++i) {
+        if (n > 0 && runs[n - 1].start + runs[n - 1].len == d->blk[i]) { runs[n - 1].len++; continue; }
+        runs[n].start = d->blk[i];
+        runs[n].len = 1;
+        ++n;
+    }
+    return n;
+}
+
+/*
+ * Double the bucket count: allocate as many new blocks as there are now,
+ * then move every entry whose next hash bit is set from bucket i to
+ * bucket i + nbuckets.
+ */
+static int dir_grow(mvfs_t *fs, dir_t *d, uint32_t *sb_flags) {
+    uint64_t n = d->nbuckets, drs = fs->sb.data_region_start;
+    if (n == MAX_DIR_BUCKETS) { fprintf(stderr, "Root directory is full\n"); return -1; }
+    uint32_t *nblk = realloc(d->blk, 2 * n * sizeof(*nblk));
+    if (nblk) d->blk = nblk;
+    uint8_t **nbuf = realloc(d->buf, 2 * n * sizeof(*nbuf));
+    if (nbuf) d->buf = nbuf;
+    bitmap_run_t *runs = malloc(2 * n * sizeof(*runs));
+    if (!nblk || !nbuf || !runs) { perror("malloc root directory"); free(runs); return -1; }
+
+    int nr = groups_alloc_blocks(fs, n, d->blk[n - 1] + 1 - drs, runs, (int)n);
+    if (nr < 0) {
+        if (errno == ENOSPC) fprintf(stderr, "Not enough free data blocks available\n");
+        free(runs);
+        return -1;
+    }
+    uint64_t i = n;
+    for (int r = 0; r < nr; ++r)
+        for (uint64_t k = 0; k < runs[r].len; ++k) d->blk[i++] = (uint32_t)(drs + runs[r].start + k);
+    for (i = n; i < 2 * n; ++i) d->buf[i] = NULL;
+    for (i = n; i < 2 * n; ++i)
+        if (!(d->buf[i] = calloc(1, BS))) { perror("malloc root directory"); free(runs); return -1; }
+
+    for (i = 0; i < n; ++i) {
+        uint8_t *src = dir_bucket(fs, d, i);
+        if (!src) { free(runs); return -1; }
+        unsigned moved = 0;
+        for (unsigned s = 0; s < BS / DIRENT_SIZE; ++s) {
+            dirent64_t *e = (dirent64_t *)(src + s * DIRENT_SIZE);
+            if (e->inode_no == 0 || strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) continue;
+            if (!(mvfs_name_hash(e->name) & n)) continue;
+            memcpy(d->buf[i + n] + moved++ * DIRENT_SIZE, e, DIRENT_SIZE);
+            memset(e, 0, DIRENT_SIZE);
+        }
+    }
+    d->nbuckets = 2 * n;
+    d->grown = 1;
+
+    /* the root is mapped like a file of nbuckets blocks */
+    if (d->nbuckets > 12) *sb_flags |= SB_FEAT_EXTENTS;
+    nr = dir_runs(d, runs);
+    free(runs);
+    if (d->nbuckets > 12 && nr > (int)EXTENTS_PER_BLOCK) { fprintf(stderr, "Root directory too fragmented\n"); return -1; }
+    if (d->nbuckets > 12 && nr > (int)INLINE_EXTENTS && d->ext_block == 0) {
+        bitmap_run_t eb;
+        if (groups_alloc_blocks(fs, 1, d->blk[d->nbuckets - 1] + 1 - drs, &eb, 1) != 1) {
+            if (errno == ENOSPC) fprintf(stderr, "Not enough free data blocks available\n");
+            return -1;
+        }
+        d->ext_block = (uint32_t)(drs + eb.start);
+    }
+    return 0;
+}
+
+/* Store a finished dirent in its bucket, growing the directory while that bucket is full */
+static int dir_insert(mvfs_t *fs, dir_t *d, const dirent64_t *ent, uint32_t *sb_flags) {
+    for (;;) {
+        uint8_t *b = dir_bucket(fs, d, mvfs_name_hash(ent->name) & (d->nbuckets - 1));
+        if (!b) return -1;
+        for (unsigned s = 0; s < BS / DIRENT_SIZE; ++s) {
+            dirent64_t *e = (dirent64_t *)(b + s * DIRENT_SIZE);
+            if (e->inode_no != 0) continue;
+            memcpy(e, ent, sizeof(*e));
+            return 0;
+        }
+        if (dir_grow(fs, d, sb_flags) != 0) return -1;
+    }
+}
+
+/* Write touched buckets back and, if the directory grew, remap d->root (the caller writes it) */
+static int dir_commit(mvfs_t *fs, dir_t *d, int64_t added) {
+    for (uint64_t i = 0; i < d->nbuckets; ++i)
+        if (d->buf[i] && meta_write(fs, d->blk[i], 0, d->buf[i], BS) != 0) return -1;
+    inode_t *root = &d->root;
+    if (d->grown) {
+        add_plan_t p;
+        memset(&p, 0, sizeof(p));
+        if (!(p.runs = malloc(d->nbuckets * sizeof(*p.runs)))) { perror("malloc root directory"); return -1; }
+        p.nruns = dir_runs(d, p.runs);
+        p.nblocks = d->nbuckets;
+        p.ext_block = p.nruns > (int)INLINE_EXTENTS ? d->ext_block : 0;
+        memset(root->direct, 0, sizeof(root->direct));
+        root->flags &= ~(INODE_FL_EXTENTS | INODE_FL_EXTENT_BLOCK);
+        root->flags |= INODE_FL_HASHDIR;
+        int rc = inode_map_blocks(fs, root, &p);
+        free(p.runs);
+        if (rc != 0) return -1;
+    }
+    /* a hashed root's size covers all of its buckets, a classic one counts its entries */
+    if (root->flags & INODE_FL_HASHDIR) root->size_bytes = d->nbuckets * BS;
+    else root->size_bytes = (uint64_t)((int64_t)root->size_bytes + added * DIRENT_SIZE);
+    return 0;
+}
+
+static int io_init(mvfs_t *fs, int backend, int direct) {
+    if (blkio_init(&fs->io, fs->fd, fs->path, backend, direct) != 0) return -1;
+    if (fs->ovl) {
+        fs->io.remap = ovl_place;
+        fs->io.remap_ctx = fs->ovl;
+    }
+    return 0;
+}
+
+mvfs_t *mvfs_open(const char *path, int mode) {
+    mvfs_t *fs = calloc(1, sizeof(*fs));
+    if (!fs) { perror("calloc"); return NULL; }
+    fs->mode = mode;
+    fs->io.fd = -1;
+    fs->fd = open(path, mode == MVFS_RDWR ? O_RDWR : O_RDONLY);
+    if (fs->fd < 0) { perror("open image"); free(fs); return NULL; }
+    if (!(fs->path = strdup(path))) { perror("strdup"); mvfs_discard(fs); return NULL; }
+
+    uint8_t blk0[BS];
+    struct stat st;
+    if (fstat(fs->fd, &st) != 0) { perror("stat image"); mvfs_discard(fs); return NULL; }
+    if (dev_read(fs, blk0, BS, 0) != 0) { perror("read sb block"); mvfs_discard(fs); return NULL; }
+    /* an overlay: the image is the chain's view, and writes land in the overlay file */
+    if (ovl_is_overlay(blk0)) {
+        if (!(fs->ovl = ovl_open(path, mode == MVFS_RDWR))) { mvfs_discard(fs); return NULL; }
+        st.st_size = (off_t)fs->ovl->len;
+        memcpy(blk0, fs->ovl->view, BS);
+    }
+    if (mvfs_validate(blk0, st.st_size) != 0) { mvfs_discard(fs); return NULL; }
+    memcpy(&fs->sb, blk0, sizeof(fs->sb));
+    if (fs->sb.version == SB_VERSION_EXT) memcpy(&fs->sbx, blk0 + SBX_OFFSET, sizeof(fs->sbx));
+    if (mode == MVFS_RDWR && io_init(fs, BLKIO_PWRITEV, 0) != 0) { mvfs_discard(fs); return NULL; }
+
+    if (fs->sb.flags & SB_FEAT_JOURNAL) {
+        /* the superblock itself may have been logged: check it again after replay */
+        if (journal_replay(fs) != 0 || meta_read(fs, 0, 0, blk0, BS) != 0 || mvfs_validate(blk0, st.st_size) != 0) {
+            mvfs_discard(fs);
+            return NULL;
+        }
+        memcpy(&fs->sb, blk0, sizeof(fs->sb));
+        memcpy(&fs->sbx, blk0 + SBX_OFFSET, sizeof(fs->sbx));
+    }
+    if (mode == MVFS_RDWR) {
+        int ph = stats_enter(PH_BITMAP_READ);
+        int rc = groups_open(fs);
+        stats_enter(ph);
+        if (rc != 0) { mvfs_discard(fs); return NULL; }
+    }
+    return fs;
+}
+
+int mvfs_set_io(mvfs_t *fs, int backend, int direct) {
+    if (fs->mode != MVFS_RDWR) return 0;
+    if (backend == BLKIO_MMAP && fs->ovl) {
+        fprintf(stderr, "An overlay grows as it is written and can't be mapped; use another --io\n");
+        return -1;
+    }
+    if (blkio_flush(&fs->io) != 0) { perror("write image"); return -1; }
+    blkio_fini(&fs->io);
+    return io_init(fs, backend, direct);
+}
+
+/*
+ * Dedup index buckets touched by the add or removal in progress, copied
+ * privately on first touch and written back on commit, like the
+ * directory's buckets. While an add is planned, an entry for one of its
+ * own new blocks holds the file block index in `blk` and has
+ * DEDUP_PENDING set in `refs`. On a journaled image one operation may only
+ * touch as many buckets as its transaction leaves room for in the journal
+ * (dedup_budget()); past that, an add neither looks up nor indexes blocks.
+ */
+#define DEDUP_PENDING 0x80000000u
+
+typedef struct {
+    uint64_t bucket;
+    dedup_entry_t *e;     /* DEDUP_ENTRIES_PER_BLOCK entries; NULL for an empty slot */
+    int dirty;
+} dstage_t;
+
+typedef struct {
+    dstage_t *v;          /* open addressing on the bucket number */
+    uint64_t cap, n, limit;
+    dedup_entry_t **pending;
+    uint64_t npending;
+} dedup_t;
+
+static void dedup_close(dedup_t *d) {
+    for (uint64_t i = 0; d->v && i < d->cap; ++i) free(d->v[i].e);
+    free(d->v);
+    free(d->pending);
+    memset(d, 0, sizeof(*d));
+}
+
+/*
+ * Index blocks one operation may change in a journaled transaction: the
+ * journal less the blocks already dirty, the descriptor and commit blocks
+ * and a bound on the operation's other metadata. Besides the inode, the
+ * root inode, the superblock and the group descriptors, that is at most
+ * every bucket of the directory twice (a doubling) and the bitmap blocks
+ * the file's data spans, counted twice since a run may straddle two.
+ */
+static uint64_t dedup_budget(const mvfs_t *fs, const dir_t *dir, uint64_t nblocks) {
+    if (!(fs->sb.flags & SB_FEAT_JOURNAL)) return UINT64_MAX;
+    uint64_t jb = fs->sbx.journal_blocks;
+    uint64_t other = 16 + 2 * dir->nbuckets + 2 * div_up(nblocks, BS * 8);
+    uint64_t used = fs->ndirty + other + 1 + journal_desc_blocks(jb, fs->njruns + EXTENTS_PER_BLOCK);
+    return used < jb ? jb - used : 0;
+}
+
+static int dedup_open(mvfs_t *fs, dedup_t *d, const dir_t *dir, uint64_t nblocks) {
+    memset(d, 0, sizeof(*d));
+    d->limit = dedup_budget(fs, dir, nblocks);
+    uint64_t most = nblocks < fs->sbx.dedup_blocks ? nblocks : fs->sbx.dedup_blocks;
+    if (most > d->limit) most = d->limit;
+    for (d->cap = 16; d->cap < 2 * most; d->cap *= 2) {}
+    d->v = calloc(d->cap, sizeof(*d->v));
+    d->pending = malloc(nblocks * sizeof(*d->pending));
+    if (!d->v || !d->pending) { perror("malloc dedup index"); dedup_close(d); return -1; }
+    return 0;
+}
+
+/* The table slot of bucket b: the staged bucket, or the empty slot it would take */
+static dstage_t *dedup_slot(const dedup_t *d, uint64_t b) {
+    uint64_t i = (b * 0x9E3779B97F4A7C15ull) & (d->cap - 1);
+    while (d->v[i].e && d->v[i].bucket != b) i = (i + 1) & (d->cap - 1);
+    return &d->v[i];
+}
+
+/* The staged bucket for fingerprint fp in *out, or NULL once the operation may touch no more; -1 on error */
+static int dedup_bucket(mvfs_t *fs, dedup_t *d, uint64_t fp, dstage_t **out) {
+    uint64_t b = fp & (fs->sbx.dedup_blocks - 1);
+    dstage_t *v = dedup_slot(d, b);
+    *out = NULL;
+    if (v->e) { *out = v; return 0; }
+    if (d->n >= d->limit || 2 * (d->n + 1) > d->cap) return 0;
+    if (!(v->e = malloc(BS))) { perror("malloc dedup bucket"); return -1; }
+    if (meta_read(fs, fs->sbx.dedup_start + b, 0, v->e, BS) != 0) { free(v->e); v->e = NULL; return -1; }
+    v->bucket = b;
+    d->n++;
+    *out = v;
+    return 0;
+}
+
+/* Whether entry e's block holds exactly `data`: 1, 0, or -1 on a read error */
+static int dedup_same(mvfs_t *fs, int fd, size_t size, const dedup_entry_t *e, const uint8_t *data, uint8_t *scratch) {
+    if (e->refs & DEDUP_PENDING) {
+        /* an earlier block of this file, zero padded like its data block will be */
+        uint64_t off = (uint64_t)e->blk * BS;
+        size_t n = size - off < BS ? size - off : BS;
+        if (fio_read_full(fd, scratch, n, (off_t)off) != 0) return -1;
+        memset(scratch + n, 0, BS - n);
+        return memcmp(scratch, data, BS) == 0;
+    }
+    if (e->blk < fs->sb.data_region_start || e->blk >= fs->sb.data_region_start + fs->sb.data_region_blocks) return 0;
+    /* data added since the last flush is still only in the queue */
+    const uint8_t *q = blkio_find(&fs->io, e->blk);
+    if (q) return memcmp(q, data, BS) == 0;
+    if (dev_read(fs, scratch, BS, (off_t)e->blk * BS) != 0) return -1;
+    return memcmp(scratch, data, BS) == 0;
+}
+
+/*
+ * Fingerprint every block of the file and sort it into a block already in
+ * the index (its reference count goes up), a repeat of an earlier block
+ * of the same file, or a new block, which gets a pending index entry.
+ */
+static int dedup_plan(mvfs_t *fs, add_plan_t *p, dedup_t *d, const char *path) {
+    const uint64_t CHUNK_BLOCKS = (1u << 20) / BS;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror("open file to add"); return -1; }
+    uint8_t *chunk = malloc((CHUNK_BLOCKS + 1) * BS), *scratch = chunk + CHUNK_BLOCKS * BS;
+    p->blocks = malloc(p->nblocks * sizeof(*p->blocks));
+    p->kind = malloc(p->nblocks);
+    if (!chunk || !p->blocks || !p->kind) { perror("malloc"); free(chunk); close(fd); return -1; }
+    int rc = 0;
+    for (uint64_t c = 0; rc == 0 && c < p->nblocks; c += CHUNK_BLOCKS) {
+        uint64_t nb = p->nblocks - c < CHUNK_BLOCKS ? p->nblocks - c : CHUNK_BLOCKS;
+        size_t bytes = p->size - c * BS < nb * BS ? p->size - c * BS : nb * BS;
+        if (fio_read_full(fd, chunk, bytes, (off_t)(c * BS)) != 0) { perror("read file to add"); rc = -1; break; }
+        memset(chunk + bytes, 0, nb * BS - bytes);
+        for (uint64_t k = 0; rc == 0 && k < nb; ++k) {
+            uint64_t i = c + k;
+            const uint8_t *data = chunk + k * BS;
+            uint64_t fp = mvfs_block_fp(data);
+            dstage_t *st;
+            p->kind[i] = BLK_NEW;
+            if ((rc = dedup_bucket(fs, d, fp, &st)) != 0 || !st) continue;
+            dedup_entry_t *hit = NULL, *slot = NULL;
+            for (unsigned j = 0; j < DEDUP_ENTRIES_PER_BLOCK && !hit; ++j) {
+                dedup_entry_t *e = &st->e[j];
+                if (e->blk == 0 && !(e->refs & DEDUP_PENDING)) { if (!slot) slot = e; continue; }
+                if (e->fp != fp || (e->refs & ~DEDUP_PENDING) >= ~DEDUP_PENDING) continue;
+                int same = dedup_same(fs, fd, p->size, e, data, scratch);
+                if (same < 0) { perror("read block to compare"); rc = -1; break; }
+                if (same) hit = e;
+            }
+            if (rc != 0) break;
+            if (hit) {
+                p->kind[i] = (hit->refs & DEDUP_PENDING) ? BLK_REPEAT : BLK_SHARED;
+                p->blocks[i] = hit->blk;
+                hit->refs++;
+                st->dirty = 1;
+                continue;
+            }
+            if (slot) {
+                *slot = (dedup_entry_t){ fp, (uint32_t)i, 1 | DEDUP_PENDING };
+                d->pending[d->npending++] = slot;
+                st->dirty = 1;
+            }
+        }
+    }
+    for (uint64_t i = 0; i < p->nblocks; ++i) p->nnew += p->kind[i] == BLK_NEW;
+    free(chunk);
+    close(fd);
+    return rc;
+}
+
+/*
+ * Hand the allocated runs (absolute) out to the new blocks in file order,
+ * resolve repeats and pending entries, and replace p->runs with the file's
+ * mapping in file order. -1 with errno EFBIG if that mapping needs more
+ * extents than an inode can hold.
+ */
+static int dedup_map(add_plan_t *p, dedup_t *d) {
+    uint64_t i = 0;
+    for (int r = 0; r < p->nruns; ++r)
+        for (uint64_t k = 0; k < p->runs[r].len; ++k) {
+            while (p->kind[i] != BLK_NEW) ++i;
+            p->blocks[i++] = p->runs[r].start + k;
+        }
+    for (i = 0; i < p->nblocks; ++i)
+        if (p->kind[i] == BLK_REPEAT) p->blocks[i] = p->blocks[p->blocks[i]];
+    for (uint64_t k = 0; k < d->npending; ++k) {
+        d->pending[k]->blk = (uint32_t)p->blocks[d->pending[k]->blk];
+        d->pending[k]->refs &= ~DEDUP_PENDING;
+    }
+    int max_runs = p->nblocks <= 12 ? 12 : (int)EXTENTS_PER_BLOCK, n = 0;
+    bitmap_run_t *runs = malloc((size_t)max_runs * sizeof(*runs));
+    if (!runs) { perror("malloc runs"); return -1; }
+    for (i = 0; i < p->nblocks; ++i) {
+        if (n > 0 && runs[n - 1].start + runs[n - 1].len == p->blocks[i]) { runs[n - 1].len++; continue; }
+        if (n == max_runs) { free(runs); errno = EFBIG; return -1; }
+        runs[n].start = p->blocks[i];
+        runs[n++].len = 1;
+    }
+    free(p->runs);
+    p->runs = runs;
+    p->nruns = n;
+    return 0;
+}
+
+static int dedup_commit(mvfs_t *fs, dedup_t *d) {
+    for (uint64_t i = 0; i < d->cap; ++i)
+        if (d->v[i].e && d->v[i].dirty && meta_write(fs, fs->sbx.dedup_start + d->v[i].bucket, 0, d->v[i].e, BS) != 0) return -1;
+    return 0;
+}
+
+int mvfs_set_dedup(mvfs_t *fs, int on) {
+    if (on && !(fs->sb.flags & SB_FEAT_DEDUP)) {
+        fprintf(stderr, "Image has no dedup index (build it with mkfs_builder --dedup)\n");
+        return -1;
+    }
+    fs->dedup = on;
+    return 0;
+}
+
+void mvfs_set_compress(mvfs_t *fs, int on) {
+    fs->compress = on;
+}
+
+int mvfs_set_punch(mvfs_t *fs, int on) {
+    if (on && fs->ovl) { fprintf(stderr, "Can't punch holes in an overlay\n"); return -1; }
+    fs->punch = on;
+    return 0;
+}
+
+/*
+ * Compress a file COMPRESS_UNIT at a time behind its block map into
+ * p->cdata. Leaves p->cdata NULL (and returns 0) as soon as the stream
+ * could no longer come out at least one block shorter than the file.
+ */
+static int compress_plan(add_plan_t *p, const char *path) {
+    const size_t CHUNK = 1u << 20;
+    uint64_t units = div_up(p->size, COMPRESS_UNIT);
+    size_t limit = (p->nblocks - 1) * BS, pos = units * sizeof(uint32_t), cap = 0;
+    if (pos >= limit) return 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror("open file to add"); return -1; }
+    uint8_t *chunk = malloc(CHUNK), *out = NULL;
+    uint32_t *map = malloc(units * sizeof(*map));
+    if (!chunk || !map) { perror("malloc"); goto fail; }
+    for (size_t c = 0; c < p->size; c += CHUNK) {
+        size_t bytes = p->size - c < CHUNK ? p->size - c : CHUNK;
+        if (fio_read_full(fd, chunk, bytes, (off_t)c) != 0) { perror("read file to add"); goto fail; }
+        for (size_t k = 0; k < bytes; k += COMPRESS_UNIT) {
+            size_t ulen = bytes - k < COMPRESS_UNIT ? bytes - k : COMPRESS_UNIT;
+            if (cap < pos + ulen && cap < limit) {
+                size_t want = cap ? cap : CHUNK;
+                while (want < pos + ulen && want < limit) want *= 2;
+                if (want > limit) want = limit;
+                uint8_t *grown = realloc(out, want);
+                if (!grown) { perror("malloc"); goto fail; }
+                out = grown;
+                cap = want;
+            }
+            size_t room = cap - pos, n = lz_compress(chunk + k, ulen, out + pos, room < ulen - 1 ? room : ulen - 1);
+            if (n == 0) {
+                if (ulen > room) goto give_up;
+                memcpy(out + pos, chunk + k, ulen);
+                n = ulen;
+            }
+            pos += n;
+            map[(c + k) / COMPRESS_UNIT] = (uint32_t)pos;
+        }
+    }
+    memcpy(out, map, units * sizeof(*map));
+    p->cdata = out;
+    p->csize = pos;
+    p->nblocks = div_up(pos, BS);
+    free(map);
+    free(chunk);
+    close(fd);
+    return 0;
+
+give_up:
+    free(out);
+    free(map);
+    free(chunk);
+    close(fd);
+    return 0;
+
+fail:
+    free(out);
+    free(map);
+    free(chunk);
+    close(fd);
+    return -1;
+}
+
+/* Queued file data is flushed early once it holds this much */
+#define DATA_QUEUE_BYTES (64u << 20)
+
+/*
+ * Read a planned file (or copy its compressed stream) into aligned chunks
+ * of at most 1 MiB and queue them for its blocks. Chunks of one run are
+ * adjacent, and so are the runs of consecutive small files, so the flush
+ * turns them into a few large writes.
+ */
+static int write_file_data(mvfs_t *fs, const add_plan_t *p, const char *path) {
+    int fd = -1;
+    if (!p->cdata && (fd = open(path, O_RDONLY)) < 0) { perror("open file to add"); return -1; }
+    const uint64_t CHUNK_BLOCKS = (1u << 20) / BS;
+    size_t done = 0, total = p->cdata ? p->csize : p->size;
+    for (int r = 0; r < p->nruns; ++r) {
+        for (uint64_t k = 0; k < p->runs[r].len; k += CHUNK_BLOCKS) {
+            uint64_t nb = p->runs[r].len - k < CHUNK_BLOCKS ? p->runs[r].len - k : CHUNK_BLOCKS;
+            size_t n = (size_t)nb * BS;
+            size_t bytes = total - done < n ? total - done : n;
+            uint8_t *buf = blkio_alloc(nb);
+            if (!buf) { perror("malloc"); goto fail; }
+            if (p->cdata) memcpy(buf, p->cdata + done, bytes);
+            else if (fio_read_full(fd, buf, bytes, (off_t)done) != 0) { perror("fread file chunk"); free(buf); goto fail; }
+            memset(buf + bytes, 0, n - bytes);
+            for (uint64_t b = 0; b < nb; ++b) cache_drop(fs, p->runs[r].start + k + b);
+            if ((fs->sb.flags & SB_FEAT_JOURNAL) && journal_note_data(fs, p->runs[r].start + k, buf, nb) != 0) {
+                free(buf);
+                goto fail;
+            }
+            if (blkio_write(&fs->io, p->runs[r].start + k, buf, nb, 1) != 0) { perror("malloc"); free(buf); goto fail; }
+            done += bytes;
+            if (fs->io.queued_bytes >= DATA_QUEUE_BYTES && blkio_flush(&fs->io) != 0) {
+                perror("write file data");
+                goto fail;
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    return 0;
+
+fail:
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+/* Queue the new blocks of a deduplicated file, one buffer per stretch of adjacent new blocks */
+static int write_dedup_data(mvfs_t *fs, const add_plan_t *p, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror("open file to add"); return -1; }
+    const uint64_t CHUNK_BLOCKS = (1u << 20) / BS;
+    for (uint64_t i = 0; i < p->nblocks; ) {
+        if (p->kind[i] != BLK_NEW) { ++i; continue; }
+        uint64_t j = i + 1;
+        while (j < p->nblocks && j - i < CHUNK_BLOCKS && p->kind[j] == BLK_NEW && p->blocks[j] == p->blocks[i] + (j - i)) ++j;
+        uint64_t nb = j - i;
+        size_t bytes = p->size - i * BS < nb * BS ? p->size - i * BS : nb * BS;
+        uint8_t *buf = blkio_alloc(nb);
+        if (!buf) { perror("malloc"); close(fd); return -1; }
+        if (fio_read_full(fd, buf, bytes, (off_t)(i * BS)) != 0) { perror("fread file chunk"); free(buf); close(fd); return -1; }
+        memset(buf + bytes, 0, nb * BS - bytes);
+        for (uint64_t b = 0; b < nb; ++b) cache_drop(fs, p->blocks[i] + b);
+        if ((fs->sb.flags & SB_FEAT_JOURNAL) && journal_note_data(fs, p->blocks[i], buf, nb) != 0) {
+            free(buf);
+            close(fd);
+            return -1;
+        }
+        if (blkio_write(&fs->io, p->blocks[i], buf, nb, 1) != 0) { perror("malloc"); free(buf); close(fd); return -1; }
+        if (fs->io.queued_bytes >= DATA_QUEUE_BYTES && blkio_flush(&fs->io) != 0) {
+            perror("write file data");
+            close(fd);
+            return -1;
+        }
+        i = j;
+    }
+    close(fd);
+    return 0;
+}
+
+static int add_file(mvfs_t *fs, const char *name, const char *path, uint64_t *ino) {
+    const superblock_t *sb = &fs->sb;
+    add_plan_t plan, *p = &plan;
+    memset(p, 0, sizeof(*p));
+    dir_t dir;
+    memset(&dir, 0, sizeof(dir));
+    dedup_t dd;
+    memset(&dd, 0, sizeof(dd));
+    uint32_t sb_flags = sb->flags;
+    uint64_t goal = fs->goal;
+
+    /*
+     * keep each transaction well inside the journal: commit what is pending
+     * before it could overflow, or before blocks it frees could be reused
+     */
+    if ((sb->flags & SB_FEAT_JOURNAL) && (fs->jfreed || (fs->ndirty + 64) * 2 > fs->sbx.journal_blocks) &&
+        mvfs_sync(fs) != 0) return -1;
+    size_t io_mark = fs->io.n, jruns_mark = fs->njruns;
+    uint64_t jlast_len = fs->njruns ? fs->jruns[fs->njruns - 1].len : 0;
+    uint32_t jcrc_mark = fs->jdata_crc;
+
+    struct stat st;
+    if (stat(path, &st) != 0) { perror("open file to add"); return -1; }
+    p->size = (size_t)st.st_size;
+
+    dirent64_t ent;
+    memset(&ent, 0, sizeof(ent));
+    ent.type = 1; /* file */
+    mvfs_name_set(ent.name, name);
+    if (dir_open(fs, &dir) != 0) return -1;
+    int64_t found = dir_lookup(fs, &dir, ent.name);
+    if (found < 0) goto fail;
+    if (found) { fprintf(stderr, "File '%s' already exists in root\n", ent.name); goto fail; }
+
+    /* tiny files go in the inode, up to 12 blocks map directly, anything larger through extents */
+    int inline_data = p->size > 0 && p->size <= INLINE_DATA_MAX;
+    p->nblocks = inline_data ? 0 : (p->size + BS - 1) / BS;
+    /* compressed: the stream's blocks are mapped like a file's, if there are fewer of them */
+    if (fs->compress && p->nblocks > 1) {
+        stats_enter(PH_DATA_WRITE);
+        if (compress_plan(p, path) != 0) goto fail;
+        stats_enter(PH_ALLOC);
+    }
+    if (p->nblocks > sb->data_region_blocks) {
+        fprintf(stderr, "File too large: requires %zu blocks (data region has %" PRIu64 ")\n",
+                p->nblocks, sb->data_region_blocks);
+        goto fail;
+    }
+    /* deduplicated: only the blocks the index does not already hold need allocating */
+    int dedup = fs->dedup && p->nblocks > 0 && !p->cdata;
+    uint64_t nalloc = p->nblocks;
+    if (dedup) {
+        if (dedup_open(fs, &dd, &dir, p->nblocks) != 0 || dedup_plan(fs, p, &dd, path) != 0) goto fail;
+        nalloc = p->nnew;
+    }
+    int max_runs = nalloc <= 12 ? 12 : (int)EXTENTS_PER_BLOCK;
+    if (!(p->runs = malloc((size_t)max_runs * sizeof(*p->runs)))) { perror("malloc runs"); goto fail; }
+
+    /* first-fit within a group that can also hold the data */
+    if (groups_alloc_inode(fs, nalloc, &p->inode_idx) != 0) {
+        if (errno == ENOSPC) fprintf(stderr, "No free inode available\n");
+        goto fail;
+    }
+
+    /* one contiguous run when possible, right after the previous file if it shares the inode's group */
+    const group_t *ig = &fs->g[fs->rotor];
+    if (goal < ig->blk_lo || goal >= ig->blk_lo + ig->blk_len) goal = ig->blk_lo;
+    p->nruns = groups_alloc_blocks(fs, nalloc, goal, p->runs, max_runs);
+    if (p->nruns < 0) {
+        if (errno == EFBIG) fprintf(stderr, "Free data blocks too fragmented for '%s'\n", name);
+        else if (errno == ENOSPC) fprintf(stderr, "Not enough free data blocks available\n");
+        goto fail;
+    }
+    for (int r = 0; r < p->nruns; ++r) {
+        goal = p->runs[r].start + p->runs[r].len;
+        p->runs[r].start += sb->data_region_start;
+    }
+    if (dedup && dedup_map(p, &dd) != 0) {
+        if (errno == EFBIG) fprintf(stderr, "Shared blocks split '%s' into too many extents\n", name);
+        goto fail;
+    }
+    if (p->nblocks > 12 && p->nruns > (int)INLINE_EXTENTS) {
+        bitmap_run_t eb;
+        if (groups_alloc_blocks(fs, 1, goal, &eb, 1) != 1) {
+            if (errno == ENOSPC) fprintf(stderr, "Not enough free data blocks available\n");
+            goto fail;
+        }
+        p->ext_block = (uint32_t)(sb->data_region_start + eb.start);
+    }
+    if (p->nblocks > 12) sb_flags |= SB_FEAT_EXTENTS;
+    if (inline_data) sb_flags |= SB_FEAT_INLINE;
+    if (p->cdata) sb_flags |= SB_FEAT_COMPRESS;
+
+    ent.inode_no = (uint32_t)(p->inode_idx + 1); /* store 1-indexed inode number */
+    dirent_checksum_finalize(&ent);
+    if (dir_insert(fs, &dir, &ent, &sb_flags) != 0) goto fail;
+    if (dir.nbuckets > 1) sb_flags |= SB_FEAT_HASHDIR;
+
+    /* queue file data for the (still unreferenced) free blocks */
+    stats_enter(PH_DATA_WRITE);
+    if ((dedup ? write_dedup_data(fs, p, path) : write_file_data(fs, p, path)) != 0) goto fail;
+
+    /* commit: inode, root buckets, root inode and bitmaps go into the cache */
+    stats_enter(PH_META_WRITE);
+    uint64_t now = (uint64_t)time(NULL);
+    inode_t newino;
+    memset(&newino, 0, sizeof(newino));
+    newino.mode = 0x8000; /* file */
+    newino.links = 1;
+    newino.size_bytes = (uint64_t)p->size;
+    newino.atime = newino.mtime = newino.ctime = now;
+    if (inline_data) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) { perror("open file to add"); goto fail; }
+        int rc = fio_read_full(fd, (uint8_t *)&newino + INLINE_DATA_OFFSET, p->size, 0);
+        close(fd);
+        if (rc != 0) { perror("read file to add"); goto fail; }
+        newino.flags = INODE_FL_INLINE;
+    } else if (inode_map_blocks(fs, &newino, p) != 0) goto fail;
+    if (p->cdata) {
+        newino.flags |= INODE_FL_COMPRESSED;
+        newino.reserved_0 = (uint32_t)p->nblocks;
+    }
+    inode_crc_finalize(&newino);
+    if (inode_write(fs, p->inode_idx, &newino) != 0) goto fail;
+
+    /* update root inode metadata (links, size, mapping) and recompute CRC */
+    if (dir_commit(fs, &dir, 1) != 0) goto fail;
+    dir.root.links += 1;
+    inode_crc_finalize(&dir.root);
+    if (inode_write(fs, ROOT_INO - 1, &dir.root) != 0) goto fail;
+    if (groups_commit(fs) != 0) goto fail;
+    if (dedup && dedup_commit(fs, &dd) != 0) goto fail;
+
+    /* advertise newly used on-disk features */
+    if (sb_flags != fs->sb.flags) {
+        fs->sb.flags = sb_flags;
+        fs->sb_dirty = 1;
+    }
+    fs->goal = goal;
+    *ino = p->inode_idx + 1;
+    dir_close(&dir);
+    dedup_close(&dd);
+    free(p->runs);
+    free(p->blocks);
+    free(p->kind);
+    free(p->cdata);
+    return 0;
+
+fail:
+    groups_abort(fs);
+    if (fs->io.n > io_mark) blkio_truncate(&fs->io, io_mark);
+    fs->njruns = jruns_mark;
+    if (jruns_mark) fs->jruns[jruns_mark - 1].len = jlast_len;
+    fs->jdata_crc = jcrc_mark;
+    dir_close(&dir);
+    dedup_close(&dd);
+    free(p->runs);
+    free(p->blocks);
+    free(p->kind);
+    free(p->cdata);
+    return -1;
+}
+
+int mvfs_add(mvfs_t *fs, const char *name, const char *path, uint64_t *ino) {
+    if (fs->mode != MVFS_RDWR) { fprintf(stderr, "Image is open read-only\n"); return -1; }
+    int ph = stats_enter(PH_ALLOC);
+    int rc = add_file(fs, name, path, ino);
+    stats_enter(ph);
+    return rc;
+}
+
+/* Up to len bytes at offset pos of the data the runs map; the bytes read, or -1 */
+static ssize_t runs_read(mvfs_t *fs, const bitmap_run_t *runs, int nr, uint64_t pos, uint8_t *dst, size_t len) {
+    /* one read per run the range touches */
+    size_t done = 0;
+    uint64_t lpos = 0;
+    for (int r = 0; r < nr && done < len; ++r) {
+        uint64_t rbytes = runs[r].len * BS;
+        if (pos + done >= lpos + rbytes) { lpos += rbytes; continue; }
+        uint64_t in_run = pos + done - lpos;
+        size_t n = rbytes - in_run < len - done ? (size_t)(rbytes - in_run) : len - done;
+        if (dev_read(fs, dst + done, n, (off_t)(runs[r].start * BS + in_run)) != 0) {
+            perror("read file data");
+            return -1;
+        }
+        done += n;
+        lpos += rbytes;
+    }
+    return (ssize_t)done;
+}
+
+/* Read a compressed file's range by decoding each unit it touches */
+static ssize_t read_compressed(mvfs_t *fs, const inode_t *ino, const bitmap_run_t *runs, int nr,
+                               uint8_t *dst, size_t len, uint64_t off) {
+    if (len == 0) return 0;
+    uint64_t u0 = off / COMPRESS_UNIT, u1 = (off + len - 1) / COMPRESS_UNIT, stream_len = (uint64_t)ino->reserved_0 * BS;
+    size_t maplen = (size_t)(u1 + 1) * sizeof(uint32_t), done = 0;
+    uint32_t *map = malloc(maplen);
+    uint8_t *in = malloc(COMPRESS_UNIT), *out = malloc(COMPRESS_UNIT);
+    if (!map || !in || !out) { perror("malloc"); goto fail; }
+    ssize_t got = runs_read(fs, runs, nr, 0, (uint8_t *)map, maplen);
+    if (got < 0) goto fail;
+    if ((size_t)got != maplen) goto corrupt;
+    for (uint64_t u = u0; u <= u1; ++u) {
+        uint64_t start, end, ustart = u * COMPRESS_UNIT;
+        size_t ulen = ino->size_bytes - ustart < COMPRESS_UNIT ? (size_t)(ino->size_bytes - ustart) : COMPRESS_UNIT;
+        if (mvfs_unit_span(map, ino->size_bytes, u, stream_len, &start, &end) != 0 || end - start > ulen) goto corrupt;
+        if ((got = runs_read(fs, runs, nr, start, in, (size_t)(end - start))) < 0) goto fail;
+        if ((uint64_t)got != end - start) goto corrupt;
+        if (mvfs_unit_decode(in, (size_t)(end - start), out, ulen) != 0) goto corrupt;
+        uint64_t from = off + done - ustart;
+        size_t n = ulen - from < len - done ? (size_t)(ulen - from) : len - done;
+        memcpy(dst + done, out + from, n);
+        done += n;
+    }
+    free(map);
+    free(in);
+    free(out);
+    return (ssize_t)done;
+
+corrupt:
+    fprintf(stderr, "Corrupt compressed file\n");
+fail:
+    free(map);
+    free(in);
+    free(out);
+    return -1;
+}
+
+ssize_t mvfs_read(mvfs_t *fs, const char *name, void *buf, size_t len, uint64_t off) {
+    /* file data added since the last flush is still in the queue */
+    if (fs->io.n > 0 && blkio_flush(&fs->io) != 0) { perror("write image"); return -1; }
+    dir_t dir;
+    if (dir_open(fs, &dir) != 0) return -1;
+    int64_t ino_no = dir_lookup(fs, &dir, name);
+    dir_close(&dir);
+    if (ino_no < 0) return -1;
+    if (ino_no == 0 || (uint64_t)ino_no > fs->sb.inode_count) {
+        fprintf(stderr, "No such file '%s'\n", name);
+        errno = ENOENT;
+        return -1;
+    }
+
+    inode_t ino;
+    if (inode_read(fs, (uint64_t)ino_no - 1, &ino) != 0) return -1;
+    if (off >= ino.size_bytes) return 0;
+    if (len > ino.size_bytes - off) len = (size_t)(ino.size_bytes - off);
+    if (ino.flags & INODE_FL_INLINE) {
+        if (ino.size_bytes > INLINE_DATA_MAX) { fprintf(stderr, "Corrupt inline inode\n"); return -1; }
+        memcpy(buf, (const uint8_t *)&ino + INLINE_DATA_OFFSET + off, len);
+        return (ssize_t)len;
+    }
+
+    bitmap_run_t *runs;
+    int nr = inode_runs(fs, &ino, &runs);
+    if (nr < 0) return -1;
+    ssize_t rc;
+    if (ino.flags & INODE_FL_COMPRESSED) rc = read_compressed(fs, &ino, runs, nr, buf, len, off);
+    else rc = runs_read(fs, runs, nr, off, buf, len);
+    free(runs);
+    return rc;
+}
+
+/*
+ * Drop one reference to data block blk from the dedup index: 1 if the
+ * block is still shared, 0 if it can be freed (its entry, if it had one,
+ * is gone), 2 if it has an entry but the operation may change no more
+ * index blocks, -1 on error. A block without an entry changes nothing, so
+ * only blocks that were indexed use up the budget.
+ */
+static int dedup_unref(mvfs_t *fs, dedup_t *d, uint64_t blk, uint8_t *scratch) {
+    /* data added since the last flush is still only in the queue */
+    const uint8_t *q = blkio_find(&fs->io, blk);
+    if (!q) {
+        if (dev_read(fs, scratch, BS, (off_t)blk * BS) != 0) { perror("read block"); return -1; }
+        q = scratch;
+    }
+    uint64_t fp = mvfs_block_fp(q);
+    if (!dedup_slot(d, fp & (fs->sbx.dedup_blocks - 1))->e) {
+        /* not staged yet: look before staging it */
+        const dedup_entry_t *e = (const dedup_entry_t *)scratch;
+        if (meta_read(fs, fs->sbx.dedup_start + (fp & (fs->sbx.dedup_blocks - 1)), 0, scratch, BS) != 0) return -1;
+        unsigned j = 0;
+        while (j < DEDUP_ENTRIES_PER_BLOCK && e[j].blk != blk) ++j;
+        if (j == DEDUP_ENTRIES_PER_BLOCK) return 0;
+    }
+    dstage_t *st;
+    if (dedup_bucket(fs, d, fp, &st) != 0) return -1;
+    if (!st) return 2;
+    for (unsigned j = 0; j < DEDUP_ENTRIES_PER_BLOCK; ++j) {
+        dedup_entry_t *e = &st->e[j];
+        if (e->blk != blk) continue;
+        st->dirty = 1;
+        if (--e->refs > 0) return 1;
+        memset(e, 0, sizeof(*e));
+        return 0;
+    }
+    return 0;
+}
+
+/*
+ * Free the blocks of the runs (`nblocks` in all) from file block `from`
+ * on, last block first, minding shared blocks when a dedup index is open.
+ * 1 if the dedup index can take no more changes in this transaction: the
+ * blocks from *stop on were released, the ones before it were not.
+ */
+static int release_runs(mvfs_t *fs, const bitmap_run_t *runs, int nr, uint64_t nblocks, uint64_t from, dedup_t *dd,
+                        runlist_t *freed, uint64_t *stop) {
+    uint8_t *scratch = NULL;
+    if (dd->v && !(scratch = malloc(BS))) { perror("malloc"); return -1; }
+    uint64_t fb = nblocks;
+    int rc = 0;
+    for (int r = nr - 1; r >= 0 && rc == 0; --r) {
+        fb -= runs[r].len;
+        uint64_t lo = from <= fb ? 0 : (from - fb < runs[r].len ? from - fb : runs[r].len), k = runs[r].len;
+        while (k > lo && rc == 0) {
+            uint64_t n = k - lo, blk = runs[r].start + k - n;
+            if (dd->v) {
+                n = 1;
+                blk = runs[r].start + k - 1;
+                int shared = dedup_unref(fs, dd, blk, scratch);
+                if (shared < 0) rc = -1;
+                else if (shared == 2) { *stop = fb + k; rc = 1; }
+                if (shared != 0) { --k; continue; }
+            }
+            if (groups_unmark(fs, blk - fs->sb.data_region_start, n) != 0 || runlist_add(freed, blk, n) != 0) rc = -1;
+            k -= n;
+        }
+    }
+    free(scratch);
+    return rc;
+}
+
+/*
+ * Remove `name`, or cut it down to `size` bytes. Staged like an add:
+ * freed blocks and inodes, the directory and the dedup index only change
+ * in the cache once every step has succeeded. 1, with nothing changed, if
+ * the dedup index changes do not fit one journal transaction: the file's
+ * first *stop blocks are all that can stay for the rest to be freed now.
+ */
+static int cut_file(mvfs_t *fs, const char *name, int remove, uint64_t size, uint64_t *stop) {
+    const superblock_t *sb = &fs->sb;
+    add_plan_t plan, *p = &plan;
+    memset(p, 0, sizeof(*p));
+    dir_t dir;
+    memset(&dir, 0, sizeof(dir));
+    dedup_t dd;
+    memset(&dd, 0, sizeof(dd));
+    runlist_t freed = { 0 };
+    bitmap_run_t *runs = NULL;
+    uint32_t sb_flags = sb->flags;
+    int partial = 0;
+
+    if ((sb->flags & SB_FEAT_JOURNAL) && (fs->ndirty + 64) * 2 > fs->sbx.journal_blocks && mvfs_sync(fs) != 0) return -1;
+    size_t io_mark = fs->io.n, jruns_mark = fs->njruns;
+    uint64_t jlast_len = fs->njruns ? fs->jruns[fs->njruns - 1].len : 0;
+    uint32_t jcrc_mark = fs->jdata_crc;
+
+    if (dir_open(fs, &dir) != 0) return -1;
+    int64_t ino_no = remove ? dir_remove(fs, &dir, name) : dir_lookup(fs, &dir, name);
+    if (ino_no < 0) goto fail;
+    if (ino_no == 0) { fprintf(stderr, "No such file '%s'\n", name); goto fail; }
+    if (ino_no == ROOT_INO || (uint64_t)ino_no > sb->inode_count) { fprintf(stderr, "'%s' is not a file\n", name); goto fail; }
+    uint64_t idx = (uint64_t)ino_no - 1;
+    inode_t ino;
+    if (inode_read(fs, idx, &ino) != 0) goto fail;
+    if (ino.mode != 0x8000) { fprintf(stderr, "'%s' is not a file\n", name); goto fail; }
+    if (!remove && size > ino.size_bytes) {
+        fprintf(stderr, "'%s' is only %" PRIu64 " bytes: truncate can't grow it\n", name, ino.size_bytes);
+        goto fail;
+    }
+    if (!remove && size == ino.size_bytes) goto done;
+
+    int nr = 0;
+    uint64_t nblocks = 0;
+    if (!(ino.flags & INODE_FL_INLINE) && (nr = inode_runs(fs, &ino, &runs)) < 0) goto fail;
+    for (int r = 0; r < nr; ++r) nblocks += runs[r].len;
+    uint32_t ext_block = 0;
+    if (ino.flags & INODE_FL_EXTENT_BLOCK) {
+        extent_t head;
+        memcpy(&head, ino.direct, sizeof(head));
+        ext_block = head.start;
+    }
+    /* compressed files never share blocks */
+    if ((sb->flags & SB_FEAT_DEDUP) && !(ino.flags & INODE_FL_COMPRESSED) && nblocks > 0 &&
+        dedup_open(fs, &dd, &dir, nblocks) != 0) goto fail;
+
+    inode_t newino = ino;
+    uint64_t keep = 0; /* leading file blocks that stay mapped */
+    if (remove) {
+        memset(&newino, 0, sizeof(newino));
+        if (groups_free_inode(fs, idx) != 0) goto fail;
+    } else if (ino.flags & INODE_FL_INLINE) {
+        memset((uint8_t *)&newino + INLINE_DATA_OFFSET + size, 0, (size_t)(ino.size_bytes - size));
+        if (size == 0) newino.flags &= ~INODE_FL_INLINE;
+    } else if ((ino.flags & INODE_FL_COMPRESSED) && size > 0) {
+        /* what is left is stored again uncompressed: inline if it fits, else in new blocks */
+        if ((sb->flags & SB_FEAT_JOURNAL) && fs->jfreed) {
+            if (mvfs_sync(fs) != 0) goto fail;
+        } else if (fs->io.n > 0 && blkio_flush(&fs->io) != 0) {
+            perror("write image");
+            goto fail;
+        }
+        io_mark = fs->io.n;
+        jruns_mark = fs->njruns;
+        jlast_len = fs->njruns ? fs->jruns[fs->njruns - 1].len : 0;
+        jcrc_mark = fs->jdata_crc;
+        if (!(p->cdata = malloc((size_t)size))) { perror("malloc"); goto fail; }
+        if (read_compressed(fs, &ino, runs, nr, p->cdata, (size_t)size, 0) != (ssize_t)size) goto fail;
+        memset((uint8_t *)&newino + INLINE_DATA_OFFSET, 0, INLINE_DATA_MAX);
+        newino.flags &= ~(INODE_FL_COMPRESSED | INODE_FL_EXTENTS | INODE_FL_EXTENT_BLOCK);
+        if (size <= INLINE_DATA_MAX) {
+            memcpy((uint8_t *)&newino + INLINE_DATA_OFFSET, p->cdata, (size_t)size);
+            newino.flags |= INODE_FL_INLINE;
+            sb_flags |= SB_FEAT_INLINE;
+        } else {
+            p->size = p->csize = (size_t)size;
+            p->nblocks = (size_t)div_up(size, BS);
+            int max_runs = p->nblocks <= 12 ? 12 : (int)EXTENTS_PER_BLOCK;
+            uint64_t goal = fs->goal;
+            if (!(p->runs = malloc((size_t)max_runs * sizeof(*p->runs)))) { perror("malloc runs"); goto fail; }
+            p->nruns = groups_alloc_blocks(fs, p->nblocks, goal, p->runs, max_runs);
+            if (p->nruns < 0) {
+                if (errno == EFBIG) fprintf(stderr, "Free data blocks too fragmented for '%s'\n", name);
+                else if (errno == ENOSPC) fprintf(stderr, "Not enough free data blocks available\n");
+                goto fail;
+            }
+            for (int r = 0; r < p->nruns; ++r) {
+                goal = p->runs[r].start + p->runs[r].len;
+                p->runs[r].start += sb->data_region_start;
+            }
+            if (p->nblocks > 12 && p->nruns > (int)INLINE_EXTENTS) {
+                bitmap_run_t eb;
+                if (groups_alloc_blocks(fs, 1, goal, &eb, 1) != 1) {
+                    if (errno == ENOSPC) fprintf(stderr, "Not enough free data blocks available\n");
+                    goto fail;
+                }
+                p->ext_block = (uint32_t)(sb->data_region_start + eb.start);
+            }
+            if (p->nblocks > 12) sb_flags |= SB_FEAT_EXTENTS;
+            if (write_file_data(fs, p, NULL) != 0 || inode_map_blocks(fs, &newino, p) != 0) goto fail;
+        }
+        newino.reserved_0 = 0;
+    } else {
+        keep = div_up(size, BS);
+    }
+
+    int rr = release_runs(fs, runs, nr, nblocks, keep, &dd, &freed, stop);
+    if (rr == 1 && *stop == nblocks) {
+        fprintf(stderr, "No room in the journal to free any block of '%s'\n", name);
+        goto fail;
+    }
+    if (rr == 1) partial = 1;
+    if (rr != 0) goto fail;
+    if (!remove && keep < nblocks && !p->cdata) {
+        /* the kept prefix maps directly again at 12 blocks or fewer, and may no longer need its extent block */
+        memset(newino.direct, 0, sizeof(newino.direct));
+        newino.flags &= ~(INODE_FL_EXTENTS | INODE_FL_EXTENT_BLOCK | INODE_FL_COMPRESSED);
+        newino.reserved_0 = 0;
+        uint64_t have = 0;
+        while (have < keep) {
+            if (runs[p->nruns].len > keep - have) runs[p->nruns].len = keep - have;
+            have += runs[p->nruns++].len;
+        }
+        p->runs = runs;
+        runs = NULL;
+        p->nblocks = (size_t)keep;
+        p->ext_block = keep > 12 && p->nruns > (int)INLINE_EXTENTS ? ext_block : 0;
+        if (keep > 0 && inode_map_blocks(fs, &newino, p) != 0) goto fail;
+    }
+    if (ext_block && (!(newino.flags & INODE_FL_EXTENT_BLOCK) || newino.direct[0] != ext_block)) {
+        if (groups_unmark(fs, ext_block - sb->data_region_start, 1) != 0 || runlist_add(&freed, ext_block, 1) != 0) goto fail;
+    }
+
+    if (!remove) {
+        newino.size_bytes = size;
+        newino.mtime = newino.ctime = (uint64_t)time(NULL);
+        inode_crc_finalize(&newino);
+    }
+    if (inode_write(fs, idx, &newino) != 0) goto fail;
+    if (remove) {
+        if (dir_commit(fs, &dir, -1) != 0) goto fail;
+        dir.root.links -= 1;
+        inode_crc_finalize(&dir.root);
+        if (inode_write(fs, ROOT_INO - 1, &dir.root) != 0) goto fail;
+    }
+    if (groups_commit(fs) != 0) goto fail;
+    if (dd.v && dedup_commit(fs, &dd) != 0) goto fail;
+
+    if (sb_flags != fs->sb.flags) {
+        fs->sb.flags = sb_flags;
+        fs->sb_dirty = 1;
+    }
+    if (freed.n > 0 && (sb->flags & SB_FEAT_JOURNAL)) fs->jfreed = 1;
+    for (size_t i = 0; fs->punch && i < freed.n; ++i)
+        if (runlist_add(&fs->holes, freed.v[i].start, freed.v[i].len) != 0) break;
+done:
+    dir_close(&dir);
+    dedup_close(&dd);
+    free(runs);
+    free(freed.v);
+    free(p->runs);
+    free(p->cdata);
+    return 0;
+
+fail:
+    groups_abort(fs);
+    if (fs->io.n > io_mark) blkio_truncate(&fs->io, io_mark);
+    fs->njruns = jruns_mark;
+    if (jruns_mark) fs->jruns[jruns_mark - 1].len = jlast_len;
+    fs->jdata_crc = jcrc_mark;
+    dir_close(&dir);
+    dedup_close(&dd);
+    free(runs);
+    free(freed.v);
+    free(p->runs);
+    free(p->cdata);
+    return partial ? 1 : -1;
+}
+
+/*
+ * A cut whose dedup index changes overflow one transaction goes in steps:
+ * the file is first truncated to what does fit, that is committed, and
+ * the cut is tried again. A crash in between leaves the file shortened.
+ */
+static int cut_file_steps(mvfs_t *fs, const char *name, int remove, uint64_t size) {
+    uint64_t stop;
+    int rc;
+    while ((rc = cut_file(fs, name, remove, size, &stop)) == 1)
+        if (cut_file(fs, name, 0, stop * BS, &stop) != 0 || mvfs_sync(fs) != 0) return -1;
+    return rc;
+}
+
+int mvfs_remove(mvfs_t *fs, const char *name) {
+    if (fs->mode != MVFS_RDWR) { fprintf(stderr, "Image is open read-only\n"); return -1; }
+    int ph = stats_enter(PH_ALLOC);
+    int rc = cut_file_steps(fs, name, 1, 0);
+    stats_enter(ph);
+    return rc;
+}
+
+int mvfs_truncate(mvfs_t *fs, const char *name, uint64_t size) {
+    if (fs->mode != MVFS_RDWR) { fprintf(stderr, "Image is open read-only\n"); return -1; }
+    int ph = stats_enter(PH_ALLOC);
+    int rc = cut_file_steps(fs, name, 0, size);
+    stats_enter(ph);
+    return rc;
+}
+
+/*
+ * Punch the blocks freed since the last sync out of the image file, so
+ * the host file system gets their space back; blocks allocated again
+ * since are skipped. Called once those frees are durable.
+ */
+static int punch_holes(mvfs_t *fs) {
+    runlist_t *h = &fs->holes;
+    /* replaying the last transaction checks its data runs, which may be among these blocks */
+    if (fs->ckpt_pending) {
+        if (dev_sync(fs) != 0) { perror("fsync image"); return -1; }
+        fs->ckpt_pending = 0;
+    }
+    uint64_t drs = fs->sb.data_region_start;
+    for (size_t i = 0; i < h->n && fs->punch; ++i) {
+        uint64_t b = h->v[i].start - drs, end = b + h->v[i].len;
+        while (b < end && fs->punch) {
+            uint64_t gi = b / fs->bpg;
+            if (group_load(fs, gi) != 0) return -1;
+            const group_t *g = &fs->g[gi];
+            uint64_t lim = (end < g->blk_lo + g->blk_len ? end : g->blk_lo + g->blk_len) - g->blk_lo;
+            uint64_t z = bitmap_find_zero(&g->dbm, b - g->blk_lo), o;
+            if (z > lim) z = lim;
+            o = bitmap_find_one(&g->dbm, z);
+            if (o > lim) o = lim;
+            if (o > z && fallocate(fs->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                   (off_t)((drs + g->blk_lo + z) * BS), (off_t)((o - z) * BS)) != 0) {
+                if (errno != EOPNOTSUPP) { perror("punch hole"); return -1; }
+                fprintf(stderr, "The image's file system can't punch holes: freed blocks stay allocated\n");
+                fs->punch = 0;
+            }
+            for (uint64_t k = z; k < o; ++k) cache_drop(fs, drs + g->blk_lo + k);
+            b = g->blk_lo + o;
+        }
+    }
+    h->n = 0;
+    return 0;
+}
+
+static int sync_all(mvfs_t *fs) {
+    if (fs->sb_dirty) {
+        superblock_crc_finalize(&fs->sb);
+        if (meta_write(fs, 0, 0, &fs->sb, sizeof(fs->sb)) != 0) return -1;
+        fs->sb_dirty = 0;
+    }
+    if (fs->sb.flags & SB_FEAT_JOURNAL) {
+        if (journal_commit(fs) != 0) return -1;
+        fs->jfreed = 0;
+    } else {
+        if (cache_writeback(fs) != 0) return -1;
+        stats_enter(PH_FLUSH);
+        if (dev_sync(fs) != 0) { perror("fsync image"); return -1; }
+    }
+    /* on an overlay, nothing written counts until its map says so */
+    stats_enter(PH_FLUSH);
+    if (fs->ovl) return ovl_commit(fs->ovl);
+    return fs->holes.n > 0 ? punch_holes(fs) : 0;
+}
+
+int mvfs_sync(mvfs_t *fs) {
+    if (fs->mode != MVFS_RDWR) return 0;
+    int ph = stats_enter(PH_META_WRITE);
+    int rc = sync_all(fs);
+    stats_enter(ph);
+    return rc;
+}
+
+void mvfs_discard(mvfs_t *fs) {
+    if (!fs) return;
+    if (fs->io.fd >= 0) blkio_fini(&fs->io);
+    for (uint64_t i = 0; fs->g && i < fs->ngroups; ++i) group_unload(&fs->g[i]);
+    free(fs->g);
+    while (fs->clean.head) cache_remove(fs, fs->clean.head);
+    while (fs->dirty.head) cache_remove(fs, fs->dirty.head);
+    if (fs->fd >= 0) close(fs->fd);
+    ovl_close(fs->ovl);
+    free(fs->jruns);
+    free(fs->holes.v);
+    free(fs->path);
+    free(fs);
+}
+
+int mvfs_close(mvfs_t *fs) {
+    int rc = mvfs_sync(fs);
+    if (fs->mode == MVFS_RDWR && close(fs->fd) != 0 && rc == 0) { perror("close image"); rc = -1; }
+    else if (fs->mode != MVFS_RDWR) close(fs->fd);
+    fs->fd = -1;
+    mvfs_discard(fs);
+    return rc;
+}
@@ -0,0 +1,376 @@
+#ifndef MVFS_MINIVSFS_H
+#define MVFS_MINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "blkio.h"
+
+/*
+ * MiniVSFS on-disk format and image access shared by the tools.
+ *
+ * The structs, constants and checksum finalizers describe the format; the
+ * mvfs_* handle keeps an image open across many operations, with the
+ * superblock, group summaries and metadata blocks cached in memory. File
+ * data and dirty metadata are queued and written back in coalesced
+ * batches (blkio.h) on mvfs_sync()/mvfs_close().
+ */
+#define BS 4096u
+#define INODE_SIZE 128u
+#define DIRENT_SIZE 64u
+#define ROOT_INO 1u
+#define MAX_NAME 58
+#define MVFS_MAGIC 0x4D565346u
+
+/* superblock flags: on-disk features a reader must understand */
+#define SB_FEAT_EXTENTS 0x1u       /* some inodes use extent mapping */
+#define SB_FEAT_GROUPS 0x2u        /* multi-block bitmaps split into block groups with a descriptor table */
+#define SB_FEAT_HASHDIR 0x4u       /* root directory is a hashed array of bucket blocks */
+#define SB_FEAT_JOURNAL 0x8u       /* metadata updates go through the journal region; replay it before reading */
+#define SB_FEAT_INLINE 0x10u       /* some files are stored inside their inode */
+#define SB_FEAT_DEDUP 0x20u        /* data blocks may be shared; the dedup index counts their references */
+#define SB_FEAT_COMPRESS 0x40u     /* some files store their data compressed */
+#define SB_FEAT_KNOWN (SB_FEAT_EXTENTS | SB_FEAT_GROUPS | SB_FEAT_HASHDIR | SB_FEAT_JOURNAL | SB_FEAT_INLINE | \
+                       SB_FEAT_DEDUP | SB_FEAT_COMPRESS)
+
+#define SB_VERSION_EXT 2u          /* superblock_ext_t follows the superblock in block 0 */
+#define SBX_MAGIC 0x5853564Du      /* "MVSX" */
+#define SBX_OFFSET 128u            /* byte offset of superblock_ext_t in block 0 */
+#define BITS_PER_BLOCK (BS * 8u)
+
+/* inode flags */
+#define INODE_FL_EXTENTS 0x1u      /* direct[] holds extent_t runs instead of block numbers */
+#define INODE_FL_EXTENT_BLOCK 0x2u /* first extent points at a block of extents: {block, count} */
+#define INODE_FL_HASHDIR 0x4u      /* directory block i holds the names with mvfs_name_hash() & (blocks - 1) == i */
+#define INODE_FL_INLINE 0x8u       /* the file's bytes fill the inode from direct[] up to flags; no data blocks */
+#define INODE_FL_COMPRESSED 0x10u  /* the blocks hold a compressed stream; reserved_0 counts them */
+
+#define MAX_DIR_BUCKETS 65536u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must be 116 bytes");
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t reserved_0;   /* INODE_FL_COMPRESSED: blocks mapped */
+    uint32_t reserved_1;
+    uint32_t flags;        /* INODE_FL_*; was reserved_2, 0 for plain direct-mapped inodes */
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode must be 128 bytes");
+
+/* Inline data area: direct[], reserved_0 and reserved_1 */
+#define INLINE_DATA_OFFSET offsetof(inode_t, direct)
+#define INLINE_DATA_MAX (offsetof(inode_t, flags) - offsetof(inode_t, direct))
+_Static_assert(INLINE_DATA_MAX == 56, "inline data area must be 56 bytes");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t type;
+    char name[58];
+    uint8_t checksum;
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t) == DIRENT_SIZE, "dirent must be 64 bytes");
+
+/* A run of `len` blocks starting at absolute block `start` */
+#pragma pack(push,1)
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} extent_t;
+#pragma pack(pop)
+#define INLINE_EXTENTS (sizeof(((inode_t *)0)->direct) / sizeof(extent_t))
+#define EXTENTS_PER_BLOCK (BS / sizeof(extent_t))
+
+/*
+ * Version 2 superblock extension. Group g owns data bitmap block g (the
+ * data blocks [g, g+1) * blocks_per_group of the data region) and the
+ * inodes [g, g+1) * inodes_per_group, i.e. a slice of the inode bitmap and
+ * of the inode table. Its descriptor keeps a free summary so allocators
+ * can pick a group without reading its bitmaps.
+ */
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t size;               /* sizeof(superblock_ext_t) */
+    uint64_t group_desc_start;
+    uint64_t group_desc_blocks;
+    uint64_t group_count;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;   /* multiple of 64 */
+    uint64_t journal_start;      /* 0 unless SB_FEAT_JOURNAL */
+    uint64_t journal_blocks;
+    uint64_t dedup_start;        /* 0 unless SB_FEAT_DEDUP */
+    uint64_t dedup_blocks;       /* a power of two */
+    uint8_t reserved[180];
+    uint32_t checksum;           /* crc32 of the bytes before it */
+} superblock_ext_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_ext_t) == 256, "superblock extension must be 256 bytes");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t longest_free_run;   /* longest run of free data blocks in the group */
+    uint32_t checksum;           /* crc32 of the first 12 bytes */
+} group_desc_t;
+#pragma pack(pop)
+_Static_assert(sizeof(group_desc_t) == 16, "group descriptor must be 16 bytes");
+#define GROUP_DESCS_PER_BLOCK (BS / sizeof(group_desc_t))
+
+/*
+ * Metadata journal (SB_FEAT_JOURNAL). The region holds at most one
+ * transaction, always starting at its first block: descriptor blocks (a
+ * journal_head_t, then the home block of each logged block, then the data
+ * runs the transaction's files were written to), a copy of each logged
+ * block, and a commit block. The commit block checksums the descriptor
+ * and copies, and the data runs as they should read on disk, so a torn
+ * transaction, or one whose file data never landed, is not replayed.
+ * Replaying a committed transaction just rewrites its blocks, so it is
+ * safe to repeat; a transaction stays in the journal until the next one
+ * overwrites it.
+ */
+#define JOURNAL_DESC_MAGIC 0x444A564Du   /* "MVJD" */
+#define JOURNAL_COMMIT_MAGIC 0x434A564Du /* "MVJC" */
+#define JOURNAL_MIN_BLOCKS 16u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t desc_blocks;        /* descriptor blocks, this one included */
+    uint64_t seq;
+    uint32_t nmeta;              /* logged blocks; uint64_t home block numbers follow */
+    uint32_t ndata;              /* then this many journal_run_t */
+} journal_head_t;
+
+typedef struct {
+    uint64_t start;
+    uint64_t len;
+} journal_run_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t nmeta;
+    uint64_t seq;
+    uint32_t body_crc;           /* crc32 of the descriptor blocks and the copies */
+    uint32_t data_crc;           /* crc32 of the data runs, in order */
+    uint32_t checksum;           /* crc32 of the bytes before it */
+} journal_commit_t;
+#pragma pack(pop)
+_Static_assert(sizeof(journal_head_t) == 24, "journal head must be 24 bytes");
+_Static_assert(sizeof(journal_commit_t) == 28, "journal commit must be 28 bytes");
+
+/*
+ * Dedup index (SB_FEAT_DEDUP): a hash table of data block fingerprints.
+ * Block b of the index is the bucket of the fingerprints with
+ * fp & (dedup_blocks - 1) == b, and holds up to DEDUP_ENTRIES_PER_BLOCK
+ * entries in any order; blk == 0 marks a free slot. `refs` counts the
+ * inode references to `blk`. A data block with more than one reference
+ * always has an entry; a block without one has exactly one reference. A
+ * full bucket simply leaves new blocks unindexed.
+ */
+#pragma pack(push,1)
+typedef struct {
+    uint64_t fp;                 /* mvfs_block_fp() of the block's contents */
+    uint32_t blk;                /* absolute block number */
+    uint32_t refs;
+} dedup_entry_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dedup_entry_t) == 16, "dedup entry must be 16 bytes");
+#define DEDUP_ENTRIES_PER_BLOCK (BS / sizeof(dedup_entry_t))
+
+/*
+ * Compressed files (INODE_FL_COMPRESSED). size_bytes stays the file's
+ * length; its mapped blocks hold a stream that starts with the compressed
+ * block map, one uint32_t per COMPRESS_UNIT of the file: the stream offset
+ * where that unit's bytes end. Unit 0 starts right after the map, every
+ * other unit where the one before it ends. A unit whose stored length is
+ * its full length is stored as is, anything shorter is lz_compress()ed,
+ * so each unit decodes on its own.
+ */
+#define COMPRESS_UNIT (4u * BS)
+
+/* Checksums over the struct bytes before each checksum field (dirents: XOR of the first 63 bytes) */
+void superblock_crc_finalize(superblock_t *sb);
+void superblock_ext_crc_finalize(superblock_ext_t *sbx);
+void group_desc_crc_finalize(group_desc_t *gd);
+void inode_crc_finalize(inode_t *ino);
+void dirent_checksum_finalize(dirent64_t *d);
+
+/*
+ * `name` as a dirent stores it: cut to MAX_NAME - 1 bytes and NUL-padded.
+ * Adds, lookups and removals all go through this, so a long name finds
+ * the entry it was stored as.
+ */
+void mvfs_name_set(char dst[MAX_NAME], const char *name);
+
+/* FNV-1a of a dirent name; its low bits pick the root directory bucket */
+uint32_t mvfs_name_hash(const char *name);
+
+/* Fingerprint of one BS-byte data block for the dedup index */
+uint64_t mvfs_block_fp(const void *blk);
+
+/*
+ * Stored bytes [*start, *end) of unit u of a compressed file of `size`
+ * bytes, from its block map (`map` has every unit's entry) and the
+ * stream's length; -1 if the map points outside the stream.
+ */
+int mvfs_unit_span(const uint32_t *map, uint64_t size, uint64_t u, uint64_t stream_len, uint64_t *start, uint64_t *end);
+
+/* Decode a unit's n stored bytes into its ulen bytes of file data; -1 if they are corrupt */
+int mvfs_unit_decode(const uint8_t *in, size_t n, uint8_t *out, size_t ulen);
+
+/* Why mvfs_inode_runs() could not follow an inode's mapping */
+#define MVFS_RUNS_DIRECT (-1)    /* more blocks than the 12 direct pointers hold */
+#define MVFS_RUNS_EXT_BLOCK (-2) /* the extent block pointer is outside the data region or miscounted */
+#define MVFS_RUNS_SHORT (-3)     /* the extents end before `nblocks` */
+#define MVFS_RUNS_OUTSIDE (-4)   /* a run leaves the data region; *nruns still holds every run */
+
+/*
+ * The first `nblocks` blocks an inode maps, in file order, as runs of
+ * absolute blocks, reading any extent block from `map`, a mapping of the
+ * whole image. `runs` must have room for EXTENTS_PER_BLOCK of them (and at
+ * least 12). *ext_block, if given, gets the extent block or 0. 0, or one
+ * of the MVFS_RUNS_* codes. Inline and compressed inodes are the caller's
+ * business: it passes the number of blocks the inode should map.
+ */
+int mvfs_inode_runs(const uint8_t *map, const superblock_t *sb, const inode_t *ino, uint64_t nblocks,
+                    extent_t *runs, uint64_t *nruns, uint32_t *ext_block);
+
+/* Check block 0 of an image of `file_size` bytes; prints why and returns -1 if it is unusable */
+int mvfs_validate(const uint8_t *blk0, off_t file_size);
+
+/*
+ * Apply a committed journal transaction to a mapping of a whole image
+ * whose block 0 passed mvfs_validate(). The mapping may be read-only:
+ * `writable(ctx, blk, n)`, when given, is called first for each block the
+ * transaction changes and makes it writable, returning 0 or -1 with errno.
+ * 1 if that changed any block, 0 if there was nothing (left) to apply, -1
+ * (with a message) if the journal is corrupt or a block could not be made
+ * writable. Nothing is written to the file.
+ */
+int mvfs_journal_apply(uint8_t *map, size_t len, int (*writable)(void *ctx, uint64_t blk, uint64_t n), void *ctx);
+
+/* An open image */
+typedef struct mvfs mvfs_t;
+
+#define MVFS_RDONLY 0
+#define MVFS_RDWR 1
+
+/*
+ * Open and validate an image, replaying a committed journal transaction
+ * first (in place for MVFS_RDWR, in the cache only for MVFS_RDONLY); NULL
+ * (with a message on stderr) on failure. `path` may be an overlay
+ * (overlay.h): the image is then read through its chain, and MVFS_RDWR
+ * changes go into the overlay, committed on each sync.
+ */
+mvfs_t *mvfs_open(const char *path, int mode);
+
+/*
+ * How writes reach the image: `backend` is a BLKIO_* value (pwritev by
+ * default) and `direct` writes through O_DIRECT. Flushes queued file data
+ * first; 0, or -1 with a message on stderr.
+ */
+int mvfs_set_io(mvfs_t *fs, int backend, int direct);
+
+/*
+ * Deduplicate the data of later adds against the image's dedup index,
+ * sharing identical blocks instead of writing them again; -1 (with a
+ * message) if the image has no index.
+ */
+int mvfs_set_dedup(mvfs_t *fs, int on);
+
+/*
+ * Compress the data of later adds when that saves at least one block
+ * (other files are stored as usual). Compressed files are not
+ * deduplicated.
+ */
+void mvfs_set_compress(mvfs_t *fs, int on);
+
+/*
+ * Punch the blocks later removes and truncates free out of the image file
+ * (fallocate PUNCH_HOLE) on each sync, giving their space back to the
+ * host file system; -1 (with a message) for an overlay.
+ */
+int mvfs_set_punch(mvfs_t *fs, int on);
+
+/*
+ * Add the host file `path` to the root directory as `name`, returning its
+ * 1-based inode number in *ino. The data is queued for free blocks and
+ * the metadata changes land in the block cache only once every step has
+ * succeeded; a failed add drops both, leaving the image as it was.
+ */
+int mvfs_add(mvfs_t *fs, const char *name, const char *path, uint64_t *ino);
+
+/*
+ * Remove the file `name` from the root directory, freeing its inode and
+ * blocks; on a dedup image a shared block only loses one reference.
+ * Staged like mvfs_add(): a failed remove leaves the image as it was.
+ */
+int mvfs_remove(mvfs_t *fs, const char *name);
+
+/*
+ * Cut the file `name` down to `size` bytes (it can't grow), freeing the
+ * blocks past the new end like mvfs_remove(). What is left of a
+ * compressed file is stored again uncompressed.
+ */
+int mvfs_truncate(mvfs_t *fs, const char *name, uint64_t size);
+
+/* Read up to `len` bytes at `off` of the file `name`; bytes read, or -1 */
+ssize_t mvfs_read(mvfs_t *fs, const char *name, void *buf, size_t len, uint64_t off);
+
+/*
+ * Write queued data and dirty metadata back and make them durable. On a
+ * journaled image every change since the last sync becomes one
+ * transaction, committed with a single fdatasync, so many adds share it.
+ * mvfs_add(), mvfs_remove() and mvfs_truncate() also sync on their own
+ * there, before the pending transaction could outgrow the journal and
+ * after a change that freed blocks, so mvfs_discard() may find earlier
+ * changes of the batch already committed.
+ */
+int mvfs_sync(mvfs_t *fs);
+
+/* mvfs_sync() (for read-write handles) and release the handle; -1 if the sync failed */
+int mvfs_close(mvfs_t *fs);
+
+/* Release the handle without writing back metadata changed since the last sync */
+void mvfs_discard(mvfs_t *fs);
+
+#endif
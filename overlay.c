@@ -0,0 +1,383 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "overlay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "fileio.h"
+#include "stats.h"
+
+static uint64_t div_up(uint64_t a, uint64_t b) { return (a + b - 1) / b; }
+
+static int sync_file(int fd) {
+    stats.syncs++;
+    return fdatasync(fd);
+}
+
+int ovl_is_overlay(const uint8_t *blk0) {
+    uint32_t magic;
+    memcpy(&magic, blk0, sizeof(magic));
+    return magic == OVL_MAGIC;
+}
+
+/* 1 and the header in *h for an overlay, 0 for anything else, -1 (with a message) for a damaged overlay */
+static int head_read(int fd, const char *path, ovl_head_t *h) {
+    uint8_t blk[OVL_BS];
+    if (fio_read_full(fd, blk, OVL_BS, 0) != 0) { fprintf(stderr, "%s: cannot read block 0: %s\n", path, strerror(errno)); return -1; }
+    if (!ovl_is_overlay(blk)) return 0;
+    memcpy(h, blk, sizeof(*h));
+    if (h->checksum != crc32(h, offsetof(ovl_head_t, checksum)) || h->version != OVL_VERSION ||
+        memchr(h->backing, '\0', OVL_BACKING_MAX) == NULL || h->backing[0] == '\0' || h->total_blocks == 0) {
+        fprintf(stderr, "%s: damaged overlay header\n", path);
+        return -1;
+    }
+    return 1;
+}
+
+/* The backing image of the overlay at `path`, as a path usable from here */
+static char *backing_path(const char *path, const char *backing) {
+    const char *slash = strrchr(path, '/');
+    if (backing[0] == '/' || !slash) return strdup(backing);
+    size_t d = (size_t)(slash - path) + 1;
+    char *p = malloc(d + strlen(backing) + 1);
+    if (!p) return NULL;
+    memcpy(p, path, d);
+    strcpy(p + d, backing);
+    return p;
+}
+
+/* Read and check an overlay's run map: sorted, disjoint, inside the image and inside the file */
+static int map_load(ovl_layer_t *l, const ovl_head_t *h, uint64_t file_blocks) {
+    if (h->nruns == 0) return 0;
+    if (h->nruns > file_blocks || h->map_start == 0 ||
+        h->map_start + div_up(h->nruns * sizeof(ovl_run_t), OVL_BS) > file_blocks) {
+        fprintf(stderr, "%s: overlay map lies outside the file\n", l->path);
+        return -1;
+    }
+    size_t bytes = (size_t)h->nruns * sizeof(ovl_run_t);
+    if (!(l->runs = malloc(bytes))) { perror("malloc overlay map"); return -1; }
+    l->nruns = l->cap = h->nruns;
+    if (fio_read_full(l->fd, l->runs, bytes, (off_t)(h->map_start * OVL_BS)) != 0) {
+        fprintf(stderr, "%s: cannot read overlay map: %s\n", l->path, strerror(errno));
+        return -1;
+    }
+    if (crc32(l->runs, bytes) != h->map_crc) { fprintf(stderr, "%s: overlay map checksum mismatch\n", l->path); return -1; }
+    uint64_t end = 0;
+    for (uint64_t i = 0; i < l->nruns; ++i) {
+        const ovl_run_t *r = &l->runs[i];
+        if (r->len == 0 || r->vblk < end || r->len > h->total_blocks || r->vblk > h->total_blocks - r->len ||
+            r->fblk == 0 || r->len > file_blocks || r->fblk > file_blocks - r->len) {
+            fprintf(stderr, "%s: bad overlay run %" PRIu64 "\n", l->path, i);
+            return -1;
+        }
+        end = r->vblk + r->len;
+    }
+    return 0;
+}
+
+void ovl_close(ovl_t *o) {
+    if (!o) return;
+    if (o->view) munmap(o->view, o->len);
+    for (int i = 0; i <= OVL_MAX_DEPTH; ++i) {
+        if (o->layers[i].fd >= 0) close(o->layers[i].fd);
+        free(o->layers[i].path);
+        free(o->layers[i].runs);
+    }
+    free(o->priv);
+    free(o);
+}
+
+int ovl_private(void *ovl, uint64_t vblk, uint64_t n) {
+    ovl_t *o = ovl;
+    if (vblk > o->len / OVL_BS || n > o->len / OVL_BS - vblk) { errno = EINVAL; return -1; }
+    uint64_t end = vblk + n;
+    while (vblk < end) {
+        /* the first span that ends past vblk */
+        uint64_t lo = 0, hi = o->npriv;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (o->priv[mid].vblk + o->priv[mid].len <= vblk) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < o->npriv && o->priv[lo].vblk <= vblk) { vblk = o->priv[lo].vblk + o->priv[lo].len; continue; }
+        uint64_t gap = lo < o->npriv && o->priv[lo].vblk < end ? o->priv[lo].vblk : end;
+        if (o->npriv == o->priv_cap) {
+            uint64_t nc = o->priv_cap ? o->priv_cap * 2 : 64;
+            ovl_span_t *np = realloc(o->priv, nc * sizeof(*np));
+            if (!np) { errno = ENOMEM; return -1; }
+            o->priv = np;
+            o->priv_cap = nc;
+        }
+        /* the same file range mapped copy-on-write over the shared one keeps its contents */
+        if (mmap(o->view + vblk * OVL_BS, (size_t)((gap - vblk) * OVL_BS), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, o->layers[0].fd, (off_t)(vblk * OVL_BS)) == MAP_FAILED) return -1;
+        ovl_span_t *prev = lo > 0 ? &o->priv[lo - 1] : NULL, *next = lo < o->npriv ? &o->priv[lo] : NULL;
+        int joins_prev = prev && prev->vblk + prev->len == vblk, joins_next = next && next->vblk == gap;
+        if (joins_prev && joins_next) {
+            prev->len += gap - vblk + next->len;
+            memmove(next, next + 1, (o->npriv - lo - 1) * sizeof(*next));
+            o->npriv--;
+        } else if (joins_prev) {
+            prev->len += gap - vblk;
+        } else if (joins_next) {
+            next->len += next->vblk - vblk;
+            next->vblk = vblk;
+        } else {
+            memmove(&o->priv[lo + 1], &o->priv[lo], (o->npriv - lo) * sizeof(*o->priv));
+            o->priv[lo] = (ovl_span_t){ vblk, gap - vblk };
+            o->npriv++;
+        }
+        vblk = gap;
+    }
+    return 0;
+}
+
+ovl_t *ovl_open(const char *path, int writable) {
+    ovl_t *o = calloc(1, sizeof(*o));
+    if (!o) { perror("calloc"); return NULL; }
+    o->writable = writable;
+    for (int i = 0; i <= OVL_MAX_DEPTH; ++i) o->layers[i].fd = -1;
+
+    /* walk the chain top down into layers[0..n), then flip it so the base comes first */
+    ovl_layer_t *l = o->layers;
+    char *cur = strdup(path);
+    uint64_t total = 0;
+    int n = 0;
+    struct stat st;
+    for (;;) {
+        if (!cur) { perror("malloc"); goto fail; }
+        if (n > OVL_MAX_DEPTH) { fprintf(stderr, "%s: overlay chain deeper than %d\n", path, OVL_MAX_DEPTH); free(cur); goto fail; }
+        l[n].path = cur;
+        l[n].fd = open(cur, n == 0 && writable ? O_RDWR : O_RDONLY);
+        if (l[n].fd < 0 || fstat(l[n].fd, &st) != 0) { fprintf(stderr, "%s: %s\n", cur, strerror(errno)); ++n; goto fail; }
+        ovl_head_t h;
+        int is = head_read(l[n].fd, cur, &h);
+        if (is < 0) { ++n; goto fail; }
+        if (!is) { ++n; break; }
+        if (n == 0) total = h.total_blocks;
+        else if (h.total_blocks != total) { fprintf(stderr, "%s: backing overlay %s has another size\n", path, cur); ++n; goto fail; }
+        uint64_t file_blocks = (uint64_t)st.st_size / OVL_BS;
+        if (map_load(&l[n], &h, file_blocks) != 0) { ++n; goto fail; }
+        if (n == 0) {
+            o->head = h;
+            o->next = div_up((uint64_t)st.st_size, OVL_BS);
+            o->committed = o->next;
+            o->live_start = h.map_start;
+            o->live_blocks = div_up(h.nruns * sizeof(ovl_run_t), OVL_BS);
+        }
+        cur = backing_path(cur, h.backing);
+        ++n;
+    }
+    o->depth = n - 1;
+    if (writable && o->depth == 0) { fprintf(stderr, "%s is not an overlay\n", path); goto fail; }
+    for (int i = 0; i < n / 2; ++i) {
+        ovl_layer_t t = l[i];
+        l[i] = l[n - 1 - i];
+        l[n - 1 - i] = t;
+    }
+
+    /* the base mapped shared, then each overlay's blocks on top of it as private copies */
+    if (o->depth > 0 && (uint64_t)st.st_size < total * OVL_BS) {
+        fprintf(stderr, "%s: base image %s is smaller than the overlay\n", path, l[0].path);
+        goto fail;
+    }
+    o->len = o->depth > 0 ? (size_t)(total * OVL_BS) : (size_t)st.st_size - (size_t)st.st_size % OVL_BS;
+    if (o->len == 0) { fprintf(stderr, "%s: image is empty\n", l[0].path); goto fail; }
+    o->view = mmap(NULL, o->len, PROT_READ, MAP_SHARED, l[0].fd, 0);
+    if (o->view == MAP_FAILED) { o->view = NULL; perror("mmap image"); goto fail; }
+    for (int i = 1; i < n; ++i)
+        for (uint64_t r = 0; r < l[i].nruns; ++r) {
+            const ovl_run_t *run = &l[i].runs[r];
+            if (ovl_private(o, run->vblk, run->len) != 0) { perror("map overlay blocks"); goto fail; }
+            if (fio_read_full(l[i].fd, o->view + run->vblk * OVL_BS, run->len * OVL_BS, (off_t)(run->fblk * OVL_BS)) != 0) {
+                fprintf(stderr, "%s: %s\n", l[i].path, strerror(errno));
+                goto fail;
+            }
+        }
+    return o;
+
+fail:
+    ovl_close(o);
+    return NULL;
+}
+
+/* How an overlay at `path` names `backing`: its bare name next to the overlay, else its absolute path */
+static char *backing_name(const char *path, const char *backing) {
+    char *pd = strdup(path), *bd = strdup(backing), *bb = strdup(backing);
+    char pdir[PATH_MAX], bdir[PATH_MAX], *out = NULL;
+    if (!pd || !bd || !bb) { perror("malloc"); goto out; }
+    if (!realpath(dirname(pd), pdir) || !realpath(dirname(bd), bdir)) { perror("realpath"); goto out; }
+    if (strcmp(pdir, bdir) == 0) {
+        out = strdup(basename(bb));
+    } else {
+        char full[PATH_MAX];
+        if (realpath(backing, full)) out = strdup(full);
+        else perror("realpath");
+    }
+out:
+    free(pd);
+    free(bd);
+    free(bb);
+    return out;
+}
+
+int ovl_create(const char *path, const char *backing) {
+    struct stat ps, bs;
+    if (stat(path, &ps) == 0 && stat(backing, &bs) == 0 && ps.st_dev == bs.st_dev && ps.st_ino == bs.st_ino) {
+        fprintf(stderr, "An overlay cannot replace its own backing image\n");
+        return -1;
+    }
+    /* the image size as ovl_open() would see it: an overlay's header, else the file's whole blocks */
+    int bfd = open(backing, O_RDONLY);
+    if (bfd < 0 || fstat(bfd, &bs) != 0) { fprintf(stderr, "%s: %s\n", backing, strerror(errno)); if (bfd >= 0) close(bfd); return -1; }
+    ovl_head_t bh;
+    int is = head_read(bfd, backing, &bh);
+    close(bfd);
+    if (is < 0) return -1;
+    uint64_t total = is ? bh.total_blocks : (uint64_t)bs.st_size / OVL_BS;
+    if (total == 0) { fprintf(stderr, "%s: image is empty\n", backing); return -1; }
+    uint8_t blk[OVL_BS];
+    memset(blk, 0, sizeof(blk));
+    ovl_head_t *h = (ovl_head_t *)blk;
+    h->magic = OVL_MAGIC;
+    h->version = OVL_VERSION;
+    h->total_blocks = total;
+    char *name = backing_name(path, backing);
+    if (!name) return -1;
+    if (strlen(name) >= OVL_BACKING_MAX) { fprintf(stderr, "Backing image path too long\n"); free(name); return -1; }
+    strcpy(h->backing, name);
+    free(name);
+    h->checksum = crc32(h, offsetof(ovl_head_t, checksum));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) { perror("open overlay"); return -1; }
+    if (fio_write_full(fd, blk, OVL_BS, 0) != 0 || sync_file(fd) != 0) { perror("write overlay"); close(fd); return -1; }
+    if (close(fd) != 0) { perror("close overlay"); return -1; }
+    return 0;
+}
+
+/* Room for `more` runs in the map */
+static int runs_reserve(ovl_layer_t *t, uint64_t more) {
+    if (t->nruns + more <= t->cap) return 0;
+    uint64_t nc = t->cap ? t->cap * 2 : 64;
+    while (nc < t->nruns + more) nc *= 2;
+    ovl_run_t *nr = realloc(t->runs, nc * sizeof(*nr));
+    if (!nr) { errno = ENOMEM; return -1; }
+    t->runs = nr;
+    t->cap = nc;
+    return 0;
+}
+
+uint64_t ovl_place(void *ovl, uint64_t vblk, const uint8_t *buf, uint64_t n, uint64_t *len) {
+    ovl_t *o = ovl;
+    ovl_layer_t *t = &o->layers[o->depth];
+    if (vblk > o->len / OVL_BS || n > o->len / OVL_BS - vblk) { errno = EINVAL; return UINT64_MAX; }
+    /* before the map changes, so a failure leaves it as it was; the caller places the rest of the n next */
+    if (ovl_private(o, vblk, n) != 0) return UINT64_MAX;
+    /* the first run that ends past vblk */
+    uint64_t lo = 0, hi = t->nruns, fblk;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (t->runs[mid].vblk + t->runs[mid].len <= vblk) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < t->nruns && t->runs[lo].vblk <= vblk && t->runs[lo].fblk + (vblk - t->runs[lo].vblk) >= o->committed) {
+        /* placed since the last commit: rewrite in place */
+        uint64_t k = vblk - t->runs[lo].vblk;
+        *len = n < t->runs[lo].len - k ? n : t->runs[lo].len - k;
+        fblk = t->runs[lo].fblk + k;
+    } else if (lo < t->nruns && t->runs[lo].vblk <= vblk) {
+        /* committed: the header still points at these, so write new copies at the end and split the run around them */
+        ovl_run_t r = t->runs[lo];
+        uint64_t k = vblk - r.vblk, old = r.len - k;
+        if (old > o->committed - (r.fblk + k)) old = o->committed - (r.fblk + k);
+        *len = n < old ? n : old;
+        if (runs_reserve(t, 2) != 0) return UINT64_MAX;
+        fblk = o->next;
+        o->next += *len;
+        ovl_run_t piece[3];
+        int np = 0;
+        if (k > 0) piece[np++] = (ovl_run_t){ r.vblk, r.fblk, k };
+        uint64_t mid = lo + (uint64_t)np;
+        piece[np++] = (ovl_run_t){ vblk, fblk, *len };
+        if (k + *len < r.len) piece[np++] = (ovl_run_t){ vblk + *len, r.fblk + k + *len, r.len - k - *len };
+        memmove(&t->runs[lo + np], &t->runs[lo + 1], (t->nruns - lo - 1) * sizeof(*t->runs));
+        memcpy(&t->runs[lo], piece, (size_t)np * sizeof(*piece));
+        t->nruns += (uint64_t)np - 1;
+        ovl_run_t *prev = mid > 0 ? &t->runs[mid - 1] : NULL;
+        if (prev && prev->vblk + prev->len == vblk && prev->fblk + prev->len == fblk) {
+            prev->len += *len;
+            memmove(&t->runs[mid], &t->runs[mid + 1], (t->nruns - mid - 1) * sizeof(*t->runs));
+            t->nruns--;
+        }
+        o->dirty = 1;
+    } else {
+        uint64_t gap = lo < t->nruns ? t->runs[lo].vblk - vblk : n;
+        *len = n < gap ? n : gap;
+        fblk = o->next;
+        o->next += *len;
+        ovl_run_t *prev = lo > 0 ? &t->runs[lo - 1] : NULL;
+        if (prev && prev->vblk + prev->len == vblk && prev->fblk + prev->len == fblk) {
+            prev->len += *len;
+        } else {
+            if (runs_reserve(t, 1) != 0) return UINT64_MAX;
+            memmove(&t->runs[lo + 1], &t->runs[lo], (t->nruns - lo) * sizeof(*t->runs));
+            t->runs[lo] = (ovl_run_t){ vblk, fblk, *len };
+            t->nruns++;
+        }
+        o->dirty = 1;
+    }
+    memcpy(o->view + vblk * OVL_BS, buf, *len * OVL_BS);
+    return fblk;
+}
+
+int ovl_commit(ovl_t *o) {
+    if (!o->writable || !o->dirty) return 0;
+    ovl_layer_t *t = &o->layers[o->depth];
+    size_t bytes = (size_t)t->nruns * sizeof(ovl_run_t);
+    uint64_t blocks = div_up(bytes, OVL_BS), start = 0;
+    if (blocks > 0) {
+        /* never over the map the header still points at */
+        if (blocks <= o->spare_blocks) {
+            start = o->spare_start;
+        } else {
+            start = o->next;
+            o->next += blocks;
+        }
+        uint8_t *map = calloc(blocks, OVL_BS);
+        if (!map) { perror("malloc overlay map"); return -1; }
+        memcpy(map, t->runs, bytes);
+        int rc = fio_write_full(t->fd, map, blocks * OVL_BS, (off_t)(start * OVL_BS));
+        free(map);
+        if (rc != 0) { perror("write overlay map"); return -1; }
+    }
+    /* the blocks and the map are durable before the header points at them */
+    if (sync_file(t->fd) != 0) { perror("fsync overlay"); return -1; }
+
+    uint8_t blk[OVL_BS];
+    memset(blk, 0, sizeof(blk));
+    o->head.map_start = start;
+    o->head.nruns = t->nruns;
+    o->head.map_crc = crc32(t->runs, bytes);
+    o->head.checksum = crc32(&o->head, offsetof(ovl_head_t, checksum));
+    memcpy(blk, &o->head, sizeof(o->head));
+    if (fio_write_full(t->fd, blk, OVL_BS, 0) != 0 || sync_file(t->fd) != 0) { perror("write overlay header"); return -1; }
+    o->spare_start = o->live_start;
+    o->spare_blocks = o->live_blocks;
+    o->live_start = start;
+    o->live_blocks = blocks;
+    o->committed = o->next;
+    o->dirty = 0;
+    return 0;
+}
@@ -0,0 +1,122 @@
+#ifndef MVFS_OVERLAY_H
+#define MVFS_OVERLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Copy-on-write overlay images. An overlay file holds only the blocks that
+ * differ from its backing image, which may itself be an overlay; reading
+ * a block walks the chain down to the first image that has it. Block 0 of
+ * the overlay file is an ovl_head_t, stored blocks follow in the order
+ * they were first written, and a map of ovl_run_t (sorted by image block)
+ * sits at map_start. The header is rewritten last on every commit, after
+ * the blocks and the new map are durable, so a crash leaves the overlay
+ * as of its previous commit. Committed blocks are never written again: a
+ * new version of one goes to the end of the file and its run is remapped.
+ *
+ * The backing path is taken relative to the overlay's directory unless it
+ * is absolute.
+ */
+#define OVL_MAGIC 0x564F564Du    /* "MVOV" */
+#define OVL_VERSION 1u
+#define OVL_BS 4096u
+#define OVL_BACKING_MAX 1024u
+#define OVL_MAX_DEPTH 64
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t total_blocks;       /* size of the image the chain describes */
+    uint64_t map_start;          /* first block of the run map, 0 while it is empty */
+    uint64_t nruns;
+    uint32_t map_crc;            /* crc32 of the nruns entries */
+    char backing[OVL_BACKING_MAX];
+    uint32_t checksum;           /* crc32 of the bytes before it */
+} ovl_head_t;
+
+/* Image blocks [vblk, vblk + len) are stored at overlay file blocks [fblk, fblk + len) */
+typedef struct {
+    uint64_t vblk;
+    uint64_t fblk;
+    uint64_t len;
+} ovl_run_t;
+#pragma pack(pop)
+_Static_assert(sizeof(ovl_head_t) <= OVL_BS, "overlay header must fit a block");
+
+typedef struct {
+    char *path;
+    int fd;
+    ovl_run_t *runs;
+    uint64_t nruns, cap;
+} ovl_layer_t;
+
+/* View blocks [vblk, vblk + len) are private copies */
+typedef struct {
+    uint64_t vblk;
+    uint64_t len;
+} ovl_span_t;
+
+/*
+ * An open chain. `view` maps the whole image as the chain reads it: the
+ * base image mapped shared and read-only, so reading it costs no memory
+ * beyond the page cache however large it is, with every block the chain
+ * changes remapped as a private, writable copy (`priv`, sorted) holding
+ * the overlays' contents, bottom first. Only those blocks take memory.
+ * layers[0] is the base image (no runs), layers[depth] the top overlay.
+ */
+typedef struct {
+    uint8_t *view;
+    size_t len;
+    int depth;                   /* overlays above the base; 0 for a plain image */
+    ovl_layer_t layers[OVL_MAX_DEPTH + 1];
+    ovl_span_t *priv;
+    uint64_t npriv, priv_cap;
+
+    /* writable top overlay */
+    ovl_head_t head;
+    int writable;
+    int dirty;                   /* placed blocks or a new map not yet committed */
+    uint64_t next;               /* next free overlay file block */
+    uint64_t committed;          /* file blocks below this belong to the last commit */
+    uint64_t live_start, live_blocks;   /* map the header points at */
+    uint64_t spare_start, spare_blocks; /* the map before it, free for the next one */
+} ovl_t;
+
+/* Whether a file's first block is an overlay header */
+int ovl_is_overlay(const uint8_t *blk0);
+
+/*
+ * Open an image or overlay chain; `writable` opens the top overlay for
+ * ovl_place()/ovl_commit() (and needs one). NULL, with a message on
+ * stderr, on failure.
+ */
+ovl_t *ovl_open(const char *path, int writable);
+
+/* Create an empty overlay at `path` over the image or overlay `backing`; 0, or -1 with a message */
+int ovl_create(const char *path, const char *backing);
+
+/*
+ * Make view blocks [vblk, vblk + n) writable, as private copies of what
+ * they hold now; blocks that already are keep their contents. Nothing is
+ * written to any file. A mvfs_journal_apply() hook. 0, or -1 with errno.
+ */
+int ovl_private(void *ovl, uint64_t vblk, uint64_t n);
+
+/*
+ * Where image blocks [vblk, vblk + n) go in the top overlay: returns the
+ * file block of the first *len of them, and copies their new contents
+ * (buf) into the view. Blocks placed since the last commit are rewritten
+ * where they are; blocks the overlay does not hold yet, or holds from an
+ * earlier commit, get new blocks at its end. A blkio remap hook.
+ * UINT64_MAX if out of memory.
+ */
+uint64_t ovl_place(void *ovl, uint64_t vblk, const uint8_t *buf, uint64_t n, uint64_t *len);
+
+/* Make placed blocks part of the overlay: write the map, then the header, each made durable; 0 or -1 */
+int ovl_commit(ovl_t *o);
+
+void ovl_close(ovl_t *o);
+
+#endif
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+stats_t stats;
+
+static const char *const phase_name[PH_COUNT] = {
+    "arg_parse", "image_copy", "open", "bitmap_read", "allocation", "data_write", "metadata_write", "flush"
+};
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* rchar, wchar, syscr and syscw of this process; -1 where the kernel does not say */
+static void proc_io(int64_t v[4]) {
+    static const char *const key[4] = { "rchar:", "wchar:", "syscr:", "syscw:" };
+    for (int i = 0; i < 4; ++i) v[i] = -1;
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) return;
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        for (int i = 0; i < 4; ++i) {
+            size_t n = strlen(key[i]);
+            if (strncmp(line, key[i], n) == 0) sscanf(line + n, "%" SCNd64, &v[i]);
+        }
+    }
+    fclose(f);
+}
+
+void stats_start(uint64_t t0) {
+    proc_io(stats.io0);
+    stats.on = 1;
+    stats.phase = PH_ARGS;
+    stats.mark = t0;
+}
+
+int stats_enter(int phase) {
+    int prev = stats.phase;
+    if (!stats.on) return prev;
+    uint64_t now = stats_now();
+    stats.ns[stats.phase] += now - stats.mark;
+    stats.mark = now;
+    stats.phase = phase;
+    return prev;
+}
+
+void stats_print(FILE *f, const char *tool, int json) {
+    stats_enter(stats.phase);
+    int64_t io[4];
+    proc_io(io);
+    int64_t d[4];
+    for (int i = 0; i < 4; ++i) d[i] = io[i] < 0 || stats.io0[i] < 0 ? -1 : io[i] - stats.io0[i];
+    /* io_uring writes and stores into a mapped image bypass the kernel's read/write accounting */
+    int64_t written = d[1] < 0 ? -1 : d[1] + (int64_t)stats.uring_bytes + (int64_t)stats.mmap_bytes;
+    uint64_t total = 0;
+    for (int p = 0; p < PH_COUNT; ++p) total += stats.ns[p];
+
+    if (json) {
+        fprintf(f, "{\"tool\":\"%s\",\"phases_ms\":{", tool);
+        for (int p = 0; p < PH_COUNT; ++p) fprintf(f, "%s\"%s\":%.3f", p ? "," : "", phase_name[p], stats.ns[p] / 1e6);
+        fprintf(f, "},\"total_ms\":%.3f", total / 1e6);
+        if (d[0] >= 0) fprintf(f, ",\"bytes_read\":%" PRId64, d[0]); else fprintf(f, ",\"bytes_read\":null");
+        if (written >= 0) fprintf(f, ",\"bytes_written\":%" PRId64, written); else fprintf(f, ",\"bytes_written\":null");
+        fprintf(f, ",\"syscalls\":{");
+        if (d[2] >= 0) fprintf(f, "\"read\":%" PRId64 ",\"write\":%" PRId64 ",", d[2], d[3]);
+        else fprintf(f, "\"read\":null,\"write\":null,");
+        fprintf(f, "\"sync\":%" PRIu64 ",\"io_uring_enter\":%" PRIu64 "}", stats.syncs, stats.uring_submits);
+        fprintf(f, ",\"bitmap_bits_scanned\":%" PRIu64 "}\n", stats.bits_scanned);
+        return;
+    }
+
+    fprintf(f, "%s stats:\n", tool);
+    for (int p = 0; p < PH_COUNT; ++p) fprintf(f, "  %-16s %10.3f ms\n", phase_name[p], stats.ns[p] / 1e6);
+    fprintf(f, "  %-16s %10.3f ms\n", "total", total / 1e6);
+    if (d[0] >= 0) fprintf(f, "  bytes read: %" PRId64 ", written: %" PRId64 "\n", d[0], written);
+    else fprintf(f, "  bytes read/written: unavailable (no /proc/self/io)\n");
+    if (d[2] >= 0) fprintf(f, "  syscalls: %" PRId64 " read, %" PRId64 " write, ", d[2], d[3]);
+    else fprintf(f, "  syscalls: ");
+    fprintf(f, "%" PRIu64 " sync, %" PRIu64 " io_uring_enter\n", stats.syncs, stats.uring_submits);
+    fprintf(f, "  bitmap bits scanned: %" PRIu64 "\n", stats.bits_scanned);
+}
@@ -0,0 +1,54 @@
+#ifndef MVFS_STATS_H
+#define MVFS_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Process-wide instrumentation for --stats: wall time per phase plus I/O
+ * counters. Time is charged to the current phase and moves on with
+ * stats_enter(), which does nothing until stats_start() has been called.
+ * Read/write syscalls and their bytes come from the kernel's accounting
+ * (/proc/self/io); the counters below cover what it leaves out. Not
+ * thread-safe: only the single-threaded write paths use it.
+ */
+enum stats_phase {
+    PH_ARGS,          /* argument parsing and validation */
+    PH_COPY,          /* cloning the input image, or creating the overlay */
+    PH_OPEN,          /* opening the image: superblock, journal replay */
+    PH_BITMAP_READ,   /* loading group descriptors and bitmaps */
+    PH_ALLOC,         /* planning: layout, lookups, inode and block allocation */
+    PH_DATA_WRITE,    /* reading, compressing and writing file data */
+    PH_META_WRITE,    /* building and queueing metadata blocks */
+    PH_FLUSH,         /* submitting queued writes and making them durable */
+    PH_COUNT
+};
+
+typedef struct {
+    int on;
+    int phase;
+    uint64_t mark;               /* when the current phase was entered */
+    uint64_t ns[PH_COUNT];
+    uint64_t syncs;              /* fsync/fdatasync calls */
+    uint64_t uring_submits;      /* io_uring_enter calls */
+    uint64_t uring_bytes;        /* bytes written through io_uring */
+    uint64_t mmap_bytes;         /* bytes copied into a mapped image (--io=mmap) */
+    uint64_t bits_scanned;       /* bitmap bits read by searches and summaries */
+    int64_t io0[4];              /* /proc/self/io rchar, wchar, syscr, syscw at stats_start() */
+} stats_t;
+
+extern stats_t stats;
+
+/* Monotonic clock in nanoseconds */
+uint64_t stats_now(void);
+
+/* Start accounting; the time since `t0` (a stats_now() value) counts as argument parsing */
+void stats_start(uint64_t t0);
+
+/* Charge the time since the last switch to the current phase and enter `phase`; returns the previous phase */
+int stats_enter(int phase);
+
+/* Close the current phase and print everything, as text or as one JSON object */
+void stats_print(FILE *f, const char *tool, int json);
+
+#endif
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Removing and truncating multi-MB files on a journaled dedup image.
+#
+# A removal may change only so many dedup index blocks per journal
+# transaction. Blocks without an index entry must not count against that,
+# and a removal that needs more goes in several transactions. A small
+# journal and a root directory grown by many adds make the second case
+# happen with a few MB of data.
+#
+#   make check
+#   sh tests/dedup_remove.sh
+#
+# BIN overrides the directory holding the tools.
+
+set -eu
+
+BIN=${BIN:-.}
+abspath() { (cd "$1" && pwd); }
+BIN=$(abspath "$BIN")
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+fail() { echo "FAIL: $*" >&2; exit 1; }
+
+head -c 3000000 /dev/urandom > plain.bin
+head -c 2000000 /dev/urandom > a.bin
+cp a.bin b.bin
+head -c 5000 b.bin > b.head
+
+# default journal: a file added without --dedup, and a deduplicated pair
+"$BIN/mkfs_builder" --image d.img --size-kib 204800 --inodes 256 --journal --dedup >/dev/null
+printf 'plain.bin\n' > list
+"$BIN/mkfs_adder" --input d.img --in-place --manifest list >/dev/null || fail "add"
+printf 'a.bin\nb.bin\n' > list
+"$BIN/mkfs_adder" --input d.img --in-place --dedup --manifest list >/dev/null || fail "add --dedup"
+"$BIN/mkfs_remover" --image d.img --remove plain.bin >/dev/null || fail "remove an unshared file"
+"$BIN/mkfs_remover" --image d.img --remove a.bin >/dev/null || fail "remove a shared file"
+"$BIN/mkfs_checker" --image d.img >/dev/null || fail "checker after removal"
+"$BIN/mkfs_reader" --image d.img --cat b.bin | cmp -s - b.bin || fail "the other copy after removal"
+
+# small journal, large root: the removal no longer fits one transaction
+"$BIN/mkfs_builder" --image s.img --size-kib 204800 --inodes 2048 --journal=64 --dedup >/dev/null
+printf 'a.bin\nb.bin\n' > list
+"$BIN/mkfs_adder" --input s.img --in-place --dedup --manifest list >/dev/null || fail "add --dedup, small journal"
+: > list
+i=0
+while [ "$i" -lt 700 ]; do
+    echo "$i" > "f$i"
+    echo "f$i" >> list
+    i=$((i + 1))
+done
+"$BIN/mkfs_adder" --input s.img --in-place --manifest list >/dev/null || fail "add many files"
+"$BIN/mkfs_remover" --image s.img --remove a.bin --truncate b.bin=5000 >/dev/null || fail "remove and truncate in steps"
+"$BIN/mkfs_checker" --image s.img >/dev/null || fail "checker after removal in steps"
+"$BIN/mkfs_reader" --image s.img --cat b.bin | cmp -s - b.head || fail "truncated file"
+
+echo "dedup remove: ok"
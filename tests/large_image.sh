@@ -0,0 +1,57 @@
+#!/bin/sh
+# Every tool against a sparse image larger than RAM and swap together.
+#
+# The image is mapped whole by the checker, reader, compactor and overlay
+# code, and by mkfs_adder --io=mmap, so it must open without the kernel
+# charging its size as memory. Builds a journaled --sparse image a GiB
+# past MemTotal + SwapTotal, adds files in place (once through a mapping),
+# and checks, lists, reads back, compacts and overlays it.
+#
+#   make check
+#   sh tests/large_image.sh
+#
+# BIN overrides the directory holding the tools, SIZE_KIB the image size.
+
+set -eu
+
+BIN=${BIN:-.}
+abspath() { (cd "$1" && pwd); }
+BIN=$(abspath "$BIN")
+
+mem_kib=$(awk '/^(MemTotal|SwapTotal):/ { s += $2 } END { print s }' /proc/meminfo)
+SIZE_KIB=${SIZE_KIB:-$(( (mem_kib + 1048576) / 4 * 4 ))}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+fail() { echo "FAIL: $*" >&2; exit 1; }
+
+seq 1 20000 > a.txt
+printf 'falcon yankee narwhal\n' > b.txt
+seq 7 9000 > c.txt
+seq 40 4000 > d.txt
+
+echo "image: $SIZE_KIB KiB (RAM + swap: $mem_kib KiB)"
+"$BIN/mkfs_builder" --image big.img --size-kib "$SIZE_KIB" --inodes 4096 --sparse --journal >/dev/null
+printf 'a.txt\nb.txt\n' > list
+"$BIN/mkfs_adder" --input big.img --in-place --manifest list >/dev/null || fail "adder --in-place"
+
+"$BIN/mkfs_checker" --image big.img >/dev/null || fail "checker"
+[ "$("$BIN/mkfs_reader" --image big.img --ls | wc -l)" -eq 2 ] || fail "reader --ls"
+"$BIN/mkfs_reader" --image big.img --cat a.txt | cmp -s - a.txt || fail "reader --cat"
+"$BIN/mkfs_adder" --input big.img --in-place --file d.txt --io=mmap >/dev/null || fail "adder --io=mmap"
+"$BIN/mkfs_checker" --image big.img >/dev/null || fail "checker after --io=mmap"
+"$BIN/mkfs_reader" --image big.img --cat d.txt | cmp -s - d.txt || fail "reader --cat after --io=mmap"
+
+"$BIN/mkfs_adder" --input big.img --output top.img --overlay --file c.txt >/dev/null || fail "adder --overlay"
+"$BIN/mkfs_checker" --image top.img >/dev/null || fail "checker through an overlay"
+"$BIN/mkfs_reader" --image top.img --cat c.txt | cmp -s - c.txt || fail "reader --cat through an overlay"
+"$BIN/mkfs_flattener" --image top.img --output flat.img >/dev/null || fail "flattener"
+"$BIN/mkfs_checker" --image flat.img >/dev/null || fail "checker on the flattened image"
+
+"$BIN/mkfs_compactor" --image flat.img --output small.img --shrink >/dev/null || fail "compactor"
+"$BIN/mkfs_checker" --image small.img >/dev/null || fail "checker on the compacted image"
+"$BIN/mkfs_reader" --image small.img --cat c.txt | cmp -s - c.txt || fail "reader --cat on the compacted image"
+
+echo "large image: ok"